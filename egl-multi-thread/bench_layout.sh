@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Compare the vertex layouts of the kmscube mesh on the headless build.
+# Every frame draws the mesh many times into a small surface, so vertex
+# fetch rather than fill dominates. Prints the frame rate, the average
+# render time and the vertex bytes fetched per second for every layout.
+#
+# usage: ./bench_layout.sh [seconds per run] [draws per frame]
+
+APP=./egl_multi_layer_headless
+SECONDS_PER_RUN=${1:-3}
+REPEAT=${2:-2000}
+SIZE=64x64
+
+[ -x $APP ] || { echo "build with BUILD_HEADLESS=yes first"; exit 1; }
+
+printf "%12s %10s %10s %12s %12s\n" layout fps render-ms bytes/frame MB/s
+for layout in separate interleaved indexed packed; do
+	$APP --threads 1 --layout $layout --mesh-repeat $REPEAT --size $SIZE \
+		--duration $SECONDS_PER_RUN --stats-interval 0 | awk -v layout=$layout '
+		function field(name) { match($0, name "= *[0-9.]+"); s = substr($0, RSTART, RLENGTH); sub(name "= *", "", s); return s }
+		/bytes fetched per frame/ { match($0, "[0-9]+ bytes fetched"); bytes = substr($0, RSTART, RLENGTH - 14) }
+		/^stats \(total/ { total = 1 }
+		total && / render / { match($0, "[0-9.]+/s"); fps = substr($0, RSTART, RLENGTH - 2); ms = field("avg") }
+		END { printf "%12s %10.1f %10.3f %12d %12.1f\n", layout, fps, ms, bytes, bytes * fps / 1e6 }'
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Compare the render scheduling modes of the headless build:
+# one thread per surface, a single render thread and a pool of workers.
+# Prints the total frame rate of all surfaces and the average
+# eglMakeCurrent cost for every surface count.
+#
+# usage: ./bench_sched.sh [seconds per run] [pool workers]
+
+APP=./egl_multi_layer_headless
+SECONDS_PER_RUN=${1:-3}
+WORKERS=${2:-$(nproc)}
+SIZE=256x256
+
+[ -x $APP ] || { echo "build with BUILD_HEADLESS=yes first"; exit 1; }
+
+run() {
+	$APP --threads $1 --workers $2 --size $SIZE --duration $SECONDS_PER_RUN \
+		--stats-interval 0 | awk '
+		function field(name) { match($0, name "= *[0-9.]+"); s = substr($0, RSTART, RLENGTH); sub(name "= *", "", s); return s }
+		/^stats \(total/ { total = 1 }
+		total && / render / { match($0, "[0-9.]+/s"); fps += substr($0, RSTART, RLENGTH - 2) }
+		total && / make-current / { mc += field("avg") * field("n"); n += field("n") }
+		END { printf "%10.1f %10.4f", fps, n ? mc / n : 0 }'
+}
+
+printf "%8s %21s %21s %21s\n" "" "thread per surface" "single thread" "$WORKERS workers"
+printf "%8s %10s %10s %10s %10s %10s %10s\n" surfaces fps mc-ms fps mc-ms fps mc-ms
+for n in 1 2 4 8 16 32 64; do
+	printf "%8d %s %s %s\n" $n "$(run $n 0)" "$(run $n 1)" "$(run $n $WORKERS)"
+done
@@ -2,23 +2,81 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include <libdrm/drm.h>
 #include <libdrm/drm_mode.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #include <gbm/gbm.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include "drm_gbm.h"
+#include "event_loop.h"
+#include "frame_queue.h"
+#include "gl_composite.h"
+#include "startup.h"
+#include "trace.h"
+#ifdef USE_FAKEKMS
+#include "fake_kms.h"
+#endif
+
+#define MAX_CONFIG_PLANES (16)
+#define CONFIG_CACHE_SIZE (16)
+#define MAX_EGL_MODIFIERS (64)
+/* a probe can need one scratch buffer per plane, all at once */
+#define SCRATCH_CACHE_SIZE (MAX_CONFIG_PLANES)
+
+/* the part of a plane's state that needs a TEST_ONLY commit to change */
+struct plane_config {
+	uint32_t plane;
+	uint32_t crtc;
+	uint32_t format;
+	int32_t crtc_x;
+	int32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+	uint32_t src_w;
+	uint32_t src_h;
+};
+
+struct config_key {
+	int count;
+	struct plane_config planes[MAX_CONFIG_PLANES];
+};
+
+/* a buffer for TEST_ONLY commits, shared by every plane that asks for the same */
+struct scratch_fb {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	int count_modifiers;
+	uint64_t modifiers[PLANE_MAX_MODIFIERS];
+	struct gbm_bo *bo;
+	/* the last probe that added it to a request */
+	unsigned int probe;
+};
 
 struct drm_data {
 	int fd;
 	int conn_id;
 	int crtc_id;
+	int crtc_index;
+	int out_fence_property;
+	int mode_id_property;
+	int active_property;
+	int conn_crtc_id_property;
+	uint32_t mode_blob_id;
+	int modeset_done;
 	int width;
 	int height;
+	unsigned long long vblank_nsec;
 
 	int count_planes;
 	struct plane_data *pdata;
@@ -26,12 +84,86 @@ struct drm_data {
 	int nonprimary_planes;
 
 	struct gbm_device *gbm_dev;
+
+	/* what EGL can import, for the last format asked about */
+	uint32_t egl_modifiers_format;
+	int count_egl_modifiers;
+	uint64_t egl_modifiers[MAX_EGL_MODIFIERS];
+
+	enum latch_mode latch_mode;
+	int flip_pending;
+	int monotonic_timestamps;	/* flip events carry CLOCK_MONOTONIC times */
+	unsigned int last_vblank;	/* sequence of the last flip event */
+	unsigned long flips;
+	unsigned long vblanks_skipped;	/* without a flip between two flips */
+	unsigned long fence_retires;	/* commits whose buffers went back on the out-fence */
+	unsigned long long commit_nsec;
+	unsigned long long first_commit_nsec;	/* 0 once the first flip is reported */
+
+	int explicit_fencing;
+	int out_fence_fd;	/* of the last commit, until its old buffers retire */
+	struct event_loop *loop;	/* waits for out_fence_fd, if set */
+
+	/* reused for every commit, rewound with drmModeAtomicSetCursor */
+	drmModeAtomicReqPtr req;
+
+	/* plane configurations that already passed a TEST_ONLY commit */
+	struct config_key config_cache[CONFIG_CACHE_SIZE];
+	int config_cache_count;
+	int config_cache_next;
+
+	/* buffers of the plane assignment probes, dropped after the first commit */
+	struct scratch_fb scratch[SCRATCH_CACHE_SIZE];
+	int count_scratch;
+	int scratch_next;
+	unsigned int scratch_probe;
+
+	/* surfaces without a plane, drawn by the GPU into the primary plane */
+	struct gl_composite *composite;
+	int count_composited;
+	struct plane_data composited[MAX_COMPOSITE_LAYERS];
+};
+
+static const struct {
+	const char *name;
+	size_t offset;
+} plane_property_names[] = {
+	{ "FB_ID", offsetof(struct plane_properties, fb_id) },
+	{ "CRTC_ID", offsetof(struct plane_properties, crtc_id) },
+	{ "SRC_X", offsetof(struct plane_properties, src_x) },
+	{ "SRC_Y", offsetof(struct plane_properties, src_y) },
+	{ "SRC_W", offsetof(struct plane_properties, src_w) },
+	{ "SRC_H", offsetof(struct plane_properties, src_h) },
+	{ "CRTC_X", offsetof(struct plane_properties, crtc_x) },
+	{ "CRTC_Y", offsetof(struct plane_properties, crtc_y) },
+	{ "CRTC_W", offsetof(struct plane_properties, crtc_w) },
+	{ "CRTC_H", offsetof(struct plane_properties, crtc_h) },
+	{ "IN_FENCE_FD", offsetof(struct plane_properties, in_fence_fd) },
+	{ "zorder", offsetof(struct plane_properties, zpos) },
+	{ "zpos", offsetof(struct plane_properties, zpos) },
+	{ "FB_DAMAGE_CLIPS", offsetof(struct plane_properties, fb_damage_clips) },
 };
 
+static uint32_t find_property(int fd, uint32_t object_id, uint32_t object_type, const char *name)
+{
+	drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, object_id, object_type);
+	uint32_t prop_id = 0;
+	int count;
+
+	for(count = 0; props && count < props->count_props; count++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[count]);
+		if(strcmp(prop->name, name) == 0)
+			prop_id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return prop_id;
+}
+
 struct drm_fb {
 	struct gbm_bo *bo;
 	uint32_t fb_id;
-	int dmabuf_fd;
 	int fd;
 };
 
@@ -39,7 +171,6 @@ static void
 drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 {
 	struct drm_fb *fb = data;
-	struct gbm_device *gbm = gbm_bo_get_device(bo);
 
 	if (fb->fb_id)
 		drmModeRmFB(fb->fd, fb->fb_id);
@@ -50,8 +181,10 @@ drm_fb_destroy_callback(struct gbm_bo *bo, void *data)
 static struct drm_fb * drm_fb_get_from_bo(int fd, struct gbm_bo *bo)
 {
 	struct drm_fb *fb = gbm_bo_get_user_data(bo);
-	uint32_t width, height, stride, handle;
-	int ret;
+	uint32_t width, height, format;
+	uint32_t handles[4] = { 0 }, strides[4] = { 0 }, offsets[4] = { 0 };
+	uint64_t modifier, modifiers[4] = { 0 };
+	int count, ret;
 
 	if (fb)
 		return fb;
@@ -62,35 +195,67 @@ static struct drm_fb * drm_fb_get_from_bo(int fd, struct gbm_bo *bo)
 
 	width = gbm_bo_get_width(bo);
 	height = gbm_bo_get_height(bo);
-	stride = gbm_bo_get_stride(bo);
-	handle = gbm_bo_get_handle(bo).u32;
+	format = gbm_bo_get_format(bo);
+	modifier = gbm_bo_get_modifier(bo);
+
+	/* compressed layouts keep their metadata in planes of their own */
+	for(count = 0; count < gbm_bo_get_plane_count(bo) && count < 4; count++) {
+		handles[count] = gbm_bo_get_handle_for_plane(bo, count).u32;
+		strides[count] = gbm_bo_get_stride_for_plane(bo, count);
+		offsets[count] = gbm_bo_get_offset(bo, count);
+		modifiers[count] = modifier;
+	}
 
-	ret = drmModeAddFB(fd, width, height, 32, 32, stride, handle, &fb->fb_id);
+	/* without an explicit modifier the kernel asks the driver for the layout */
+	if(modifier != DRM_FORMAT_MOD_INVALID)
+		ret = drmModeAddFB2WithModifiers(fd, width, height, format, handles, strides,
+				offsets, modifiers, &fb->fb_id, DRM_MODE_FB_MODIFIERS);
+	else
+		ret = drmModeAddFB2(fd, width, height, format, handles, strides,
+				offsets, &fb->fb_id, 0);
 	if (ret) {
 		free(fb);
 		return NULL;
 	}
 
-	fb->dmabuf_fd = gbm_bo_get_fd(bo);
-
 	gbm_bo_set_user_data(bo, fb, drm_fb_destroy_callback);
 
 	return fb;
 }
 
-static void page_flip_handler(int fd, unsigned int frame,
-			      unsigned int sec, unsigned int usec,
-			      void *data)
+static struct drm_data *stats_drm;
+
+static void drm_frames_dump(int total)
 {
-	int *flips = data;
-	*flips= *flips - 1;
-}
+	struct drm_data *drm = stats_drm;
+	int count;
 
+	/* the counts only ever grow, every dump shows the totals */
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		char name[32];
+
+		if(!pdata->occupied)
+			continue;
+		snprintf(name, sizeof(name), "plane %d frames", pdata->plane);
+		printf("  %-24s shown=%lu dropped=%lu repeated=%lu\n", name,
+				__atomic_load_n(&pdata->frames_shown, __ATOMIC_RELAXED),
+				__atomic_load_n(&pdata->frames_dropped, __ATOMIC_RELAXED),
+				__atomic_load_n(&pdata->frames_repeated, __ATOMIC_RELAXED));
+	}
+	printf("  %-24s flips=%lu skipped vblanks=%lu\n", "crtc",
+			__atomic_load_n(&drm->flips, __ATOMIC_RELAXED),
+			__atomic_load_n(&drm->vblanks_skipped, __ATOMIC_RELAXED));
+	if(drm->explicit_fencing)
+		printf("  %-24s out-fence retires=%lu\n", "crtc",
+				__atomic_load_n(&drm->fence_retires, __ATOMIC_RELAXED));
+}
 
 struct drm_data *init_drm_gbm (int conn_id) {
 	int ret;
 	int count;
-	struct drm_set_client_cap req;
+	uint64_t cap;
+	unsigned long long t0 = stats_now_nsec();
 
 	struct drm_data *drm = calloc(sizeof(struct drm_data), 1);
 	if(!drm) {
@@ -98,7 +263,11 @@ struct drm_data *init_drm_gbm (int conn_id) {
 		return NULL;
 	}
 
+#ifdef USE_FAKEKMS
+	int fd = fake_kms_open();
+#else
 	int fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
+#endif
 	drm->fd = fd;
 	if(fd < 0) {
 		printf("drm open failed\n");
@@ -110,10 +279,10 @@ struct drm_data *init_drm_gbm (int conn_id) {
 		printf("drm set master failed\n");
 		return NULL;
 	}
+	startup_record(STARTUP_DRM_OPEN, t0);
+	t0 = stats_now_nsec();
 
-	req.capability = DRM_CLIENT_CAP_ATOMIC;
-	req.value = 1;
-	ret = ioctl(fd, DRM_IOCTL_SET_CLIENT_CAP, &req);
+	ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
 	if(ret < 0) {
 		printf("drm set atomic cap failed\n");
 		return NULL;
@@ -127,9 +296,15 @@ struct drm_data *init_drm_gbm (int conn_id) {
 			drmModeConnectorPtr connector = drmModeGetConnector(fd, drm->conn_id);
 			drmModeEncoderPtr encoder = drmModeGetEncoder(fd, connector->encoder_id);
 			drm->crtc_id = encoder->crtc_id;
+			for(drm->crtc_index = 0; drm->crtc_index < res->count_crtcs; drm->crtc_index++)
+				if(res->crtcs[drm->crtc_index] == drm->crtc_id)
+					break;
 			drmModeCrtcPtr crtc = drmModeGetCrtc(fd, encoder->crtc_id);
 			drm->width = crtc->width;
 			drm->height = crtc->height;
+			drm->vblank_nsec = 1000000000ULL /
+				(crtc->mode.vrefresh ? crtc->mode.vrefresh : 60);
+			drmModeCreatePropertyBlob(fd, &crtc->mode, sizeof(crtc->mode), &drm->mode_blob_id);
 			conn_found = 1;
 			break;
 		}
@@ -139,177 +314,1050 @@ struct drm_data *init_drm_gbm (int conn_id) {
 		return NULL;
 	}
 
+	/* otherwise the flip times are not comparable with stats_now_nsec */
+	if(drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap)
+		drm->monotonic_timestamps = 1;
+	else
+		printf("no monotonic flip timestamps, using the event arrival time\n");
+
+	stats_drm = drm;
+	stats_register_dump(drm_frames_dump);
+
+	drm->out_fence_property = find_property(fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+	drm->mode_id_property = find_property(fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+	drm->active_property = find_property(fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+	drm->conn_crtc_id_property = find_property(fd, drm->conn_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+	drm->out_fence_fd = -1;
+
+	drm->req = drmModeAtomicAlloc();
+
 	drm->gbm_dev = gbm_create_device(fd);
 
 	drmModePlaneResPtr planes = drmModeGetPlaneResources(fd);
 	drm->count_planes = planes->count_planes;
 	drm->pdata = calloc(sizeof(struct plane_data), planes->count_planes);
 	for(count = 0; count < planes->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+
+		plane_caps_read(fd, planes->planes[count], res->max_width, res->max_height,
+				&pdata->caps);
+		plane_caps_print(&pdata->caps);
+
+		if(pdata->caps.type == DRM_PLANE_TYPE_PRIMARY) {
+			pdata->primary = 1;
+			drm->primary_planes++;
+		} else {
+			pdata->primary = 0;
+			drm->nonprimary_planes++;
+		}
+
 		drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, planes->planes[count], DRM_MODE_OBJECT_PLANE);
 		int propc;
 		for(propc = 0; propc < props->count_props; propc++) {
 			drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[propc]);
-			if(strcmp(prop->name, "type") == 0) {
-				unsigned long long prop_value = props->prop_values[propc];
-				if(prop_value) {
-					drm->pdata[count].primary = 1;
-					drm->primary_planes++;
-				} else {
-					drm->pdata[count].primary = 0;
-					drm->nonprimary_planes++;
-				}
+			int namec;
+			for(namec = 0; namec < sizeof(plane_property_names) / sizeof(plane_property_names[0]); namec++) {
+				if(strcmp(prop->name, plane_property_names[namec].name) == 0)
+					*(uint32_t *)((char *)&pdata->props +
+							plane_property_names[namec].offset) = props->props[propc];
 			}
-			if(strcmp(prop->name, "zorder") == 0) {
-				if(drm->pdata[count].primary) {
-					drm->pdata[count].zorder = drm->primary_planes -1 ;
-				} else {
-					drm->pdata[count].zorder = 4 - drm->nonprimary_planes;
-				}
-				drmModeObjectSetProperty(fd, planes->planes[count],
-						DRM_MODE_OBJECT_PLANE,
-						props->props[propc], drm->pdata[count].zorder);
-			}
-			if(strcmp(prop->name, "FB_ID") == 0)
-				drm->pdata[count].fb_id_property = props->props[propc];
+			drmModeFreeProperty(prop);
 		}
-		drm->pdata[count].plane = planes->planes[count];
-		drm->pdata[count].occupied = 0;
-		drm->pdata[count].gbm_dev = drm->gbm_dev;
-		
+		drmModeFreeObjectProperties(props);
+
+		pdata->zorder = pdata->caps.zpos_min;
+		pdata->in_fence_fd = -1;
+		pdata->plane = planes->planes[count];
+		pdata->occupied = 0;
+		pdata->gbm_dev = drm->gbm_dev;
 	}
+	drmModeFreePlaneResources(planes);
+	startup_record(STARTUP_RESOURCES, t0);
 
 	return drm;
 
 }
 
-struct plane_data *get_new_surface(struct drm_data *drm, int posx, int posy, int width, int height)
+static void add_plane_state(struct drm_data *drm, drmModeAtomicReqPtr req, struct plane_data *pdata)
+{
+	struct plane_properties *props = &pdata->props;
+
+	drmModeAtomicAddProperty(req, pdata->plane, props->crtc_id, drm->crtc_id);
+	/* GL draws from the bottom left, the buffer rows start at the top */
+	drmModeAtomicAddProperty(req, pdata->plane, props->src_x, 0);
+	drmModeAtomicAddProperty(req, pdata->plane, props->src_y,
+			(pdata->height - pdata->src_height) << 16);
+	drmModeAtomicAddProperty(req, pdata->plane, props->src_w, pdata->src_width << 16);
+	drmModeAtomicAddProperty(req, pdata->plane, props->src_h, pdata->src_height << 16);
+	drmModeAtomicAddProperty(req, pdata->plane, props->crtc_x, pdata->posx);
+	drmModeAtomicAddProperty(req, pdata->plane, props->crtc_y, pdata->posy);
+	drmModeAtomicAddProperty(req, pdata->plane, props->crtc_w, pdata->width);
+	drmModeAtomicAddProperty(req, pdata->plane, props->crtc_h, pdata->height);
+	if(props->zpos && !pdata->caps.zpos_immutable)
+		drmModeAtomicAddProperty(req, pdata->plane, props->zpos, pdata->zorder);
+}
+
+/*
+ * A framebuffer of the size, format and layout of pdata's buffers. The one
+ * on screen if there is one, otherwise a scratch buffer that is allocated
+ * once and kept for the next probe that needs the same. Buffers already in
+ * the request of the current probe are never evicted.
+ */
+static struct drm_fb *scratch_fb_get(struct drm_data *drm, struct plane_data *pdata)
 {
+	struct scratch_fb *scratch;
+	struct gbm_bo *bo;
 	int count;
 
-	if(posx < 0 || posx + width > drm->width || posy < 0 || posy + height > drm->height) {
-		printf("surface dimensions exceed crtc dimensions\n");
+	if(pdata->current_bo)
+		return drm_fb_get_from_bo(drm->fd, pdata->current_bo);
+
+	for(count = 0; count < drm->count_scratch; count++) {
+		scratch = &drm->scratch[count];
+		if(scratch->width == pdata->width && scratch->height == pdata->height &&
+				scratch->format == pdata->format &&
+				scratch->count_modifiers == pdata->count_modifiers &&
+				memcmp(scratch->modifiers, pdata->modifiers,
+					sizeof(pdata->modifiers[0]) * pdata->count_modifiers) == 0) {
+			scratch->probe = drm->scratch_probe;
+			return drm_fb_get_from_bo(drm->fd, scratch->bo);
+		}
+	}
+
+	if(pdata->count_modifiers)
+		bo = gbm_bo_create_with_modifiers(drm->gbm_dev,
+				pdata->width, pdata->height, pdata->format,
+				pdata->modifiers, pdata->count_modifiers);
+	else
+		bo = gbm_bo_create(drm->gbm_dev, pdata->width, pdata->height,
+				pdata->format, GBM_BO_USE_SCANOUT);
+	if(!bo)
 		return NULL;
+
+	/* full, the oldest one that this probe does not use goes */
+	if(drm->count_scratch == SCRATCH_CACHE_SIZE) {
+		while(drm->scratch[drm->scratch_next].probe == drm->scratch_probe)
+			drm->scratch_next = (drm->scratch_next + 1) % SCRATCH_CACHE_SIZE;
+		scratch = &drm->scratch[drm->scratch_next];
+		gbm_bo_destroy(scratch->bo);
+	} else {
+		scratch = &drm->scratch[drm->scratch_next];
+		drm->count_scratch++;
+	}
+	drm->scratch_next = (drm->scratch_next + 1) % SCRATCH_CACHE_SIZE;
+
+	scratch->width = pdata->width;
+	scratch->height = pdata->height;
+	scratch->format = pdata->format;
+	scratch->count_modifiers = pdata->count_modifiers;
+	memcpy(scratch->modifiers, pdata->modifiers,
+			sizeof(pdata->modifiers[0]) * pdata->count_modifiers);
+	scratch->bo = bo;
+	scratch->probe = drm->scratch_probe;
+
+	return drm_fb_get_from_bo(drm->fd, bo);
+}
+
+static void scratch_fb_drop_all(struct drm_data *drm)
+{
+	while(drm->count_scratch--)
+		gbm_bo_destroy(drm->scratch[drm->count_scratch].bo);
+	drm->count_scratch = 0;
+	drm->scratch_next = 0;
+}
+
+/*
+ * TEST_ONLY commit of every occupied plane plus the candidate, each with a
+ * buffer of its size and format, so a plane is only handed out if the
+ * display controller can really show it next to the others.
+ */
+static int test_assignment(struct drm_data *drm, struct plane_data *candidate)
+{
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	int count_planes = 0;
+	int count;
+	int ret = 0;
+
+	/* scratch buffers of earlier probes may be evicted from now on */
+	drm->scratch_probe++;
+
+	if(!drm->modeset_done) {
+		drmModeAtomicAddProperty(req, drm->crtc_id, drm->mode_id_property, drm->mode_blob_id);
+		drmModeAtomicAddProperty(req, drm->crtc_id, drm->active_property, 1);
+		drmModeAtomicAddProperty(req, drm->conn_id, drm->conn_crtc_id_property, drm->crtc_id);
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 	}
 
 	for(count = 0; count < drm->count_planes; count++) {
-		if(drm->pdata[count].primary)
+		struct plane_data *pdata = &drm->pdata[count];
+		struct drm_fb *fb;
+
+		if(!pdata->occupied && pdata != candidate)
 			continue;
-		if(drm->pdata[count].occupied)
+		if(count_planes++ == MAX_CONFIG_PLANES) {
+			ret = -1;
+			break;
+		}
+
+		fb = scratch_fb_get(drm, pdata);
+		if(!fb) {
+			ret = -1;
+			break;
+		}
+
+		add_plane_state(drm, req, pdata);
+		drmModeAtomicAddProperty(req, pdata->plane, pdata->props.fb_id, fb->fb_id);
+	}
+
+	if(!ret)
+		ret = drmModeAtomicCommit(drm->fd, req, flags, 0);
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+static int plane_fits(struct drm_data *drm, struct plane_data *pdata,
+		int width, int height, uint32_t format)
+{
+	struct plane_caps *caps = &pdata->caps;
+
+	if(pdata->primary || pdata->occupied)
+		return 0;
+	if(!(caps->possible_crtcs & (1 << drm->crtc_index)))
+		return 0;
+	if(width > caps->max_width || height > caps->max_height)
+		return 0;
+
+	return plane_caps_has_format(caps, format);
+}
+
+static int egl_modifiers(struct drm_data *drm, uint32_t format, const uint64_t **modifiers)
+{
+	PFNEGLQUERYDMABUFMODIFIERSEXTPROC query;
+	const char *extensions = NULL;
+	EGLDisplay display;
+	EGLint major, minor, n = 0;
+
+	*modifiers = drm->egl_modifiers;
+	if(drm->egl_modifiers_format == format)
+		return drm->count_egl_modifiers;
+
+#ifdef USE_FAKEKMS
+	/* the fake buffers are never imported as dma-bufs, leave the layout to GBM */
+	return 0;
+#endif
+
+	/* the display the render threads get as well, initializing it twice is fine */
+	display = eglGetDisplay((EGLNativeDisplayType)drm->gbm_dev);
+	if(eglInitialize(display, &major, &minor))
+		extensions = eglQueryString(display, EGL_EXTENSIONS);
+	query = (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+
+	if(!extensions || !strstr(extensions, "EGL_EXT_image_dma_buf_import_modifiers") || !query ||
+			!query(display, format, MAX_EGL_MODIFIERS, (EGLuint64KHR *)drm->egl_modifiers, NULL, &n))
+		n = 0;
+
+	drm->egl_modifiers_format = format;
+	drm->count_egl_modifiers = n;
+
+	return n;
+}
+
+/*
+ * Modifiers for the buffers of pdata on the plane with caps, or on no
+ * plane (GPU composition) without. Only layouts the plane can scan out
+ * and EGL can import are any use; with none of them the allocation is
+ * left to the driver.
+ */
+static void choose_modifiers(struct drm_data *drm, struct plane_caps *caps, struct plane_data *pdata)
+{
+	uint64_t plane_modifiers[PLANE_MAX_MODIFIERS];
+	const uint64_t *egl;
+	int count_plane = 0, count_egl, i, j;
+
+	pdata->count_modifiers = 0;
+
+	count_egl = egl_modifiers(drm, pdata->format, &egl);
+	if(caps)
+		count_plane = plane_caps_modifiers(caps, pdata->format,
+				plane_modifiers, PLANE_MAX_MODIFIERS);
+
+	for(i = 0; i < count_egl && pdata->count_modifiers < PLANE_MAX_MODIFIERS; i++) {
+		if(egl[i] == DRM_FORMAT_MOD_INVALID)
 			continue;
+		for(j = 0; caps && j < count_plane; j++)
+			if(plane_modifiers[j] == egl[i])
+				break;
+		if(!caps || j < count_plane)
+			pdata->modifiers[pdata->count_modifiers++] = egl[i];
+	}
+}
+
+/* the explicit modifiers if the driver can render to any of them, the driver's choice otherwise */
+static struct gbm_surface *create_surface(struct gbm_device *gbm_dev, struct plane_data *pdata,
+		uint32_t flags)
+{
+	struct gbm_surface *surf = NULL;
+
+	if(pdata->count_modifiers)
+		surf = gbm_surface_create_with_modifiers(gbm_dev, pdata->width, pdata->height,
+				pdata->format, pdata->modifiers, pdata->count_modifiers);
+	if(!surf) {
+		pdata->count_modifiers = 0;
+		surf = gbm_surface_create(gbm_dev, pdata->width, pdata->height,
+				pdata->format, flags);
+	}
+
+	return surf;
+}
+
+void plane_data_report_layout(struct plane_data *pdata, struct gbm_bo *bo)
+{
+	char name[32];
+
+	if(pdata->plane)
+		printf("plane %d:", pdata->plane);
+	else
+		printf("composited surface:");
+	printf(" %dx%d %.4s, modifier %s of %d candidates, %d plane(s)\n",
+			pdata->width, pdata->height, (char *)&pdata->format,
+			plane_modifier_name(gbm_bo_get_modifier(bo), name, sizeof(name)),
+			pdata->count_modifiers, gbm_bo_get_plane_count(bo));
+}
+
+/*
+ * The primary plane is not used for surfaces, so it shows the GPU
+ * composition of everything that did not get a plane of its own.
+ */
+static int setup_composition(struct drm_data *drm, uint32_t format)
+{
+	struct plane_data *pdata = NULL;
+	int count;
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *p = &drm->pdata[count];
+
+		if(!p->primary || p->occupied)
+			continue;
+		if(!(p->caps.possible_crtcs & (1 << drm->crtc_index)))
+			continue;
+		if(!plane_caps_has_format(&p->caps, format))
+			continue;
+		pdata = p;
 		break;
 	}
 
-	if(count == drm->count_planes) {
-		printf("no more planes\n");
+	if(!pdata) {
+		printf("no primary plane for GPU composition\n");
+		return -1;
+	}
+
+	pdata->format = format;
+	choose_modifiers(drm, &pdata->caps, pdata);
+
+	drm->composite = gl_composite_create(drm->gbm_dev, drm->width, drm->height, format,
+			pdata->modifiers, pdata->count_modifiers);
+	if(!drm->composite)
+		return -1;
+
+	pdata->posx = 0;
+	pdata->posy = 0;
+	pdata->width = pdata->src_width = drm->width;
+	pdata->height = pdata->src_height = drm->height;
+	pdata->zorder = pdata->caps.zpos_min;
+
+	if(test_assignment(drm, pdata)) {
+		printf("plane %d rejected for GPU composition\n", pdata->plane);
+		return -1;
+	}
+
+	pdata->gbm_surf = gl_composite_get_surface(drm->composite);
+	pdata->queue = gl_composite_get_queue(drm->composite);
+	pdata->occupied = 1;
+
+	stats_register(&pdata->commit_time, 0,
+			"plane %d commit-flip", pdata->plane);
+	stats_register(&pdata->flip_interval, STATS_VBLANK,
+			"plane %d flip-flip", pdata->plane);
+	stats_register(&pdata->latency, 0,
+			"plane %d render-flip", pdata->plane);
+
+	printf("plane %d composites the surfaces that have no plane\n", pdata->plane);
+
+	return 0;
+}
+
+static struct plane_data *get_composited_surface(struct drm_data *drm,
+		int posx, int posy, int width, int height, uint32_t format)
+{
+	struct plane_data *pdata;
+
+	if(drm->count_composited == MAX_COMPOSITE_LAYERS) {
+		printf("no more surfaces\n");
 		return NULL;
 	}
 
-	drm->pdata[count].gbm_surf = gbm_surface_create(drm->gbm_dev,
-			width, height,
-			GBM_FORMAT_XRGB8888,
-			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-	drm->pdata[count].posx = posx;
-	drm->pdata[count].posy = posy;
-	drm->pdata[count].width = width;
-	drm->pdata[count].height = height;
-	drm->pdata[count].occupied = 1;
+	/* the layers are textures, whatever their format the primary is XRGB */
+	if(!drm->composite && setup_composition(drm, GBM_FORMAT_XRGB8888)) {
+		printf("no plane can show a %dx%d surface\n", width, height);
+		return NULL;
+	}
+
+	pdata = &drm->composited[drm->count_composited];
+	memset(pdata, 0, sizeof(*pdata));
+	pdata->in_fence_fd = -1;
+	pdata->gbm_dev = drm->gbm_dev;
+	pdata->format = format;
+	pdata->posx = posx;
+	pdata->posy = posy;
+	pdata->width = pdata->src_width = width;
+	pdata->height = pdata->src_height = height;
+	choose_modifiers(drm, NULL, pdata);
 
-	return &drm->pdata[count];
+	pdata->gbm_surf = create_surface(drm->gbm_dev, pdata, GBM_BO_USE_RENDERING);
+	if(!pdata->gbm_surf) {
+		printf("composited surface alloc failed\n");
+		return NULL;
+	}
+
+	if(gl_composite_add_layer(drm->composite, pdata))
+		return NULL;
+
+	pdata->occupied = 1;
+	drm->count_composited++;
+
+	return pdata;
 }
 
-int update_all_surfaces(struct drm_data *drm)
+/*
+ * Hand out the cheapest free plane that can show the surface. Planes that
+ * fail the TEST_ONLY commit are skipped and the next cheapest one is tried.
+ * Once no plane is left the surface is composited by the GPU.
+ */
+struct plane_data *get_new_surface(struct drm_data *drm, int posx, int posy, int width, int height,
+		uint32_t format)
 {
-	int count;
-	int ret;
-	static int firsttime = 1;
-	static int flip_pending = 0;
-
-	if(firsttime) {
-		firsttime = 0;
-		for(count = 0; count < drm->count_planes; count++) {	
-			struct plane_data *pdata = &drm->pdata[count];
-			if(drm->pdata[count].occupied == 0)
+	struct plane_data *pdata;
+	char *rejected;
+	int count, best;
+	int stacked = 0;
+	unsigned long long t0 = stats_now_nsec();
+
+	if(posx < 0 || posx + width > drm->width || posy < 0 || posy + height > drm->height) {
+		printf("surface dimensions exceed crtc dimensions\n");
+		return NULL;
+	}
+
+	rejected = calloc(1, drm->count_planes);
+	if(!rejected) {
+		printf("plane allocator alloc failed\n");
+		return NULL;
+	}
+
+	for(count = 0; count < drm->count_planes; count++)
+		if(drm->pdata[count].occupied)
+			stacked++;
+
+	for(;;) {
+		best = -1;
+		for(count = 0; count < drm->count_planes; count++) {
+			if(rejected[count] || !plane_fits(drm, &drm->pdata[count], width, height, format))
 				continue;
-			struct gbm_surface *surf = drm->pdata[count].gbm_surf;
-			struct gbm_bo *bo = gbm_surface_lock_front_buffer(surf);
-			struct drm_fb *fb = drm_fb_get_from_bo(drm->fd, bo);
-
-			ret = drmModeSetPlane(drm->fd,
-					drm->pdata[count].plane,
-					drm->crtc_id,
-					fb->fb_id,
-					0,
-					drm->pdata[count].posx,
-					drm->pdata[count].posy,
-					drm->pdata[count].width,
-					drm->pdata[count].height,
-					0,
-					0,
-					drm->pdata[count].width << 16,
-					drm->pdata[count].height << 16);
+			if(best < 0 || plane_caps_cost(&drm->pdata[count].caps) <
+					plane_caps_cost(&drm->pdata[best].caps))
+				best = count;
 		}
 
+		if(best < 0) {
+			free(rejected);
+			pdata = get_composited_surface(drm, posx, posy, width, height, format);
+			if(pdata)
+				startup_record(STARTUP_GBM_SURFACE, t0);
+			return pdata;
+		}
+
+		pdata = &drm->pdata[best];
+		pdata->format = format;
+		pdata->posx = posx;
+		pdata->posy = posy;
+		pdata->width = pdata->src_width = width;
+		pdata->height = pdata->src_height = height;
+		choose_modifiers(drm, &pdata->caps, pdata);
+
+		/* earlier surfaces stay on top, like the fixed zorder used to do */
+		if(!pdata->caps.zpos_immutable) {
+			pdata->zorder = pdata->caps.zpos_max - stacked;
+			if(pdata->zorder < pdata->caps.zpos_min)
+				pdata->zorder = pdata->caps.zpos_min;
+		}
+
+		if(test_assignment(drm, pdata) == 0)
+			break;
+
+		printf("plane %d rejected for a %dx%d surface\n", pdata->plane, width, height);
+		rejected[best] = 1;
+	}
+	free(rejected);
+
+	pdata->gbm_surf = create_surface(drm->gbm_dev, pdata,
+			GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	if(!pdata->gbm_surf) {
+		printf("plane %d surface alloc failed\n", pdata->plane);
+		return NULL;
+	}
+	pdata->occupied = 1;
+	startup_record(STARTUP_GBM_SURFACE, t0);
+
+	stats_register(&pdata->commit_time, 0,
+			"plane %d commit-flip", pdata->plane);
+	stats_register(&pdata->flip_interval, STATS_VBLANK,
+			"plane %d flip-flip", pdata->plane);
+	stats_register(&pdata->latency, 0,
+			"plane %d render-flip", pdata->plane);
+
+	return pdata;
+}
+
+/*
+ * Full state of the display pipe: CRTC mode and the geometry of every
+ * plane that is or is about to be enabled. The first commit also routes
+ * the connector and sets the mode.
+ */
+static void add_full_state(struct drm_data *drm, drmModeAtomicReqPtr req, struct config_key *key)
+{
+	int count;
+
+	if(!drm->modeset_done) {
+		drmModeAtomicAddProperty(req, drm->crtc_id, drm->mode_id_property, drm->mode_blob_id);
+		drmModeAtomicAddProperty(req, drm->crtc_id, drm->active_property, 1);
+		drmModeAtomicAddProperty(req, drm->conn_id, drm->conn_crtc_id_property, drm->crtc_id);
 	}
 
-	drmModeAtomicReqPtr m_req = drmModeAtomicAlloc();
+	memset(key, 0, sizeof(*key));
 
-	for(count = 0; count < drm->count_planes; count++) {	
+	for(count = 0; count < drm->count_planes; count++) {
 		struct plane_data *pdata = &drm->pdata[count];
+		if(!pdata->enabled && !pdata->pending_bo)
+			continue;
+
+		add_plane_state(drm, req, pdata);
+
+		if(key->count == MAX_CONFIG_PLANES)
+			continue;
+		key->planes[key->count].plane = pdata->plane;
+		key->planes[key->count].crtc = drm->crtc_id;
+		key->planes[key->count].format = pdata->format;
+		key->planes[key->count].crtc_x = pdata->posx;
+		key->planes[key->count].crtc_y = pdata->posy;
+		key->planes[key->count].crtc_w = pdata->width;
+		key->planes[key->count].crtc_h = pdata->height;
+		key->planes[key->count].src_w = pdata->src_width;
+		key->planes[key->count].src_h = pdata->src_height;
+		key->count++;
+	}
+}
+
+static int config_validated(struct drm_data *drm, struct config_key *key)
+{
+	int count;
+
+	for(count = 0; count < drm->config_cache_count; count++)
+		if(memcmp(&drm->config_cache[count], key, sizeof(*key)) == 0)
+			return 1;
+
+	return 0;
+}
+
+static void config_cache_add(struct drm_data *drm, struct config_key *key)
+{
+	memcpy(&drm->config_cache[drm->config_cache_next], key, sizeof(*key));
+	drm->config_cache_next = (drm->config_cache_next + 1) % CONFIG_CACHE_SIZE;
+	if(drm->config_cache_count < CONFIG_CACHE_SIZE)
+		drm->config_cache_count++;
+}
+
+static int wait_for_vblank(struct drm_data *drm)
+{
+	drmVBlank vbl;
+
+	memset(&vbl, 0, sizeof(vbl));
+	vbl.request.type = DRM_VBLANK_RELATIVE;
+	if(drm->crtc_index == 1)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	else if(drm->crtc_index > 1)
+		vbl.request.type |= (drm->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+			DRM_VBLANK_HIGH_CRTC_MASK;
+	vbl.request.sequence = 1;
+
+	return drmWaitVBlank(drm->fd, &vbl);
+}
+
+static unsigned long long elapsed(unsigned long long from, unsigned long long to)
+{
+	return to > from ? to - from : 0;
+}
+
+/* flip_nsec and vblank are the time and sequence of the vblank that latched it */
+static void record_flip(struct drm_data *drm, struct plane_data *pdata,
+		unsigned long long commit_nsec, unsigned long long flip_nsec,
+		unsigned int vblank)
+{
+	stats_record(&pdata->commit_time, elapsed(commit_nsec, flip_nsec));
+	if(pdata->pending_start_nsec)
+		stats_record(&pdata->latency, elapsed(pdata->pending_start_nsec, flip_nsec));
+	if(pdata->last_flip_nsec)
+		stats_record_interval(&pdata->flip_interval,
+				flip_nsec - pdata->last_flip_nsec, drm->vblank_nsec);
+	pdata->last_flip_nsec = flip_nsec;
+
+	/* seqs in between were replaced in the queue and never reached the screen */
+	if(pdata->last_seq && pdata->pending_seq - pdata->last_seq > 1)
+		__atomic_store_n(&pdata->frames_dropped, pdata->frames_dropped +
+				pdata->pending_seq - pdata->last_seq - 1, __ATOMIC_RELAXED);
+	if(pdata->last_vblank && vblank - pdata->last_vblank > 1)
+		__atomic_store_n(&pdata->frames_repeated, pdata->frames_repeated +
+				vblank - pdata->last_vblank - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pdata->frames_shown, pdata->frames_shown + 1, __ATOMIC_RELAXED);
+	pdata->last_seq = pdata->pending_seq;
+	pdata->last_vblank = vblank;
+}
+
+/*
+ * Hand the buffers the last flip replaced back to the render threads,
+ * unless the commit's out-fence still has to say they are off screen.
+ */
+static void release_retired(struct drm_data *drm)
+{
+	int count;
+
+	if(drm->out_fence_fd >= 0)
+		return;
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		if(!pdata->retiring_bo)
+			continue;
+
+		frame_queue_release(pdata->queue, pdata->retiring_bo);
+		pdata->retiring_bo = NULL;
+		frame_queue_signal(pdata->queue);
+	}
+}
+
+/*
+ * With explicit fencing the kernel signals the commit's out-fence once the
+ * new buffers have replaced the old ones on screen, which is the real
+ * retire time of the old buffers. It may signal before or after the flip
+ * event is read, whichever comes second releases them.
+ */
+static void retire_buffers(struct drm_data *drm)
+{
+	if(drm->loop)
+		event_loop_remove_fd(drm->loop, drm->out_fence_fd);
+	close(drm->out_fence_fd);
+	drm->out_fence_fd = -1;
+	__atomic_store_n(&drm->fence_retires, drm->fence_retires + 1, __ATOMIC_RELAXED);
+
+	release_retired(drm);
+}
+
+static int out_fence_cb(int fd, void *data)
+{
+	struct drm_data *drm = data;
+
+	TRACE_BEGIN("retire");
+	retire_buffers(drm);
+	TRACE_END("retire");
+
+	/* render threads may have been waiting for a buffer */
+	return commit_ready_surfaces(drm);
+}
+
+/*
+ * The commit has landed: the pending buffers are on screen now, so their
+ * predecessors can go back to the render threads once they retire.
+ */
+static void page_flip_handler(int fd, unsigned int frame,
+			      unsigned int sec, unsigned int usec,
+			      void *data)
+{
+	struct drm_data *drm = data;
+	unsigned long long flip_nsec = stats_now_nsec();
+	int count;
+
+	TRACE_BEGIN("flip");
+	drm->flip_pending = 0;
+
+	/* when the vblank happened, the event itself comes later */
+	if(drm->monotonic_timestamps && (sec || usec))
+		flip_nsec = sec * 1000000000ULL + usec * 1000ULL;
+
+	if(drm->last_vblank && frame - drm->last_vblank > 1)
+		__atomic_store_n(&drm->vblanks_skipped, drm->vblanks_skipped +
+				frame - drm->last_vblank - 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&drm->flips, drm->flips + 1, __ATOMIC_RELAXED);
+	drm->last_vblank = frame;
+
+	if(drm->first_commit_nsec) {
+		startup_record(STARTUP_FIRST_COMMIT, drm->first_commit_nsec);
+		startup_done("first flip");
+		drm->first_commit_nsec = 0;
+	}
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		if(!pdata->pending_bo)
+			continue;
+
+		record_flip(drm, pdata, drm->commit_nsec, flip_nsec, frame);
+
+		pdata->retiring_bo = pdata->current_bo;
+		pdata->current_bo = pdata->pending_bo;
+		pdata->pending_bo = NULL;
+		frame_queue_signal(pdata->queue);
+	}
+	release_retired(drm);
+	TRACE_END("flip");
+}
+
+static void drop_pending(struct drm_data *drm)
+{
+	int count;
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		if(!pdata->pending_bo)
+			continue;
+		frame_queue_release(pdata->queue, pdata->pending_bo);
+		pdata->pending_bo = NULL;
+		frame_queue_signal(pdata->queue);
+	}
+}
+
+static void close_in_fences(struct drm_data *drm)
+{
+	int count;
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		if(pdata->in_fence_fd < 0)
+			continue;
+		close(pdata->in_fence_fd);
+		pdata->in_fence_fd = -1;
+	}
+}
+
+/*
+ * FB_DAMAGE_CLIPS is only a hint, without it the plane is updated in full.
+ * Returns the blob id, which the caller destroys after the commit.
+ */
+static uint32_t add_damage_clips(struct drm_data *drm, drmModeAtomicReqPtr req,
+		struct plane_data *pdata, struct frame_damage *damage)
+{
+	struct drm_mode_rect clips[FRAME_MAX_DAMAGE];
+	uint32_t blob_id;
+	int count;
+
+	if(!pdata->props.fb_damage_clips || !pdata->enabled)
+		return 0;
+	if(damage->full || !damage->count)
+		return 0;
+
+	for(count = 0; count < damage->count; count++) {
+		clips[count].x1 = damage->rects[count].x1;
+		clips[count].y1 = damage->rects[count].y1;
+		clips[count].x2 = damage->rects[count].x2;
+		clips[count].y2 = damage->rects[count].y2;
+	}
+
+	if(drmModeCreatePropertyBlob(drm->fd, clips, sizeof(clips[0]) * damage->count, &blob_id))
+		return 0;
+
+	drmModeAtomicAddProperty(req, pdata->plane, pdata->props.fb_damage_clips, blob_id);
+
+	return blob_id;
+}
+
+static int frame_ready(struct plane_data *pdata)
+{
+	if(!pdata->queue)
+		return 0;
+
+	return frame_queue_ready(pdata->queue);
+}
+
+/*
+ * Latch the planes that have a new frame and commit them without blocking.
+ *
+ * In LATCH_LOCKSTEP nothing is committed until every plane has a new
+ * frame, so the slowest render thread sets the frame rate of all of them.
+ * In LATCH_MAILBOX every plane that has a new frame is latched and the
+ * others keep scanning out their current buffer.
+ *
+ * current_bo stays locked while it is on screen and is released only once
+ * the flip to its successor (pending_bo) has completed.
+ *
+ * There is no legacy drmModeSetPlane: the first commit is a full atomic
+ * modeset, and a plane's geometry is only sent again when it changes.
+ *
+ * With explicit fencing the render-done fence of every latched frame goes
+ * in as the plane's IN_FENCE_FD, so the commit does not have to wait for
+ * the GPU, and OUT_FENCE_PTR tells when the replaced buffers retire. The
+ * next commit waits for that, as it waits for the flip event.
+ *
+ * The damage a render thread reported for a frame goes in as the plane's
+ * FB_DAMAGE_CLIPS.
+ *
+ * Surfaces without a plane are composited first, the composed frame is
+ * then latched on the primary plane like any other.
+ *
+ * Returns 1 if a flip was queued, 0 if there was nothing to do or a flip
+ * or retire is still pending, -1 on error.
+ */
+int commit_ready_surfaces(struct drm_data *drm)
+{
+	int count;
+	int ret;
+	int occupied = 0, ready = 0, changed = 0;
+	int fenced = 0, reconfigure = 0;
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	drmModeAtomicReqPtr m_req = drm->req;
+	struct config_key key;
+	uint32_t damage_blobs[MAX_CONFIG_PLANES];
+	int count_blobs = 0;
+
+	if(drm->flip_pending || drm->out_fence_fd >= 0)
+		return 0;
+
+	if(drm->composite)
+		gl_composite_update(drm->composite, drm->latch_mode == LATCH_LOCKSTEP);
+
+	for(count = 0; count < drm->count_planes; count++) {
 		if(drm->pdata[count].occupied == 0)
 			continue;
-		struct gbm_surface *surf = drm->pdata[count].gbm_surf;
-		struct gbm_bo *bo = gbm_surface_lock_front_buffer(surf);
-		struct drm_fb *fb = drm_fb_get_from_bo(drm->fd, bo);
+		occupied++;
+		if(frame_ready(&drm->pdata[count]))
+			ready++;
+	}
+
+	if(!ready)
+		return 0;
+	if(drm->latch_mode == LATCH_LOCKSTEP && ready < occupied)
+		return 0;
+
+	drmModeAtomicSetCursor(m_req, 0);
+
+	for(count = 0; count < drm->count_planes; count++) {
+		struct plane_data *pdata = &drm->pdata[count];
+		struct frame frame;
+
+		if(pdata->occupied == 0 || !frame_ready(pdata))
+			continue;
+
+		if(!frame_queue_take(pdata->queue, &frame) || !frame.bo)
+			continue;
+		struct drm_fb *fb = drm_fb_get_from_bo(drm->fd, frame.bo);
+
+		/* first frame of this plane, its geometry goes in as well */
+		if(!pdata->enabled) {
+			reconfigure = 1;
+			plane_data_report_layout(pdata, frame.bo);
+		}
+
+		/* a new render scale, the plane scales it up to the same rectangle */
+		if(frame.width != pdata->src_width || frame.height != pdata->src_height) {
+			pdata->src_width = frame.width;
+			pdata->src_height = frame.height;
+			reconfigure = 1;
+		}
 
 		drmModeAtomicAddProperty(m_req,
-				drm->pdata[count].plane,
-				drm->pdata[count].fb_id_property,
+				pdata->plane,
+				pdata->props.fb_id,
 				fb->fb_id);
 
-		drm->pdata[count].current_bo = bo;
+		if(count_blobs < MAX_CONFIG_PLANES) {
+			damage_blobs[count_blobs] = add_damage_clips(drm, m_req, pdata, &frame.damage);
+			if(damage_blobs[count_blobs])
+				count_blobs++;
+		}
+
+		if(frame.fence_fd >= 0) {
+			if(drm->explicit_fencing && pdata->props.in_fence_fd) {
+				drmModeAtomicAddProperty(m_req,
+						pdata->plane,
+						pdata->props.in_fence_fd,
+						frame.fence_fd);
+				pdata->in_fence_fd = frame.fence_fd;
+				fenced++;
+			} else {
+				close(frame.fence_fd);
+			}
+		}
+
+		pdata->pending_bo = frame.bo;
+		pdata->pending_seq = frame.seq;
+		pdata->pending_start_nsec = frame.start_nsec;
+		changed++;
 	}
 
+	if(!changed)
+		return 0;
 
-	flip_pending++;
-	ret = drmModeAtomicCommit(drm->fd, m_req, DRM_MODE_ATOMIC_TEST_ONLY, 0);
-	ret = drmModeAtomicCommit(drm->fd, m_req, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK, &flip_pending);
+	drm->out_fence_fd = -1;
+	if(drm->explicit_fencing && drm->out_fence_property)
+		drmModeAtomicAddProperty(m_req,
+				drm->crtc_id,
+				drm->out_fence_property,
+				(uint64_t)(unsigned long)&drm->out_fence_fd);
+
+	/*
+	 * Steady state frames only carry FB_ID (and fences). A new plane
+	 * configuration is validated with TEST_ONLY once and remembered.
+	 */
+	ret = 0;
+	if(reconfigure || !drm->modeset_done) {
+		add_full_state(drm, m_req, &key);
+		if(!drm->modeset_done) {
+			flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+			drm->first_commit_nsec = stats_now_nsec();
+		}
+
+		if(!config_validated(drm, &key)) {
+			TRACE_BEGIN("test commit");
+			ret = drmModeAtomicCommit(drm->fd, m_req,
+					DRM_MODE_ATOMIC_TEST_ONLY | (flags & DRM_MODE_ATOMIC_ALLOW_MODESET), 0);
+			TRACE_END("test commit");
+			if(!ret)
+				config_cache_add(drm, &key);
+		}
+	}
+
+	if(!ret) {
+		drm->commit_nsec = stats_now_nsec();
+		TRACE_BEGIN("atomic commit");
+		ret = drmModeAtomicCommit(drm->fd, m_req, flags, drm);
+		TRACE_END("atomic commit");
+	}
 
-	drmModeAtomicFree(m_req);
+	/* the kernel holds its own reference to the in-fences and blobs now */
+	if(fenced)
+		close_in_fences(drm);
+	while(count_blobs--)
+		drmModeDestroyPropertyBlob(drm->fd, damage_blobs[count_blobs]);
 
-	while (flip_pending) {
+	if(ret) {
+		printf("atomic commit failed %d\n", ret);
+		drm->out_fence_fd = -1;
+		drop_pending(drm);
+		return -1;
+	}
+
+	/* without a loop update_all_surfaces waits for it */
+	if(drm->out_fence_fd >= 0 && drm->loop &&
+			event_loop_add_fd(drm->loop, drm->out_fence_fd, out_fence_cb, drm)) {
+		printf("out-fence wait failed, releasing buffers on the flip\n");
+		close(drm->out_fence_fd);
+		drm->out_fence_fd = -1;
+	}
+
+	/* the real buffers are on their way, the probes do not need theirs any more */
+	if(!drm->modeset_done)
+		scratch_fb_drop_all(drm);
+
+	drm->modeset_done = 1;
+	for(count = 0; count < drm->count_planes; count++)
+		if(drm->pdata[count].pending_bo)
+			drm->pdata[count].enabled = 1;
+
+	drm->flip_pending = 1;
+
+	return 1;
+}
+
+int get_drm_fd(struct drm_data *drm)
+{
+	return drm->fd;
+}
+
+int get_refresh_rate(struct drm_data *drm)
+{
+	return (1000000000ULL + drm->vblank_nsec / 2) / drm->vblank_nsec;
+}
+
+int handle_drm_events(struct drm_data *drm)
+{
+	drmEventContext ev = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.vblank_handler = 0,
+		.page_flip_handler = page_flip_handler,
+	};
+
+	return drmHandleEvent(drm->fd, &ev);
+}
+
+void set_latch_mode(struct drm_data *drm, enum latch_mode mode)
+{
+	drm->latch_mode = mode;
+}
+
+void set_event_loop(struct drm_data *drm, struct event_loop *loop)
+{
+	drm->loop = loop;
+}
+
+int set_explicit_fencing(struct drm_data *drm, int enable)
+{
+	if(enable && !drm->out_fence_property) {
+		printf("OUT_FENCE_PTR not supported, using implicit sync\n");
+		return -1;
+	}
+
+	drm->explicit_fencing = enable;
+
+	return 0;
+}
+
+/*
+ * Blocking variant for simple loops: commit what is ready and wait for the
+ * flip, or wait for the next vblank if there is nothing to commit.
+ */
+int update_all_surfaces(struct drm_data *drm)
+{
+	int ret;
+
+	ret = commit_ready_surfaces(drm);
+	if(ret <= 0)
+		return wait_for_vblank(drm);
+
+	while (drm->flip_pending || drm->out_fence_fd >= 0) {
+		int nfds = drm->fd;
 		fd_set fds;
 		FD_ZERO(&fds);
-		FD_SET(drm->fd, &fds);
+		if(drm->flip_pending)
+			FD_SET(drm->fd, &fds);
+		if(drm->out_fence_fd >= 0) {
+			FD_SET(drm->out_fence_fd, &fds);
+			if(drm->out_fence_fd > nfds)
+				nfds = drm->out_fence_fd;
+		}
 
-		ret = select(drm->fd + 1, &fds, NULL, NULL, NULL);
+		TRACE_BEGIN("select");
+		ret = select(nfds + 1, &fds, NULL, NULL, NULL);
+		TRACE_END("select");
 
 		if(ret <= 0) {
 			printf("failing %d\n", ret);
 			return 0;
 		}
 
-		if (FD_ISSET(drm->fd, &fds)) {
-			drmEventContext ev = {
-				.version = DRM_EVENT_CONTEXT_VERSION,
-				.vblank_handler = 0,
-				.page_flip_handler = page_flip_handler,
-			};
-
-			drmHandleEvent(drm->fd, &ev);
-		}
-	}
-
-	for(count = 0; count < drm->count_planes; count++) {	
-		struct plane_data *pdata = &drm->pdata[count];
-		if(drm->pdata[count].occupied == 0)
-			continue;
-		struct gbm_surface *surf = drm->pdata[count].gbm_surf;
-		struct gbm_bo *bo = drm->pdata[count].current_bo;	
-		gbm_surface_release_buffer(surf, bo);
-		drm->pdata[count].current_bo = NULL;
-		
+		if (FD_ISSET(drm->fd, &fds))
+			handle_drm_events(drm);
+		if (drm->out_fence_fd >= 0 && FD_ISSET(drm->out_fence_fd, &fds))
+			retire_buffers(drm);
 	}
 
 	return 0;
-
 }
@@ -3,9 +3,38 @@
 
 #include <gbm/gbm.h>
 
+#include "stats.h"
+#include "drm_planes.h"
+
+struct frame_queue;
+struct event_loop;
+
+enum latch_mode {
+	LATCH_LOCKSTEP,	/* commit once every plane has a new frame */
+	LATCH_MAILBOX,	/* planes only latch when a new frame is ready */
+};
+
+/* KMS property ids of a plane, 0 if the plane does not have it */
+struct plane_properties {
+	uint32_t fb_id;
+	uint32_t crtc_id;
+	uint32_t src_x;
+	uint32_t src_y;
+	uint32_t src_w;
+	uint32_t src_h;
+	uint32_t crtc_x;
+	uint32_t crtc_y;
+	uint32_t crtc_w;
+	uint32_t crtc_h;
+	uint32_t in_fence_fd;
+	uint32_t zpos;
+	uint32_t fb_damage_clips;
+};
+
 struct plane_data {
 	int plane;
-	int fb_id_property;
+	struct plane_properties props;
+	struct plane_caps caps;
 	int zorder;
 	int primary;
 
@@ -13,19 +42,77 @@ struct plane_data {
 	struct gbm_surface *gbm_surf;
 
 	struct gbm_bo *current_bo;
+	struct gbm_bo *pending_bo;
+	struct gbm_bo *retiring_bo;	/* replaced on screen, waits for the out-fence */
+	int in_fence_fd;
+
+	/* set by the owner of the render thread, tells when a frame is ready */
+	struct frame_queue *queue;
 
 	int width;
 	int height;
 	int posx;
 	int posy;
 
+	/* drawn part of the buffers, scaled up to width x height, see dynres.h */
+	int src_width;
+	int src_height;
+
+	uint32_t format;
+
+	/*
+	 * Layouts the buffers may have, the plane's IN_FORMATS modifiers that
+	 * EGL can import too. None for a plain gbm_surface_create, which
+	 * leaves it to the driver and usually ends up linear.
+	 */
+	int count_modifiers;
+	uint64_t modifiers[PLANE_MAX_MODIFIERS];
+
 	int occupied;
+	int enabled;	/* geometry committed, only FB_ID changes from now on */
+
+	/* written by the compositor loop only */
+	struct stats_hist commit_time;
+	struct stats_hist flip_interval;
+	struct stats_hist latency;	/* render start to the vblank that showed it */
+	unsigned long long last_flip_nsec;
+
+	/* frame_queue seq and render start of the frame in the pending commit */
+	unsigned int pending_seq;
+	unsigned long long pending_start_nsec;
+
+	/*
+	 * Frames seen on screen, the ones the queue replaced before they were
+	 * committed, and the extra vblanks a frame stayed on screen because
+	 * the next one was late. Last seq and vblank sequence shown, 0 before
+	 * the first flip.
+	 */
+	unsigned long frames_shown;
+	unsigned long frames_dropped;
+	unsigned long frames_repeated;
+	unsigned int last_seq;
+	unsigned int last_vblank;
 };
 
 struct drm_data;
 
 struct drm_data *init_drm_gbm (int conn_id);
-struct plane_data *get_new_surface(struct drm_data *drm, int posx, int posy, int width, int height);
+/* format is a GBM_FORMAT_*, the surface goes to the GPU composition if no plane can show it */
+struct plane_data *get_new_surface(struct drm_data *drm, int posx, int posy, int width, int height,
+		uint32_t format);
 int update_all_surfaces(struct drm_data *drm);
+void set_latch_mode(struct drm_data *drm, enum latch_mode mode);
+int set_explicit_fencing(struct drm_data *drm, int enable);
+int get_refresh_rate(struct drm_data *drm);	/* Hz of the current mode */
+
+/* print the layout GBM picked, with the first buffer of the surface */
+void plane_data_report_layout(struct plane_data *pdata, struct gbm_bo *bo);
+
+/* building blocks for an event driven compositor loop */
+int get_drm_fd(struct drm_data *drm);
+/* the out-fences of the commits are waited for on loop, not in update_all_surfaces */
+void set_event_loop(struct drm_data *drm, struct event_loop *loop);
+int handle_drm_events(struct drm_data *drm);
+int commit_ready_surfaces(struct drm_data *drm);
 
 #endif /*__DRM_GBM_H__*/
@@ -0,0 +1,236 @@
+#include <stdio.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_mode.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "drm_planes.h"
+
+static int format_index(struct plane_caps *caps, uint32_t format)
+{
+	int count;
+
+	for(count = 0; count < caps->count_formats; count++)
+		if(caps->formats[count] == format)
+			return count;
+
+	return -1;
+}
+
+/*
+ * IN_FORMATS lists the modifiers of a plane, each with a bitmask over a
+ * window of the blob's format list. Remap the masks to caps->formats.
+ */
+static void read_in_formats(int fd, uint32_t blob_id, struct plane_caps *caps)
+{
+	drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(fd, blob_id);
+	struct drm_format_modifier_blob *header;
+	struct drm_format_modifier *mods;
+	uint32_t *formats;
+	int count, bit;
+
+	if(!blob)
+		return;
+
+	header = blob->data;
+	formats = (uint32_t *)((char *)header + header->formats_offset);
+	mods = (struct drm_format_modifier *)((char *)header + header->modifiers_offset);
+
+	for(count = 0; count < header->count_modifiers; count++) {
+		uint64_t mask = 0;
+
+		if(caps->count_modifiers == PLANE_MAX_MODIFIERS)
+			break;
+
+		for(bit = 0; bit < 64; bit++) {
+			int idx;
+
+			if(!(mods[count].formats & (1ULL << bit)))
+				continue;
+			if(mods[count].offset + bit >= header->count_formats)
+				break;
+			idx = format_index(caps, formats[mods[count].offset + bit]);
+			if(idx >= 0)
+				mask |= 1ULL << idx;
+		}
+
+		caps->modifiers[caps->count_modifiers] = mods[count].modifier;
+		caps->modifier_formats[caps->count_modifiers] = mask;
+		caps->count_modifiers++;
+	}
+
+	drmModeFreePropertyBlob(blob);
+}
+
+int plane_caps_read(int fd, uint32_t plane_id, int max_width, int max_height,
+		struct plane_caps *caps)
+{
+	drmModePlanePtr plane;
+	drmModeObjectPropertiesPtr props;
+	uint64_t cap;
+	int count;
+
+	memset(caps, 0, sizeof(*caps));
+	caps->plane_id = plane_id;
+	caps->type = DRM_PLANE_TYPE_OVERLAY;
+	caps->can_scale = -1;
+	caps->max_width = max_width;
+	caps->max_height = max_height;
+
+	plane = drmModeGetPlane(fd, plane_id);
+	if(!plane) {
+		printf("plane %d not found\n", plane_id);
+		return -1;
+	}
+
+	caps->possible_crtcs = plane->possible_crtcs;
+	for(count = 0; count < plane->count_formats && count < PLANE_MAX_FORMATS; count++)
+		caps->formats[count] = plane->formats[count];
+	caps->count_formats = count;
+	drmModeFreePlane(plane);
+
+	props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	for(count = 0; props && count < props->count_props; count++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[count]);
+		uint64_t value = props->prop_values[count];
+
+		if(!prop)
+			continue;
+
+		if(strcmp(prop->name, "type") == 0) {
+			caps->type = value;
+		} else if(strcmp(prop->name, "IN_FORMATS") == 0) {
+			read_in_formats(fd, value, caps);
+		} else if(strcmp(prop->name, "zpos") == 0 ||
+				(strcmp(prop->name, "zorder") == 0 && !caps->has_zpos)) {
+			caps->has_zpos = 1;
+			caps->zpos_immutable = !!(prop->flags & DRM_MODE_PROP_IMMUTABLE);
+			if(caps->zpos_immutable || prop->count_values < 2) {
+				caps->zpos_min = caps->zpos_max = value;
+			} else {
+				caps->zpos_min = prop->values[0];
+				caps->zpos_max = prop->values[1];
+			}
+		} else if(strcmp(prop->name, "alpha") == 0) {
+			caps->has_alpha = 1;
+		} else if(strcmp(prop->name, "pixel blend mode") == 0) {
+			caps->has_blend = 1;
+		} else if(strcmp(prop->name, "SCALING_FILTER") == 0) {
+			caps->can_scale = 1;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	/* cursor planes take small unscaled buffers only */
+	if(caps->type == DRM_PLANE_TYPE_CURSOR) {
+		caps->can_scale = 0;
+		caps->max_width = drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &cap) ? 64 : cap;
+		caps->max_height = drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &cap) ? 64 : cap;
+	}
+
+	return 0;
+}
+
+int plane_caps_has_format(struct plane_caps *caps, uint32_t format)
+{
+	return format_index(caps, format) >= 0;
+}
+
+int plane_caps_has_modifier(struct plane_caps *caps, uint32_t format, uint64_t modifier)
+{
+	int idx = format_index(caps, format);
+	int count;
+
+	if(idx < 0)
+		return 0;
+
+	/* no IN_FORMATS, the driver only takes implicit modifiers */
+	if(!caps->count_modifiers)
+		return modifier == 0;
+
+	for(count = 0; count < caps->count_modifiers; count++)
+		if(caps->modifiers[count] == modifier)
+			return !!(caps->modifier_formats[count] & (1ULL << idx));
+
+	return 0;
+}
+
+int plane_caps_modifiers(struct plane_caps *caps, uint32_t format, uint64_t *modifiers, int max)
+{
+	int idx = format_index(caps, format);
+	int count, n = 0;
+
+	if(idx < 0)
+		return 0;
+
+	for(count = 0; count < caps->count_modifiers && n < max; count++)
+		if(caps->modifier_formats[count] & (1ULL << idx))
+			modifiers[n++] = caps->modifiers[count];
+
+	return n;
+}
+
+/*
+ * Rough measure of how much a plane can do. The allocator hands out the
+ * cheapest plane that fits, so the capable ones are still free for the
+ * surfaces that need them.
+ */
+int plane_caps_cost(struct plane_caps *caps)
+{
+	int cost = caps->count_formats + caps->count_modifiers;
+
+	if(caps->can_scale > 0)
+		cost += 64;
+	if(caps->has_alpha)
+		cost += 16;
+	if(caps->has_blend)
+		cost += 16;
+
+	return cost;
+}
+
+void plane_caps_print(struct plane_caps *caps)
+{
+	static const char *type_names[] = { "overlay", "primary", "cursor" };
+
+	printf("plane %d: %s crtcs 0x%x formats %d modifiers %d",
+			caps->plane_id,
+			caps->type >= 0 && caps->type <= 2 ? type_names[caps->type] : "?",
+			caps->possible_crtcs, caps->count_formats, caps->count_modifiers);
+	if(caps->has_zpos)
+		printf(" zpos %d-%d%s", caps->zpos_min, caps->zpos_max,
+				caps->zpos_immutable ? " fixed" : "");
+	printf(" max %dx%d scale %s%s%s\n",
+			caps->max_width, caps->max_height,
+			caps->can_scale < 0 ? "?" : caps->can_scale ? "yes" : "no",
+			caps->has_alpha ? " alpha" : "",
+			caps->has_blend ? " blend" : "");
+}
+
+const char *plane_modifier_name(uint64_t modifier, char *buf, int len)
+{
+	static const char *vendors[] = {
+		"none", "intel", "amd", "nvidia", "samsung", "qcom",
+		"vivante", "broadcom", "arm", "allwinner", "amlogic",
+	};
+	unsigned int vendor = modifier >> 56;
+
+	if(modifier == DRM_FORMAT_MOD_LINEAR)
+		snprintf(buf, len, "linear");
+	else if(modifier == DRM_FORMAT_MOD_INVALID)
+		snprintf(buf, len, "implicit");
+	else if(vendor < sizeof(vendors) / sizeof(vendors[0]))
+		snprintf(buf, len, "%s:0x%llx", vendors[vendor],
+				(unsigned long long)(modifier & 0x00ffffffffffffffULL));
+	else
+		snprintf(buf, len, "0x%llx", (unsigned long long)modifier);
+
+	return buf;
+}
@@ -0,0 +1,52 @@
+#ifndef __DRM_PLANES_H__
+#define __DRM_PLANES_H__
+
+#include <stdint.h>
+
+#define PLANE_MAX_FORMATS (64)
+#define PLANE_MAX_MODIFIERS (16)
+
+/*
+ * What a KMS plane can do, read once at startup so that picking a plane
+ * for a surface does not have to go back to the kernel.
+ */
+struct plane_caps {
+	uint32_t plane_id;
+	uint32_t possible_crtcs;
+	int type;	/* DRM_PLANE_TYPE_* */
+
+	int count_formats;
+	uint32_t formats[PLANE_MAX_FORMATS];
+
+	/* from IN_FORMATS, bit n of modifier_formats[m] stands for formats[n] */
+	int count_modifiers;
+	uint64_t modifiers[PLANE_MAX_MODIFIERS];
+	uint64_t modifier_formats[PLANE_MAX_MODIFIERS];
+
+	/* "zpos", or the older "zorder" */
+	int has_zpos;
+	int zpos_immutable;
+	int zpos_min;
+	int zpos_max;
+
+	int max_width;
+	int max_height;
+	int can_scale;	/* -1 if the driver does not say */
+
+	int has_alpha;
+	int has_blend;
+};
+
+int plane_caps_read(int fd, uint32_t plane_id, int max_width, int max_height,
+		struct plane_caps *caps);
+int plane_caps_has_format(struct plane_caps *caps, uint32_t format);
+int plane_caps_has_modifier(struct plane_caps *caps, uint32_t format, uint64_t modifier);
+/* the IN_FORMATS modifiers of format, at most max, returns the count */
+int plane_caps_modifiers(struct plane_caps *caps, uint32_t format, uint64_t *modifiers, int max);
+int plane_caps_cost(struct plane_caps *caps);
+void plane_caps_print(struct plane_caps *caps);
+
+/* "linear", "implicit" or vendor:value, in buf */
+const char *plane_modifier_name(uint64_t modifier, char *buf, int len);
+
+#endif /*__DRM_PLANES_H__*/
@@ -0,0 +1,78 @@
+#include "dynres.h"
+
+#define DYNRES_DOWN_FRAMES (3)	/* over budget this many frames in a row */
+#define DYNRES_UP_FRAMES (60)	/* with headroom this many frames in a row */
+#define DYNRES_HEADROOM (70)	/* percent of the budget that leaves headroom */
+#define DYNRES_DOWN_STEP (100)	/* permille */
+#define DYNRES_UP_STEP (50)	/* ~10% more pixels, still within the budget after headroom */
+#define DYNRES_HOLDOFF (10)	/* frames ignored after a change */
+
+void dynres_init (struct dynres *dynres, unsigned long long budget_nsec, int min_scale)
+{
+	dynres->budget_nsec = budget_nsec;
+	dynres->min_scale = min_scale > 1000 ? 1000 : min_scale;
+	dynres->scale = 1000;
+	dynres->avg_nsec = 0;
+	dynres->over = 0;
+	dynres->under = 0;
+	dynres->holdoff = 0;
+	dynres->changes = 0;
+}
+
+int dynres_update (struct dynres *dynres, unsigned long long frame_nsec)
+{
+	int scale = dynres->scale;
+
+	if(!dynres->budget_nsec)
+		return 0;
+
+	/* the first frames at a new size still carry the old one's work */
+	if(dynres->holdoff) {
+		dynres->holdoff--;
+		return 0;
+	}
+
+	if(!dynres->avg_nsec)
+		dynres->avg_nsec = frame_nsec;
+	else
+		dynres->avg_nsec += ((long long)frame_nsec - (long long)dynres->avg_nsec) / 8;
+
+	if(dynres->avg_nsec > dynres->budget_nsec) {
+		dynres->under = 0;
+		if(++dynres->over >= DYNRES_DOWN_FRAMES)
+			scale -= DYNRES_DOWN_STEP;
+	} else if(dynres->avg_nsec < dynres->budget_nsec * DYNRES_HEADROOM / 100) {
+		dynres->over = 0;
+		if(++dynres->under >= DYNRES_UP_FRAMES)
+			scale += DYNRES_UP_STEP;
+	} else {
+		dynres->over = 0;
+		dynres->under = 0;
+	}
+
+	if(scale < dynres->min_scale)
+		scale = dynres->min_scale;
+	if(scale > 1000)
+		scale = 1000;
+	if(scale == dynres->scale)
+		return 0;
+
+	dynres->scale = scale;
+	dynres->avg_nsec = 0;
+	dynres->over = 0;
+	dynres->under = 0;
+	dynres->holdoff = DYNRES_HOLDOFF;
+	dynres->changes++;
+
+	return 1;
+}
+
+unsigned int dynres_size (struct dynres *dynres, unsigned int full)
+{
+	unsigned int size = ((full * dynres->scale / 1000) + 1) & ~1U;
+
+	if(size < 2)
+		size = 2;
+
+	return size > full ? full : size;
+}
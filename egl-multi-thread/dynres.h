@@ -0,0 +1,34 @@
+#ifndef __DYNRES_H__
+#define __DYNRES_H__
+
+/*
+ * Dynamic resolution controller of one surface.
+ *
+ * Fed with the render time of every frame, it lowers the render scale
+ * when the moving average is over budget for a few frames in a row, and
+ * raises it again only after a long run well under budget. Both sides
+ * of the band and a hold-off after every change keep it from hunting.
+ * The scale applies to width and height, the display plane (or the GPU
+ * composition) scales the result up to the surface size.
+ */
+struct dynres {
+	unsigned long long budget_nsec;	/* 0: off, always full size */
+	int min_scale;		/* permille */
+	int scale;		/* permille, 1000 is full size */
+
+	unsigned long long avg_nsec;
+	int over;		/* frames in a row over budget */
+	int under;		/* frames in a row with headroom */
+	int holdoff;
+	unsigned long changes;
+};
+
+void dynres_init (struct dynres *dynres, unsigned long long budget_nsec, int min_scale);
+
+/* returns 1 if the scale changed */
+int dynres_update (struct dynres *dynres, unsigned long long frame_nsec);
+
+/* size at the current scale, even and at least 2 */
+unsigned int dynres_size (struct dynres *dynres, unsigned int full);
+
+#endif /*__DYNRES_H__*/
@@ -41,6 +41,7 @@
 //  Includes
 //
 #include "esUtil.h"
+#include "matrix_simd.h"
 #include <math.h>
 #include <string.h>
 
@@ -194,32 +195,23 @@ esOrtho(ESMatrix *result, float left, float right, float bottom, float top, floa
 void ESUTIL_API
 esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
 {
-    ESMatrix    tmp;
-    int         i;
-
-	for (i=0; i<4; i++)
-	{
-		tmp.m[i][0] =	(srcA->m[i][0] * srcB->m[0][0]) +
-						(srcA->m[i][1] * srcB->m[1][0]) +
-						(srcA->m[i][2] * srcB->m[2][0]) +
-						(srcA->m[i][3] * srcB->m[3][0]) ;
-
-		tmp.m[i][1] =	(srcA->m[i][0] * srcB->m[0][1]) + 
-						(srcA->m[i][1] * srcB->m[1][1]) +
-						(srcA->m[i][2] * srcB->m[2][1]) +
-						(srcA->m[i][3] * srcB->m[3][1]) ;
-
-		tmp.m[i][2] =	(srcA->m[i][0] * srcB->m[0][2]) + 
-						(srcA->m[i][1] * srcB->m[1][2]) +
-						(srcA->m[i][2] * srcB->m[2][2]) +
-						(srcA->m[i][3] * srcB->m[3][2]) ;
-
-		tmp.m[i][3] =	(srcA->m[i][0] * srcB->m[0][3]) + 
-						(srcA->m[i][1] * srcB->m[1][3]) +
-						(srcA->m[i][2] * srcB->m[2][3]) +
-						(srcA->m[i][3] * srcB->m[3][3]) ;
-	}
-    memcpy(result, &tmp, sizeof(ESMatrix));
+    // scalar, SSE, AVX or NEON, see matrix_simd.c
+    matrix_kernel_get()->multiply(result, srcA, srcB);
+}
+
+void ESUTIL_API
+esMatrixMultiplyBatch(ESMatrix *results, const ESMatrix *srcA, ESMatrix *srcB, int count)
+{
+    matrix_kernel_get()->multiply_batch(results, srcA, srcB, count);
+}
+
+void ESUTIL_API
+esMatrixNormal(GLfloat normal[9], const ESMatrix *modelview)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        memcpy(&normal[i * 3], modelview->m[i], 3 * sizeof(GLfloat));
 }
 
 
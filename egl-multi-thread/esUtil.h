@@ -290,6 +290,20 @@ void ESUTIL_API esOrtho(ESMatrix *result, float left, float right, float bottom,
 //
 void ESUTIL_API esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
 
+//
+/// \brief perform result[n] = srcA[n] * srcB for count matrices, srcB is only loaded once
+/// \param results Returns the multiplied matrices, may be srcA but must not contain srcB
+/// \param srcA Array of count input matrices, srcB Input matrix used with all of them
+//
+void ESUTIL_API esMatrixMultiplyBatch(ESMatrix *results, const ESMatrix *srcA, ESMatrix *srcB, int count);
+
+//
+/// \brief extract the upper 3x3 of a modelview matrix without scaling as normal matrix
+/// \param normal Returns the 3x3 matrix in the order glUniformMatrix3fv takes
+/// \param modelview Input matrix
+//
+void ESUTIL_API esMatrixNormal(GLfloat normal[9], const ESMatrix *modelview);
+
 //
 //// \brief return an indentity matrix 
 //// \param result returns identity matrix
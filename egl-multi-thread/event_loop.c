@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "event_loop.h"
+#include "trace.h"
+
+struct event_source {
+	int fd;
+	event_loop_cb cb;
+	void *data;
+};
+
+struct event_loop {
+	int epoll_fd;
+
+	int count_sources;
+	struct event_source sources[EVENT_LOOP_MAX_SOURCES];
+};
+
+struct event_loop *event_loop_create (void)
+{
+	struct event_loop *loop = calloc(sizeof(struct event_loop), 1);
+	if(!loop) {
+		printf("event loop alloc failed\n");
+		return NULL;
+	}
+
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(loop->epoll_fd < 0) {
+		printf("epoll_create1 failed\n");
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+int event_loop_add_fd (struct event_loop *loop, int fd, event_loop_cb cb, void *data)
+{
+	struct epoll_event ev;
+	struct event_source *source;
+	int count;
+
+	/* slots of removed sources are reused, the others must not move */
+	for(count = 0; count < loop->count_sources; count++)
+		if(loop->sources[count].fd < 0)
+			break;
+
+	if(count == EVENT_LOOP_MAX_SOURCES) {
+		printf("event loop: too many sources\n");
+		return -1;
+	}
+
+	source = &loop->sources[count];
+	source->fd = fd;
+	source->cb = cb;
+	source->data = data;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = source;
+	if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		printf("epoll_ctl failed for fd %d\n", fd);
+		source->fd = -1;
+		return -1;
+	}
+
+	if(count == loop->count_sources)
+		loop->count_sources++;
+
+	return 0;
+}
+
+int event_loop_remove_fd (struct event_loop *loop, int fd)
+{
+	int count;
+
+	for(count = 0; count < loop->count_sources; count++) {
+		if(loop->sources[count].fd != fd)
+			continue;
+
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		loop->sources[count].fd = -1;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+static int timer_cb (int fd, void *data)
+{
+	struct event_source *source = data;
+	uint64_t expirations;
+
+	if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+
+	return source->cb(fd, source->data);
+}
+
+int event_loop_add_timer (struct event_loop *loop, unsigned int interval_msec, event_loop_cb cb, void *data)
+{
+	struct itimerspec its;
+	struct event_source *timer;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fd < 0) {
+		printf("timerfd_create failed\n");
+		return -1;
+	}
+
+	its.it_interval.tv_sec = interval_msec / 1000;
+	its.it_interval.tv_nsec = (interval_msec % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	timerfd_settime(fd, 0, &its, NULL);
+
+	/* the user callback runs from timer_cb once the timer is drained */
+	timer = malloc(sizeof(*timer));
+	if(!timer) {
+		close(fd);
+		return -1;
+	}
+	timer->fd = fd;
+	timer->cb = cb;
+	timer->data = data;
+
+	if(event_loop_add_fd(loop, fd, timer_cb, timer)) {
+		free(timer);
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+int event_loop_dispatch (struct event_loop *loop, int timeout_msec)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_SOURCES];
+	int count, n;
+
+	TRACE_BEGIN("epoll wait");
+	n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_SOURCES, timeout_msec);
+	TRACE_END("epoll wait");
+	if(n < 0) {
+		if(errno == EINTR)
+			return 0;
+		printf("epoll_wait failed\n");
+		return -1;
+	}
+
+	for(count = 0; count < n; count++) {
+		struct event_source *source = events[count].data.ptr;
+
+		/* removed by an earlier callback of this round */
+		if(source->fd < 0)
+			continue;
+		source->cb(source->fd, source->data);
+	}
+
+	return n;
+}
@@ -0,0 +1,24 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#define EVENT_LOOP_MAX_SOURCES (96)
+
+struct event_loop;
+
+/* called with the fd that became readable */
+typedef int (*event_loop_cb) (int fd, void *data);
+
+struct event_loop *event_loop_create (void);
+int event_loop_add_fd (struct event_loop *loop, int fd, event_loop_cb cb, void *data);
+int event_loop_add_timer (struct event_loop *loop, unsigned int interval_msec, event_loop_cb cb, void *data);
+/* before closing fd, a callback may remove its own fd */
+int event_loop_remove_fd (struct event_loop *loop, int fd);
+
+/*
+ * Sleep until at least one source is readable and run its callback.
+ * Returns the number of callbacks run, 0 on timeout or when interrupted by
+ * a signal, -1 on error.
+ */
+int event_loop_dispatch (struct event_loop *loop, int timeout_msec);
+
+#endif /*__EVENT_LOOP_H__*/
@@ -0,0 +1,1369 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include <libdrm/drm.h>
+#include <libdrm/drm_mode.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include <gbm/gbm.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "fake_kms.h"
+
+#define FAKE_MAX_PLANES (16)
+#define FAKE_MAX_FBS (256)
+#define FAKE_MAX_BLOBS (64)
+#define FAKE_SURFACE_BUFFERS (4)	/* like Mesa's GBM surfaces */
+
+#define FAKE_CONNECTOR_ID (24)
+#define FAKE_ENCODER_ID (31)
+#define FAKE_CRTC_ID (41)
+#define FAKE_PLANE_ID (50)	/* the primary, the overlays follow */
+#define FAKE_PROP_ID (100)
+#define FAKE_BLOB_ID (1000)
+
+enum fake_prop {
+	/* planes */
+	PROP_TYPE,
+	PROP_FB_ID,
+	PROP_CRTC_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_ZPOS_PRIMARY,	/* immutable 0 */
+	PROP_ZPOS,		/* 1 to the number of overlays */
+	PROP_IN_FORMATS,
+	PROP_FB_DAMAGE_CLIPS,
+	PROP_SCALING_FILTER,
+	PROP_IN_FENCE_FD,
+	/* CRTC */
+	PROP_MODE_ID,
+	PROP_ACTIVE,
+	PROP_OUT_FENCE_PTR,
+	/* connector */
+	PROP_CONN_CRTC_ID,
+	NUM_PROPS
+};
+
+static const struct {
+	const char *name;
+	uint32_t flags;
+} prop_info[NUM_PROPS] = {
+	[PROP_TYPE] = { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_FB_ID] = { "FB_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_CRTC_ID] = { "CRTC_ID", DRM_MODE_PROP_OBJECT },
+	[PROP_SRC_X] = { "SRC_X", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_Y] = { "SRC_Y", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_W] = { "SRC_W", DRM_MODE_PROP_RANGE },
+	[PROP_SRC_H] = { "SRC_H", DRM_MODE_PROP_RANGE },
+	[PROP_CRTC_X] = { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE },
+	[PROP_CRTC_Y] = { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE },
+	[PROP_CRTC_W] = { "CRTC_W", DRM_MODE_PROP_RANGE },
+	[PROP_CRTC_H] = { "CRTC_H", DRM_MODE_PROP_RANGE },
+	[PROP_ZPOS_PRIMARY] = { "zpos", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_ZPOS] = { "zpos", DRM_MODE_PROP_RANGE },
+	[PROP_IN_FORMATS] = { "IN_FORMATS", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_FB_DAMAGE_CLIPS] = { "FB_DAMAGE_CLIPS", DRM_MODE_PROP_BLOB },
+	[PROP_SCALING_FILTER] = { "SCALING_FILTER", DRM_MODE_PROP_ENUM },
+	[PROP_IN_FENCE_FD] = { "IN_FENCE_FD", DRM_MODE_PROP_SIGNED_RANGE },
+	[PROP_MODE_ID] = { "MODE_ID", DRM_MODE_PROP_BLOB },
+	[PROP_ACTIVE] = { "ACTIVE", DRM_MODE_PROP_RANGE },
+	[PROP_OUT_FENCE_PTR] = { "OUT_FENCE_PTR", DRM_MODE_PROP_RANGE },
+	[PROP_CONN_CRTC_ID] = { "CRTC_ID", DRM_MODE_PROP_OBJECT },
+};
+
+static const uint32_t fake_formats[] = {
+	DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565,
+};
+
+/* objects are the CRTC, the connector, then the planes */
+#define OBJ_CRTC (0)
+#define OBJ_CONNECTOR (1)
+#define OBJ_PLANE (2)
+#define MAX_OBJECTS (OBJ_PLANE + FAKE_MAX_PLANES)
+
+struct fake_state {
+	uint64_t values[MAX_OBJECTS][NUM_PROPS];
+};
+
+struct fake_fb {
+	uint32_t id;	/* 0 if free */
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct fake_blob {
+	uint32_t id;	/* 0 if free */
+	uint32_t length;
+	void *data;
+};
+
+struct _drmModeAtomicReqItem {
+	uint32_t object_id;
+	uint32_t property_id;
+	uint64_t value;
+};
+
+struct _drmModeAtomicReq {
+	int cursor;
+	int size;
+	struct _drmModeAtomicReqItem *items;
+};
+
+struct gbm_device {
+	int fd;
+};
+
+struct gbm_bo {
+	struct gbm_device *dev;
+	struct gbm_surface *surf;	/* NULL for gbm_bo_create */
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t stride;
+	uint32_t handle;
+	uint64_t modifier;
+	int locked;
+	void *user_data;
+	void (*destroy_user_data)(struct gbm_bo *bo, void *data);
+};
+
+struct gbm_surface {
+	pthread_mutex_t lock;	/* render thread locks, the compositor releases */
+	int next;
+	struct gbm_bo bos[FAKE_SURFACE_BUFFERS];
+};
+
+/*
+ * Only the compositor thread talks to the device, the GBM surfaces are
+ * the only objects shared with the render threads.
+ */
+static struct {
+	int fd;
+	int count_planes;
+	int max_active;
+	drmModeModeInfo mode;
+	unsigned long long epoch_nsec;
+	unsigned long long period_nsec;
+
+	struct fake_state state;
+	struct fake_fb fbs[FAKE_MAX_FBS];
+	uint32_t next_fb_id;
+	struct fake_blob blobs[FAKE_MAX_BLOBS];
+	uint32_t next_blob_id;
+	uint32_t next_handle;
+
+	/*
+	 * The last nonblocking or evented commit, latched at vblank event_seq
+	 * once its in-fences have signalled. Its out-fence signals then too.
+	 */
+	int event_pending;
+	int send_event;
+	unsigned int event_seq;
+	void *event_data;
+	int in_fences[FAKE_MAX_PLANES];
+	int out_fence;
+} fake = { .fd = -1, .out_fence = -1 };
+
+static unsigned long long now_nsec (void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* vblank n starts at epoch + n periods, the first one is 1 */
+static unsigned int vblank_seq (unsigned long long nsec)
+{
+	return (nsec - fake.epoch_nsec) / fake.period_nsec;
+}
+
+static unsigned long long vblank_nsec (unsigned int seq)
+{
+	return fake.epoch_nsec + seq * fake.period_nsec;
+}
+
+static int object_index (uint32_t object_id)
+{
+	if(object_id == FAKE_CRTC_ID)
+		return OBJ_CRTC;
+	if(object_id == FAKE_CONNECTOR_ID)
+		return OBJ_CONNECTOR;
+	if(object_id >= FAKE_PLANE_ID && object_id < FAKE_PLANE_ID + fake.count_planes)
+		return OBJ_PLANE + object_id - FAKE_PLANE_ID;
+
+	return -1;
+}
+
+static int object_has_prop (int obj, int prop)
+{
+	if(obj == OBJ_CRTC)
+		return prop == PROP_MODE_ID || prop == PROP_ACTIVE || prop == PROP_OUT_FENCE_PTR;
+	if(obj == OBJ_CONNECTOR)
+		return prop == PROP_CONN_CRTC_ID;
+	if(prop == PROP_ZPOS_PRIMARY)
+		return obj == OBJ_PLANE;
+	if(prop == PROP_ZPOS)
+		return obj > OBJ_PLANE;
+
+	return prop <= PROP_IN_FENCE_FD;
+}
+
+static struct fake_blob *find_blob (uint32_t id)
+{
+	int count;
+
+	for(count = 0; id && count < FAKE_MAX_BLOBS; count++)
+		if(fake.blobs[count].id == id)
+			return &fake.blobs[count];
+
+	return NULL;
+}
+
+static struct fake_fb *find_fb (uint32_t id)
+{
+	int count;
+
+	for(count = 0; id && count < FAKE_MAX_FBS; count++)
+		if(fake.fbs[count].id == id)
+			return &fake.fbs[count];
+
+	return NULL;
+}
+
+static int fake_format_supported (uint32_t format)
+{
+	unsigned int count;
+
+	for(count = 0; count < sizeof(fake_formats) / sizeof(fake_formats[0]); count++)
+		if(fake_formats[count] == format)
+			return 1;
+
+	return 0;
+}
+
+struct in_formats_blob {
+	struct drm_format_modifier_blob header;
+	uint32_t formats[4];
+	struct drm_format_modifier modifiers[1];
+};
+
+/* every plane takes every format, linear only */
+static uint32_t create_in_formats (void)
+{
+	struct in_formats_blob blob;
+	uint32_t id;
+
+	memset(&blob, 0, sizeof(blob));
+	blob.header.version = FORMAT_BLOB_CURRENT;
+	blob.header.count_formats = sizeof(fake_formats) / sizeof(fake_formats[0]);
+	blob.header.formats_offset = offsetof(struct in_formats_blob, formats);
+	blob.header.count_modifiers = 1;
+	blob.header.modifiers_offset = offsetof(struct in_formats_blob, modifiers);
+	memcpy(blob.formats, fake_formats, sizeof(fake_formats));
+	blob.modifiers[0].formats = (1 << blob.header.count_formats) - 1;
+	blob.modifiers[0].modifier = DRM_FORMAT_MOD_LINEAR;
+
+	if(drmModeCreatePropertyBlob(fake.fd, &blob, sizeof(blob), &id))
+		return 0;
+
+	return id;
+}
+
+static void fake_mode (int width, int height, int refresh)
+{
+	drmModeModeInfo *mode = &fake.mode;
+
+	/* CEA-like blanking, only the active size and the refresh matter here */
+	memset(mode, 0, sizeof(*mode));
+	mode->hdisplay = width;
+	mode->hsync_start = width + 88;
+	mode->hsync_end = width + 132;
+	mode->htotal = width + 280;
+	mode->vdisplay = height;
+	mode->vsync_start = height + 4;
+	mode->vsync_end = height + 9;
+	mode->vtotal = height + 45;
+	mode->vrefresh = refresh;
+	mode->clock = (uint64_t)mode->htotal * mode->vtotal * refresh / 1000;
+	snprintf(mode->name, sizeof(mode->name), "%dx%d", width, height);
+}
+
+int fake_kms_open (void)
+{
+	const char *env;
+	int width = 1920, height = 1080, refresh = 60;
+	int overlays = 3;
+	int count;
+
+	if(fake.fd >= 0)
+		return fake.fd;
+
+	env = getenv("FAKEKMS_MODE");
+	if(env && sscanf(env, "%dx%d@%d", &width, &height, &refresh) < 2) {
+		printf("fake kms: FAKEKMS_MODE is <W>x<H>@<Hz>\n");
+		return -1;
+	}
+	env = getenv("FAKEKMS_PLANES");
+	if(env)
+		overlays = atoi(env);
+	if(overlays < 0 || overlays > FAKE_MAX_PLANES - 1 || refresh <= 0) {
+		printf("fake kms: 0 to %d overlay planes at a positive refresh rate\n",
+				FAKE_MAX_PLANES - 1);
+		return -1;
+	}
+
+	/* the timer fires when the next flip event is due */
+	fake.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(fake.fd < 0) {
+		printf("fake kms: timerfd_create failed\n");
+		return -1;
+	}
+
+	fake.count_planes = 1 + overlays;
+	env = getenv("FAKEKMS_MAX_ACTIVE");
+	fake.max_active = env ? atoi(env) : fake.count_planes;
+	fake_mode(width, height, refresh);
+	fake.period_nsec = 1000000000ULL / refresh;
+	fake.epoch_nsec = now_nsec() - fake.period_nsec;
+	fake.next_fb_id = 1;
+	fake.next_blob_id = FAKE_BLOB_ID;
+	fake.next_handle = 1;
+
+	uint32_t in_formats = create_in_formats();
+	for(count = 0; count < fake.count_planes; count++) {
+		uint64_t *values = fake.state.values[OBJ_PLANE + count];
+
+		values[PROP_TYPE] = count ? DRM_PLANE_TYPE_OVERLAY : DRM_PLANE_TYPE_PRIMARY;
+		values[PROP_ZPOS] = count;
+		values[PROP_IN_FORMATS] = in_formats;
+		values[PROP_IN_FENCE_FD] = (uint64_t)-1;
+		fake.in_fences[count] = -1;
+	}
+
+	printf("fake kms: %dx%d@%d, connector %d, 1 primary and %d overlay planes, %d at once\n",
+			width, height, refresh, FAKE_CONNECTOR_ID, overlays, fake.max_active);
+
+	return fake.fd;
+}
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static PFNEGLCREATESYNCKHRPROC create_sync;
+static PFNEGLCLIENTWAITSYNCKHRPROC client_wait_sync;
+
+static void open_egl_display (void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+	create_sync = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+	client_wait_sync = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+
+	if(get_platform_display)
+		egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+				EGL_DEFAULT_DISPLAY, NULL);
+	if(egl_display == EGL_NO_DISPLAY)
+		printf("fake kms: surfaceless display not available\n");
+}
+
+EGLDisplay fake_kms_egl_display (void)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, open_egl_display);
+
+	return egl_display;
+}
+
+/* a plain fence, its fd comes from fake_kms_dup_fence_fd */
+EGLSyncKHR fake_kms_create_sync (EGLDisplay display, EGLenum type, const EGLint *attribs)
+{
+	if(!create_sync || !client_wait_sync)
+		return EGL_NO_SYNC_KHR;
+
+	return create_sync(display, EGL_SYNC_FENCE_KHR, NULL);
+}
+
+EGLint fake_kms_dup_fence_fd (EGLDisplay display, EGLSyncKHR sync)
+{
+	uint64_t one = 1;
+	int fd;
+
+	/* the frame was finished before the swap, this does not block */
+	if(client_wait_sync(display, sync, 0, EGL_FOREVER_KHR) != EGL_CONDITION_SATISFIED_KHR)
+		return EGL_NO_NATIVE_FENCE_FD_ANDROID;
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(fd >= 0)
+		write(fd, &one, sizeof(one));
+
+	return fd;
+}
+
+/* libdrm */
+
+int drmSetMaster (int fd)
+{
+	return fd == fake.fd ? 0 : -EINVAL;
+}
+
+int drmSetClientCap (int fd, uint64_t capability, uint64_t value)
+{
+	if(capability == DRM_CLIENT_CAP_ATOMIC || capability == DRM_CLIENT_CAP_UNIVERSAL_PLANES)
+		return 0;
+
+	return -EINVAL;
+}
+
+int drmGetCap (int fd, uint64_t capability, uint64_t *value)
+{
+	switch(capability) {
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+	case DRM_CAP_ADDFB2_MODIFIERS:
+		*value = 1;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+drmModeResPtr drmModeGetResources (int fd)
+{
+	drmModeResPtr res = calloc(1, sizeof(*res));
+
+	if(!res)
+		return NULL;
+
+	res->count_crtcs = res->count_connectors = res->count_encoders = 1;
+	res->crtcs = malloc(sizeof(uint32_t));
+	res->connectors = malloc(sizeof(uint32_t));
+	res->encoders = malloc(sizeof(uint32_t));
+	if(!res->crtcs || !res->connectors || !res->encoders) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+	res->crtcs[0] = FAKE_CRTC_ID;
+	res->connectors[0] = FAKE_CONNECTOR_ID;
+	res->encoders[0] = FAKE_ENCODER_ID;
+	res->max_width = res->max_height = 8192;
+
+	return res;
+}
+
+void drmModeFreeResources (drmModeResPtr res)
+{
+	if(!res)
+		return;
+	free(res->crtcs);
+	free(res->connectors);
+	free(res->encoders);
+	free(res);
+}
+
+drmModeConnectorPtr drmModeGetConnector (int fd, uint32_t connector_id)
+{
+	drmModeConnectorPtr connector;
+
+	if(connector_id != FAKE_CONNECTOR_ID)
+		return NULL;
+
+	connector = calloc(1, sizeof(*connector));
+	if(!connector)
+		return NULL;
+
+	connector->connector_id = FAKE_CONNECTOR_ID;
+	connector->encoder_id = FAKE_ENCODER_ID;
+	connector->connection = DRM_MODE_CONNECTED;
+	connector->count_modes = 1;
+	connector->modes = malloc(sizeof(fake.mode));
+	if(connector->modes)
+		*connector->modes = fake.mode;
+	connector->count_encoders = 1;
+	connector->encoders = malloc(sizeof(uint32_t));
+	if(connector->encoders)
+		connector->encoders[0] = FAKE_ENCODER_ID;
+
+	return connector;
+}
+
+void drmModeFreeConnector (drmModeConnectorPtr connector)
+{
+	if(!connector)
+		return;
+	free(connector->modes);
+	free(connector->encoders);
+	free(connector);
+}
+
+drmModeEncoderPtr drmModeGetEncoder (int fd, uint32_t encoder_id)
+{
+	drmModeEncoderPtr encoder;
+
+	if(encoder_id != FAKE_ENCODER_ID)
+		return NULL;
+
+	encoder = calloc(1, sizeof(*encoder));
+	if(!encoder)
+		return NULL;
+
+	encoder->encoder_id = FAKE_ENCODER_ID;
+	encoder->crtc_id = FAKE_CRTC_ID;
+	encoder->possible_crtcs = 1;
+
+	return encoder;
+}
+
+void drmModeFreeEncoder (drmModeEncoderPtr encoder)
+{
+	free(encoder);
+}
+
+/* the mode is already set, like after the console handed it over */
+drmModeCrtcPtr drmModeGetCrtc (int fd, uint32_t crtc_id)
+{
+	drmModeCrtcPtr crtc;
+
+	if(crtc_id != FAKE_CRTC_ID)
+		return NULL;
+
+	crtc = calloc(1, sizeof(*crtc));
+	if(!crtc)
+		return NULL;
+
+	crtc->crtc_id = FAKE_CRTC_ID;
+	crtc->width = fake.mode.hdisplay;
+	crtc->height = fake.mode.vdisplay;
+	crtc->mode_valid = 1;
+	crtc->mode = fake.mode;
+
+	return crtc;
+}
+
+void drmModeFreeCrtc (drmModeCrtcPtr crtc)
+{
+	free(crtc);
+}
+
+drmModePlaneResPtr drmModeGetPlaneResources (int fd)
+{
+	drmModePlaneResPtr res = calloc(1, sizeof(*res));
+	int count;
+
+	if(!res)
+		return NULL;
+
+	res->planes = calloc(fake.count_planes, sizeof(uint32_t));
+	if(!res->planes) {
+		free(res);
+		return NULL;
+	}
+	res->count_planes = fake.count_planes;
+	for(count = 0; count < fake.count_planes; count++)
+		res->planes[count] = FAKE_PLANE_ID + count;
+
+	return res;
+}
+
+void drmModeFreePlaneResources (drmModePlaneResPtr res)
+{
+	if(!res)
+		return;
+	free(res->planes);
+	free(res);
+}
+
+drmModePlanePtr drmModeGetPlane (int fd, uint32_t plane_id)
+{
+	int obj = object_index(plane_id);
+	drmModePlanePtr plane;
+
+	if(obj < OBJ_PLANE)
+		return NULL;
+
+	plane = calloc(1, sizeof(*plane));
+	if(!plane)
+		return NULL;
+
+	plane->formats = malloc(sizeof(fake_formats));
+	if(!plane->formats) {
+		free(plane);
+		return NULL;
+	}
+	memcpy(plane->formats, fake_formats, sizeof(fake_formats));
+	plane->count_formats = sizeof(fake_formats) / sizeof(fake_formats[0]);
+	plane->plane_id = plane_id;
+	plane->crtc_id = fake.state.values[obj][PROP_CRTC_ID];
+	plane->fb_id = fake.state.values[obj][PROP_FB_ID];
+	plane->possible_crtcs = 1;
+
+	return plane;
+}
+
+void drmModeFreePlane (drmModePlanePtr plane)
+{
+	if(!plane)
+		return;
+	free(plane->formats);
+	free(plane);
+}
+
+drmModeObjectPropertiesPtr drmModeObjectGetProperties (int fd, uint32_t object_id,
+		uint32_t object_type)
+{
+	int obj = object_index(object_id);
+	drmModeObjectPropertiesPtr props;
+	int prop;
+
+	if(obj < 0)
+		return NULL;
+
+	props = calloc(1, sizeof(*props));
+	if(!props)
+		return NULL;
+	props->props = calloc(NUM_PROPS, sizeof(uint32_t));
+	props->prop_values = calloc(NUM_PROPS, sizeof(uint64_t));
+	if(!props->props || !props->prop_values) {
+		drmModeFreeObjectProperties(props);
+		return NULL;
+	}
+
+	for(prop = 0; prop < NUM_PROPS; prop++) {
+		if(!object_has_prop(obj, prop))
+			continue;
+		props->props[props->count_props] = FAKE_PROP_ID + prop;
+		props->prop_values[props->count_props] = fake.state.values[obj][prop];
+		props->count_props++;
+	}
+
+	return props;
+}
+
+void drmModeFreeObjectProperties (drmModeObjectPropertiesPtr props)
+{
+	if(!props)
+		return;
+	free(props->props);
+	free(props->prop_values);
+	free(props);
+}
+
+drmModePropertyPtr drmModeGetProperty (int fd, uint32_t property_id)
+{
+	int prop = property_id - FAKE_PROP_ID;
+	drmModePropertyPtr property;
+
+	if(prop < 0 || prop >= NUM_PROPS)
+		return NULL;
+
+	property = calloc(1, sizeof(*property));
+	if(!property)
+		return NULL;
+
+	property->prop_id = property_id;
+	property->flags = prop_info[prop].flags;
+	snprintf(property->name, sizeof(property->name), "%s", prop_info[prop].name);
+
+	if(prop_info[prop].flags & (DRM_MODE_PROP_RANGE | DRM_MODE_PROP_SIGNED_RANGE)) {
+		property->values = calloc(2, sizeof(uint64_t));
+		if(!property->values) {
+			free(property);
+			return NULL;
+		}
+		property->count_values = 2;
+		if(prop == PROP_ZPOS) {
+			property->values[0] = 1;
+			property->values[1] = fake.count_planes - 1;
+		} else if(prop == PROP_ACTIVE) {
+			property->values[1] = 1;
+		} else if(prop == PROP_IN_FENCE_FD) {
+			property->values[0] = (uint64_t)-1;
+			property->values[1] = INT32_MAX;
+		} else if(prop == PROP_OUT_FENCE_PTR) {
+			property->values[1] = UINT64_MAX;
+		} else if(prop != PROP_ZPOS_PRIMARY) {
+			property->values[1] = prop_info[prop].flags & DRM_MODE_PROP_SIGNED_RANGE ?
+				INT32_MAX : UINT32_MAX;
+		}
+	}
+
+	return property;
+}
+
+void drmModeFreeProperty (drmModePropertyPtr property)
+{
+	if(!property)
+		return;
+	free(property->values);
+	free(property);
+}
+
+int drmModeCreatePropertyBlob (int fd, const void *data, size_t size, uint32_t *id)
+{
+	struct fake_blob *blob = find_blob(0);
+	int count;
+
+	for(count = 0; count < FAKE_MAX_BLOBS && !blob; count++)
+		if(!fake.blobs[count].id)
+			blob = &fake.blobs[count];
+	if(!blob)
+		return -ENOSPC;
+
+	blob->data = malloc(size);
+	if(!blob->data)
+		return -ENOMEM;
+	memcpy(blob->data, data, size);
+	blob->length = size;
+	blob->id = fake.next_blob_id++;
+	*id = blob->id;
+
+	return 0;
+}
+
+int drmModeDestroyPropertyBlob (int fd, uint32_t id)
+{
+	struct fake_blob *blob = find_blob(id);
+
+	if(!blob)
+		return -ENOENT;
+
+	free(blob->data);
+	blob->id = 0;
+
+	return 0;
+}
+
+drmModePropertyBlobPtr drmModeGetPropertyBlob (int fd, uint32_t blob_id)
+{
+	struct fake_blob *blob = find_blob(blob_id);
+	drmModePropertyBlobPtr res;
+
+	if(!blob)
+		return NULL;
+
+	res = calloc(1, sizeof(*res));
+	if(!res)
+		return NULL;
+	res->data = malloc(blob->length);
+	if(!res->data) {
+		free(res);
+		return NULL;
+	}
+	memcpy(res->data, blob->data, blob->length);
+	res->id = blob->id;
+	res->length = blob->length;
+
+	return res;
+}
+
+void drmModeFreePropertyBlob (drmModePropertyBlobPtr blob)
+{
+	if(!blob)
+		return;
+	free(blob->data);
+	free(blob);
+}
+
+int drmModeAddFB2WithModifiers (int fd, uint32_t width, uint32_t height, uint32_t pixel_format,
+		const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+		const uint64_t modifier[4], uint32_t *buf_id, uint32_t flags)
+{
+	uint64_t mod = flags & DRM_MODE_FB_MODIFIERS ? modifier[0] : DRM_FORMAT_MOD_INVALID;
+	int count;
+
+	if(!fake_format_supported(pixel_format) || !bo_handles[0] ||
+			pitches[0] < width * (pixel_format == DRM_FORMAT_RGB565 ? 2 : 4))
+		return -EINVAL;
+	if(mod != DRM_FORMAT_MOD_INVALID && mod != DRM_FORMAT_MOD_LINEAR)
+		return -EINVAL;
+
+	for(count = 0; count < FAKE_MAX_FBS; count++) {
+		struct fake_fb *fb = &fake.fbs[count];
+
+		if(fb->id)
+			continue;
+		fb->id = fake.next_fb_id++;
+		fb->width = width;
+		fb->height = height;
+		fb->format = pixel_format;
+		fb->modifier = mod;
+		*buf_id = fb->id;
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+int drmModeAddFB2 (int fd, uint32_t width, uint32_t height, uint32_t pixel_format,
+		const uint32_t bo_handles[4], const uint32_t pitches[4], const uint32_t offsets[4],
+		uint32_t *buf_id, uint32_t flags)
+{
+	return drmModeAddFB2WithModifiers(fd, width, height, pixel_format, bo_handles,
+			pitches, offsets, NULL, buf_id, flags & ~DRM_MODE_FB_MODIFIERS);
+}
+
+int drmModeRmFB (int fd, uint32_t buffer_id)
+{
+	struct fake_fb *fb = find_fb(buffer_id);
+
+	if(!fb)
+		return -ENOENT;
+
+	fb->id = 0;
+
+	return 0;
+}
+
+drmModeAtomicReqPtr drmModeAtomicAlloc (void)
+{
+	return calloc(1, sizeof(struct _drmModeAtomicReq));
+}
+
+void drmModeAtomicFree (drmModeAtomicReqPtr req)
+{
+	if(!req)
+		return;
+	free(req->items);
+	free(req);
+}
+
+void drmModeAtomicSetCursor (drmModeAtomicReqPtr req, int cursor)
+{
+	req->cursor = cursor;
+}
+
+int drmModeAtomicGetCursor (drmModeAtomicReqPtr req)
+{
+	return req->cursor;
+}
+
+int drmModeAtomicAddProperty (drmModeAtomicReqPtr req, uint32_t object_id,
+		uint32_t property_id, uint64_t value)
+{
+	if(req->cursor == req->size) {
+		int size = req->size ? req->size * 2 : 64;
+		struct _drmModeAtomicReqItem *items = realloc(req->items, size * sizeof(*items));
+
+		if(!items)
+			return -ENOMEM;
+		req->items = items;
+		req->size = size;
+	}
+
+	req->items[req->cursor].object_id = object_id;
+	req->items[req->cursor].property_id = property_id;
+	req->items[req->cursor].value = value;
+
+	return ++req->cursor;
+}
+
+/* what the kernel checks before a commit, roughly */
+static int check_state (struct fake_state *state, uint32_t flags)
+{
+	uint64_t *crtc = state->values[OBJ_CRTC];
+	struct fake_blob *mode = find_blob(crtc[PROP_MODE_ID]);
+	int active = crtc[PROP_ACTIVE] && mode;
+	int count, enabled = 0;
+
+	if(crtc[PROP_ACTIVE] && (!mode || mode->length != sizeof(drmModeModeInfo)))
+		return -EINVAL;
+
+	if(memcmp(state->values[OBJ_CRTC], fake.state.values[OBJ_CRTC],
+				sizeof(state->values[OBJ_CRTC])) ||
+			memcmp(state->values[OBJ_CONNECTOR], fake.state.values[OBJ_CONNECTOR],
+				sizeof(state->values[OBJ_CONNECTOR]))) {
+		if(!(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+			return -EINVAL;
+	}
+
+	for(count = 0; count < fake.count_planes; count++) {
+		uint64_t *plane = state->values[OBJ_PLANE + count];
+		struct fake_fb *fb = find_fb(plane[PROP_FB_ID]);
+
+		if(!plane[PROP_FB_ID] && !plane[PROP_CRTC_ID])
+			continue;
+		if(!fb || plane[PROP_CRTC_ID] != FAKE_CRTC_ID || !active)
+			return -EINVAL;
+
+		/* 16.16 source inside the framebuffer, a visible destination */
+		if(plane[PROP_SRC_X] + plane[PROP_SRC_W] > (uint64_t)fb->width << 16 ||
+				plane[PROP_SRC_Y] + plane[PROP_SRC_H] > (uint64_t)fb->height << 16 ||
+				!plane[PROP_SRC_W] || !plane[PROP_SRC_H] ||
+				!plane[PROP_CRTC_W] || !plane[PROP_CRTC_H])
+			return -EINVAL;
+
+		enabled++;
+	}
+
+	if(enabled > fake.max_active)
+		return -ENOSPC;
+
+	return 0;
+}
+
+static void arm_event (unsigned int seq)
+{
+	struct itimerspec timer = { { 0, 0 }, { 0, 0 } };
+
+	fake.event_seq = seq;
+	timer.it_value.tv_sec = vblank_nsec(seq) / 1000000000ULL;
+	timer.it_value.tv_nsec = vblank_nsec(seq) % 1000000000ULL;
+	timerfd_settime(fake.fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+/*
+ * Any fd that polls readable once signalled stands in for a sync_file,
+ * the render fences of this build are eventfds. Closes the signalled ones.
+ */
+static int in_fences_signalled (int timeout_msec)
+{
+	struct pollfd pfd;
+	int count, ret;
+
+	for(count = 0; count < fake.count_planes; count++) {
+		if(fake.in_fences[count] < 0)
+			continue;
+
+		pfd.fd = fake.in_fences[count];
+		pfd.events = POLLIN;
+		while((ret = poll(&pfd, 1, timeout_msec)) < 0 && errno == EINTR)
+			;
+		if(ret <= 0)
+			return 0;
+
+		close(fake.in_fences[count]);
+		fake.in_fences[count] = -1;
+	}
+
+	return 1;
+}
+
+/* the buffers the commit replaced are off screen now */
+static void signal_out_fence (void)
+{
+	uint64_t one = 1;
+
+	if(fake.out_fence < 0)
+		return;
+
+	write(fake.out_fence, &one, sizeof(one));
+	close(fake.out_fence);
+	fake.out_fence = -1;
+}
+
+int drmModeAtomicCommit (int fd, drmModeAtomicReqPtr req, uint32_t flags, void *user_data)
+{
+	struct fake_state state = fake.state;
+	int in_fences[FAKE_MAX_PLANES];
+	int32_t *out_fence_ptr = NULL;
+	int count, ret;
+
+	if(fake.event_pending && !(flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		return -EBUSY;
+
+	for(count = 0; count < fake.count_planes; count++)
+		in_fences[count] = -1;
+
+	for(count = 0; count < req->cursor; count++) {
+		struct _drmModeAtomicReqItem *item = &req->items[count];
+		int obj = object_index(item->object_id);
+		int prop = item->property_id - FAKE_PROP_ID;
+
+		if(obj < 0 || prop < 0 || prop >= NUM_PROPS || !object_has_prop(obj, prop) ||
+				prop_info[prop].flags & DRM_MODE_PROP_IMMUTABLE)
+			return -EINVAL;
+
+		/* the fences belong to this commit, they are not part of the state */
+		if(prop == PROP_IN_FENCE_FD) {
+			in_fences[obj - OBJ_PLANE] = (int)item->value;
+			if(in_fences[obj - OBJ_PLANE] >= 0 &&
+					fcntl(in_fences[obj - OBJ_PLANE], F_GETFD) < 0)
+				return -EINVAL;
+			continue;
+		}
+		if(prop == PROP_OUT_FENCE_PTR) {
+			out_fence_ptr = (int32_t *)(uintptr_t)item->value;
+			continue;
+		}
+
+		state.values[obj][prop] = item->value;
+	}
+
+	ret = check_state(&state, flags);
+	if(ret || flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return ret;
+
+	/* an eventfd, the caller gets one end and the flip writes the other */
+	if(out_fence_ptr) {
+		int out_fence = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+		if(out_fence < 0)
+			return -ENOMEM;
+		fake.out_fence = fcntl(out_fence, F_DUPFD_CLOEXEC, 0);
+		if(fake.out_fence < 0) {
+			close(out_fence);
+			return -ENOMEM;
+		}
+		*out_fence_ptr = out_fence;
+	}
+
+	/* the caller closes its in-fences after the commit, keep references */
+	for(count = 0; count < fake.count_planes; count++)
+		fake.in_fences[count] = in_fences[count] >= 0 ?
+			fcntl(in_fences[count], F_DUPFD_CLOEXEC, 0) : -1;
+
+	fake.state = state;
+
+	/* latched at the next vblank, a blocking commit waits for it */
+	if(flags & (DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK)) {
+		fake.event_data = user_data;
+		fake.send_event = (flags & DRM_MODE_PAGE_FLIP_EVENT) != 0;
+		fake.event_pending = 1;
+		arm_event(vblank_seq(now_nsec()) + 1);
+	}
+	if(!(flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+		drmVBlank vbl;
+
+		in_fences_signalled(-1);
+
+		memset(&vbl, 0, sizeof(vbl));
+		vbl.request.type = DRM_VBLANK_RELATIVE;
+		vbl.request.sequence = 1;
+		drmWaitVBlank(fd, &vbl);
+
+		if(!fake.event_pending)
+			signal_out_fence();
+	}
+
+	return 0;
+}
+
+int drmHandleEvent (int fd, drmEventContextPtr evctx)
+{
+	uint64_t expirations;
+	unsigned long long when;
+
+	/* nonblocking, the event may have been handled with an earlier wakeup */
+	read(fd, &expirations, sizeof(expirations));
+
+	if(!fake.event_pending || now_nsec() < vblank_nsec(fake.event_seq))
+		return 0;
+
+	/* a buffer is not finished yet, the flip misses this vblank */
+	if(!in_fences_signalled(0)) {
+		arm_event(vblank_seq(now_nsec()) + 1);
+		return 0;
+	}
+
+	fake.event_pending = 0;
+	signal_out_fence();
+	when = vblank_nsec(fake.event_seq);
+	if(fake.send_event && evctx->page_flip_handler)
+		evctx->page_flip_handler(fd, fake.event_seq, when / 1000000000ULL,
+				when % 1000000000ULL / 1000, fake.event_data);
+
+	return 0;
+}
+
+int drmWaitVBlank (int fd, drmVBlankPtr vbl)
+{
+	unsigned int seq = vbl->request.sequence;
+	unsigned long long when;
+	struct timespec t;
+
+	if(vbl->request.type & DRM_VBLANK_RELATIVE)
+		seq += vblank_seq(now_nsec());
+
+	when = vblank_nsec(seq);
+	t.tv_sec = when / 1000000000ULL;
+	t.tv_nsec = when % 1000000000ULL;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+		;
+
+	vbl->reply.sequence = seq;
+	vbl->reply.tval_sec = t.tv_sec;
+	vbl->reply.tval_usec = t.tv_nsec / 1000;
+
+	return 0;
+}
+
+/* libgbm */
+
+struct gbm_device *gbm_create_device (int fd)
+{
+	struct gbm_device *dev = calloc(1, sizeof(*dev));
+
+	if(dev)
+		dev->fd = fd;
+
+	return dev;
+}
+
+void gbm_device_destroy (struct gbm_device *dev)
+{
+	free(dev);
+}
+
+static void bo_init (struct gbm_bo *bo, struct gbm_device *dev, uint32_t width,
+		uint32_t height, uint32_t format, uint64_t modifier)
+{
+	uint32_t cpp = format == GBM_FORMAT_RGB565 ? 2 : 4;
+
+	memset(bo, 0, sizeof(*bo));
+	bo->dev = dev;
+	bo->width = width;
+	bo->height = height;
+	bo->format = format;
+	bo->stride = (width * cpp + 63) & ~63;
+	bo->modifier = modifier;
+	bo->handle = __atomic_fetch_add(&fake.next_handle, 1, __ATOMIC_RELAXED);
+}
+
+static void bo_fini (struct gbm_bo *bo)
+{
+	if(bo->destroy_user_data)
+		bo->destroy_user_data(bo, bo->user_data);
+	bo->destroy_user_data = NULL;
+	bo->user_data = NULL;
+}
+
+/* linear if the list has it, which is all the planes take */
+static uint64_t pick_modifier (const uint64_t *modifiers, unsigned int count)
+{
+	unsigned int i;
+
+	for(i = 0; i < count; i++)
+		if(modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			return DRM_FORMAT_MOD_LINEAR;
+
+	return DRM_FORMAT_MOD_INVALID;
+}
+
+struct gbm_bo *gbm_bo_create (struct gbm_device *dev, uint32_t width, uint32_t height,
+		uint32_t format, uint32_t flags)
+{
+	struct gbm_bo *bo;
+
+	if(!fake_format_supported(format))
+		return NULL;
+
+	bo = malloc(sizeof(*bo));
+	if(bo)
+		bo_init(bo, dev, width, height, format, DRM_FORMAT_MOD_INVALID);
+
+	return bo;
+}
+
+struct gbm_bo *gbm_bo_create_with_modifiers (struct gbm_device *dev, uint32_t width,
+		uint32_t height, uint32_t format, const uint64_t *modifiers, const unsigned int count)
+{
+	uint64_t modifier = pick_modifier(modifiers, count);
+	struct gbm_bo *bo;
+
+	if(!fake_format_supported(format) || modifier == DRM_FORMAT_MOD_INVALID)
+		return NULL;
+
+	bo = malloc(sizeof(*bo));
+	if(bo)
+		bo_init(bo, dev, width, height, format, modifier);
+
+	return bo;
+}
+
+void gbm_bo_destroy (struct gbm_bo *bo)
+{
+	bo_fini(bo);
+	free(bo);
+}
+
+uint32_t gbm_bo_get_width (struct gbm_bo *bo)
+{
+	return bo->width;
+}
+
+uint32_t gbm_bo_get_height (struct gbm_bo *bo)
+{
+	return bo->height;
+}
+
+uint32_t gbm_bo_get_format (struct gbm_bo *bo)
+{
+	return bo->format;
+}
+
+uint32_t gbm_bo_get_stride (struct gbm_bo *bo)
+{
+	return bo->stride;
+}
+
+uint32_t gbm_bo_get_stride_for_plane (struct gbm_bo *bo, int plane)
+{
+	return plane ? 0 : bo->stride;
+}
+
+uint32_t gbm_bo_get_offset (struct gbm_bo *bo, int plane)
+{
+	return 0;
+}
+
+int gbm_bo_get_plane_count (struct gbm_bo *bo)
+{
+	return 1;
+}
+
+uint64_t gbm_bo_get_modifier (struct gbm_bo *bo)
+{
+	return bo->modifier;
+}
+
+struct gbm_device *gbm_bo_get_device (struct gbm_bo *bo)
+{
+	return bo->dev;
+}
+
+union gbm_bo_handle gbm_bo_get_handle (struct gbm_bo *bo)
+{
+	union gbm_bo_handle handle;
+
+	handle.u64 = 0;
+	handle.u32 = bo->handle;
+
+	return handle;
+}
+
+union gbm_bo_handle gbm_bo_get_handle_for_plane (struct gbm_bo *bo, int plane)
+{
+	return gbm_bo_get_handle(bo);
+}
+
+/* there is no memory to share, the GPU composition uses stand-ins */
+int gbm_bo_get_fd (struct gbm_bo *bo)
+{
+	return -1;
+}
+
+void gbm_bo_set_user_data (struct gbm_bo *bo, void *data,
+		void (*destroy_user_data)(struct gbm_bo *, void *))
+{
+	bo->user_data = data;
+	bo->destroy_user_data = destroy_user_data;
+}
+
+void *gbm_bo_get_user_data (struct gbm_bo *bo)
+{
+	return bo->user_data;
+}
+
+static struct gbm_surface *surface_create (struct gbm_device *dev, uint32_t width,
+		uint32_t height, uint32_t format, uint64_t modifier)
+{
+	struct gbm_surface *surf;
+	int count;
+
+	if(!fake_format_supported(format))
+		return NULL;
+
+	surf = calloc(1, sizeof(*surf));
+	if(!surf)
+		return NULL;
+
+	pthread_mutex_init(&surf->lock, NULL);
+	for(count = 0; count < FAKE_SURFACE_BUFFERS; count++) {
+		bo_init(&surf->bos[count], dev, width, height, format, modifier);
+		surf->bos[count].surf = surf;
+	}
+
+	return surf;
+}
+
+struct gbm_surface *gbm_surface_create (struct gbm_device *dev, uint32_t width,
+		uint32_t height, uint32_t format, uint32_t flags)
+{
+	return surface_create(dev, width, height, format, DRM_FORMAT_MOD_INVALID);
+}
+
+struct gbm_surface *gbm_surface_create_with_modifiers (struct gbm_device *dev,
+		uint32_t width, uint32_t height, uint32_t format,
+		const uint64_t *modifiers, const unsigned int count)
+{
+	uint64_t modifier = pick_modifier(modifiers, count);
+
+	if(modifier == DRM_FORMAT_MOD_INVALID)
+		return NULL;
+
+	return surface_create(dev, width, height, format, modifier);
+}
+
+void gbm_surface_destroy (struct gbm_surface *surf)
+{
+	int count;
+
+	for(count = 0; count < FAKE_SURFACE_BUFFERS; count++)
+		bo_fini(&surf->bos[count]);
+	pthread_mutex_destroy(&surf->lock);
+	free(surf);
+}
+
+/* the pbuffer was drawn, hand out the next buffer as if it held the frame */
+struct gbm_bo *gbm_surface_lock_front_buffer (struct gbm_surface *surf)
+{
+	struct gbm_bo *bo = NULL;
+	int count;
+
+	pthread_mutex_lock(&surf->lock);
+	for(count = 0; count < FAKE_SURFACE_BUFFERS; count++) {
+		struct gbm_bo *b = &surf->bos[(surf->next + count) % FAKE_SURFACE_BUFFERS];
+
+		if(b->locked)
+			continue;
+		b->locked = 1;
+		surf->next = (surf->next + count + 1) % FAKE_SURFACE_BUFFERS;
+		bo = b;
+		break;
+	}
+	pthread_mutex_unlock(&surf->lock);
+
+	return bo;
+}
+
+void gbm_surface_release_buffer (struct gbm_surface *surf, struct gbm_bo *bo)
+{
+	pthread_mutex_lock(&surf->lock);
+	bo->locked = 0;
+	pthread_mutex_unlock(&surf->lock);
+}
+
+int gbm_surface_has_free_buffers (struct gbm_surface *surf)
+{
+	int count, free_buffers = 0;
+
+	pthread_mutex_lock(&surf->lock);
+	for(count = 0; count < FAKE_SURFACE_BUFFERS; count++)
+		if(!surf->bos[count].locked)
+			free_buffers++;
+	pthread_mutex_unlock(&surf->lock);
+
+	return free_buffers;
+}
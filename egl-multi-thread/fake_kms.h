@@ -0,0 +1,50 @@
+#ifndef __FAKE_KMS_H__
+#define __FAKE_KMS_H__
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/*
+ * Stand-in for the KMS device and GBM, linked instead of libdrm and
+ * libgbm by the fakekms build, so the DRM backend and its compositor loop
+ * run and can be benchmarked without a display.
+ *
+ * It emulates one CRTC driving connector 24 (the default of --connector),
+ * a primary plane and a number of overlay planes with their properties,
+ * IN_FORMATS and SCALING_FILTER, TEST_ONLY and real atomic commits, and
+ * page flip events on a vblank clock of the simulated refresh rate. No
+ * cursor plane, and GBM buffers have no memory behind them: the render
+ * threads draw into pbuffers on a surfaceless EGL display, and the GPU
+ * composition samples a texture of each buffer's size in its place, so it
+ * costs what it would but shows nothing. Surfaces that get no overlay plane
+ * are composited, e.g. FAKEKMS_PLANES=1 composites all but the first one.
+ *
+ * Explicit fencing works like on a real device: a plane's IN_FENCE_FD
+ * holds back its commit, which then misses the vblank, until the fence
+ * polls readable, and OUT_FENCE_PTR receives an eventfd that signals at
+ * the vblank that takes the commit's buffers on screen and so retires the
+ * ones they replaced.
+ *
+ * Configured from the environment:
+ *   FAKEKMS_MODE=<W>x<H>@<Hz>  the mode, 1920x1080@60 by default
+ *   FAKEKMS_PLANES=<N>         overlay planes, 3 by default
+ *   FAKEKMS_MAX_ACTIVE=<N>     planes the CRTC can show at once, more fail
+ *                              the commit like a bandwidth limit would,
+ *                              all of them by default
+ */
+
+/* the device fd, readable when a flip event is due */
+int fake_kms_open (void);
+
+/* the display the render threads use instead of one on the GBM device */
+EGLDisplay fake_kms_egl_display (void);
+
+/*
+ * Stand-ins for eglCreateSyncKHR and eglDupNativeFenceFDANDROID, which the
+ * surfaceless display lacks: the render fence is an eventfd that is
+ * signalled once the frame is finished.
+ */
+EGLSyncKHR fake_kms_create_sync (EGLDisplay display, EGLenum type, const EGLint *attribs);
+EGLint fake_kms_dup_fence_fd (EGLDisplay display, EGLSyncKHR sync);
+
+#endif /*__FAKE_KMS_H__*/
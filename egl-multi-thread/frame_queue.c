@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+#include <gbm/gbm.h>
+#endif
+
+#include "frame_queue.h"
+
+int frame_queue_init (struct frame_queue *queue, struct gbm_surface *surf)
+{
+	int count;
+
+	queue->surf = surf;
+	queue->produced = 0;
+	queue->latched = 0;
+	queue->released = 0;
+	queue->ready = NULL;
+	queue->returned_head = 0;
+	queue->returned_tail = 0;
+	queue->notify = NULL;
+
+	for(count = 0; count < FRAME_QUEUE_RECORDS; count++) {
+		queue->records[count].busy = 0;
+		queue->records[count].fence_fd = -1;
+	}
+
+	queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(queue->event_fd < 0) {
+		printf("failed to create frame eventfd\n");
+		return -1;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+
+	return 0;
+}
+
+void frame_queue_release (struct frame_queue *queue, struct gbm_bo *bo)
+{
+	unsigned int head = queue->returned_head;
+
+	/* the surface has fewer buffers than the ring has room */
+	queue->returned[head % FRAME_QUEUE_RETURNS] = bo;
+	__atomic_store_n(&queue->returned_head, head + 1, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&queue->released, 1, __ATOMIC_RELEASE);
+}
+
+void frame_queue_reclaim (struct frame_queue *queue)
+{
+	unsigned int head = __atomic_load_n(&queue->returned_head, __ATOMIC_ACQUIRE);
+
+	while(queue->returned_tail != head) {
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+		gbm_surface_release_buffer(queue->surf,
+				queue->returned[queue->returned_tail % FRAME_QUEUE_RETURNS]);
+#endif
+		__atomic_store_n(&queue->returned_tail, queue->returned_tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* on the render side, so the buffer goes straight back to GBM */
+static void frame_drop (struct frame_queue *queue, struct frame *frame)
+{
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	if(frame->bo)
+		gbm_surface_release_buffer(queue->surf, frame->bo);
+#endif
+	if(frame->bo)
+		__atomic_add_fetch(&queue->released, 1, __ATOMIC_RELEASE);
+	if(frame->fence_fd >= 0)
+		close(frame->fence_fd);
+
+	__atomic_store_n(&frame->busy, 0, __ATOMIC_RELEASE);
+}
+
+void frame_queue_publish (struct frame_queue *queue, struct frame *next)
+{
+	struct frame *frame = NULL, *old;
+	uint64_t one = 1;
+	int count;
+
+	/* at most two records are busy here, see FRAME_QUEUE_RECORDS */
+	for(count = 0; count < FRAME_QUEUE_RECORDS; count++) {
+		if(!__atomic_load_n(&queue->records[count].busy, __ATOMIC_ACQUIRE)) {
+			frame = &queue->records[count];
+			break;
+		}
+	}
+
+	*frame = *next;
+	frame->seq = queue->produced + 1;
+	frame->busy = 1;
+
+	old = __atomic_exchange_n(&queue->ready, frame, __ATOMIC_ACQ_REL);
+	if(old)
+		frame_drop(queue, old);
+
+	__atomic_store_n(&queue->produced, frame->seq, __ATOMIC_RELEASE);
+	write(queue->event_fd, &one, sizeof(one));
+}
+
+int frame_queue_ready (struct frame_queue *queue)
+{
+	return __atomic_load_n(&queue->ready, __ATOMIC_ACQUIRE) != NULL;
+}
+
+int frame_queue_take (struct frame_queue *queue, struct frame *frame)
+{
+	struct frame *ready = __atomic_exchange_n(&queue->ready, NULL, __ATOMIC_ACQ_REL);
+
+	if(!ready)
+		return 0;
+
+	*frame = *ready;
+	__atomic_store_n(&ready->busy, 0, __ATOMIC_RELEASE);
+
+	/* the damage of the dropped frames is lost, so all of it changed */
+	if(frame->seq != queue->latched + 1)
+		frame->damage.full = 1;
+
+	__atomic_store_n(&queue->latched, frame->seq, __ATOMIC_RELEASE);
+
+	frame_queue_signal(queue);
+
+	return 1;
+}
+
+void frame_queue_signal (struct frame_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	if(queue->notify)
+		queue->notify(queue->notify_data);
+}
+
+void frame_damage_reset (struct frame_damage *damage)
+{
+	damage->full = 0;
+	damage->count = 0;
+}
+
+void frame_damage_add (struct frame_damage *damage, int x, int y, int width, int height)
+{
+	struct damage_rect *rect;
+
+	if(width <= 0 || height <= 0)
+		return;
+
+	/* out of rectangles, grow the last one */
+	if(damage->count == FRAME_MAX_DAMAGE) {
+		rect = &damage->rects[FRAME_MAX_DAMAGE - 1];
+		if(x < rect->x1)
+			rect->x1 = x;
+		if(y < rect->y1)
+			rect->y1 = y;
+		if(x + width > rect->x2)
+			rect->x2 = x + width;
+		if(y + height > rect->y2)
+			rect->y2 = y + height;
+		return;
+	}
+
+	rect = &damage->rects[damage->count++];
+	rect->x1 = x;
+	rect->y1 = y;
+	rect->x2 = x + width;
+	rect->y2 = y + height;
+}
+
+unsigned int frame_damage_permille (struct frame_damage *damage, int width, int height)
+{
+	unsigned long long area = 0;
+	int count;
+
+	if(damage->full || width <= 0 || height <= 0)
+		return 1000;
+
+	/* overlapping rectangles are counted twice */
+	for(count = 0; count < damage->count; count++)
+		area += (unsigned long long)(damage->rects[count].x2 - damage->rects[count].x1) *
+			(damage->rects[count].y2 - damage->rects[count].y1);
+
+	area = area * 1000 / ((unsigned long long)width * height);
+
+	return area > 1000 ? 1000 : area;
+}
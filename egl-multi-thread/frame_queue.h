@@ -0,0 +1,114 @@
+#ifndef __FRAME_QUEUE_H__
+#define __FRAME_QUEUE_H__
+
+#include <pthread.h>
+
+struct gbm_surface;
+struct gbm_bo;
+
+/* one record being filled, one in the mailbox, one being taken */
+#define FRAME_QUEUE_RECORDS (3)
+
+/* more than a GBM surface has buffers, a power of two */
+#define FRAME_QUEUE_RETURNS (8)
+
+#define FRAME_MAX_DAMAGE (8)
+
+/* dirty rectangle in surface pixels, origin at the top left */
+struct damage_rect {
+	int x1, y1, x2, y2;
+};
+
+/* what changed in a frame since the previous one */
+struct frame_damage {
+	int full;
+	int count;
+	struct damage_rect rects[FRAME_MAX_DAMAGE];
+};
+
+/* one swapped frame on its way from a render thread to the compositor */
+struct frame {
+	unsigned int seq;	/* 1, 2, ... per queue, a gap on screen is a dropped frame */
+	struct gbm_bo *bo;	/* locked front buffer, NULL without GBM */
+	int fence_fd;		/* render-done fence, -1 if none */
+
+	/* the drawn part, at the bottom left of the buffer, see dynres.h */
+	unsigned int width;
+	unsigned int height;
+
+	/* when drawing it began, the start of its render-to-scanout latency */
+	unsigned long long start_nsec;
+
+	/* marked full by frame_queue_take if frames in between were dropped */
+	struct frame_damage damage;
+
+	int busy;
+};
+
+/*
+ * Mailbox between a render thread and the compositor.
+ *
+ * After every eglSwapBuffers the render thread locks its own front buffer
+ * and publishes it together with its fence in ready, then bumps produced
+ * and signals event_fd (an eventfd) so an event loop can wake up. A frame
+ * the compositor did not take before the next one arrives is dropped and
+ * its buffer goes straight back to GBM. The compositor takes the latest
+ * frame and records its seq in latched. Single producer, single consumer,
+ * no locks.
+ *
+ * The lock and cond are only used for back-pressure: a render thread
+ * that may not start a new frame sleeps on cond until the compositor
+ * calls frame_queue_signal after taking a frame or releasing a buffer.
+ *
+ * A GBM surface is not thread safe, so only the render side locks and
+ * releases its buffers. The compositor hands a buffer back with
+ * frame_queue_release, which puts it on the returned ring (single producer,
+ * single consumer as well) and counts it, so produced - released is the
+ * number the compositor still holds. The render side passes the returned
+ * buffers to GBM with frame_queue_reclaim before it asks the surface for a
+ * free buffer.
+ */
+struct frame_queue {
+	struct gbm_surface *surf;
+
+	unsigned int produced;
+	unsigned int latched;
+	unsigned int released;
+	int event_fd;
+
+	struct frame records[FRAME_QUEUE_RECORDS];
+	struct frame *ready;
+
+	/* written by the compositor at head, read by the render side at tail */
+	struct gbm_bo *returned[FRAME_QUEUE_RETURNS];
+	unsigned int returned_head;
+	unsigned int returned_tail;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* optional, also called by frame_queue_signal, e.g. to wake a render pool */
+	void (*notify) (void *data);
+	void *notify_data;
+};
+
+int frame_queue_init (struct frame_queue *queue, struct gbm_surface *surf);
+
+/* render thread side, everything but seq and busy comes from frame */
+void frame_queue_publish (struct frame_queue *queue, struct frame *frame);
+/* hand the buffers returned by the compositor back to the GBM surface */
+void frame_queue_reclaim (struct frame_queue *queue);
+
+/* compositor side */
+int frame_queue_ready (struct frame_queue *queue);
+int frame_queue_take (struct frame_queue *queue, struct frame *frame);
+void frame_queue_signal (struct frame_queue *queue);
+/* the buffer of a frame goes back to the render side */
+void frame_queue_release (struct frame_queue *queue, struct gbm_bo *bo);
+
+void frame_damage_reset (struct frame_damage *damage);
+void frame_damage_add (struct frame_damage *damage, int x, int y, int width, int height);
+/* damaged share of a width x height frame in 1/1000 */
+unsigned int frame_damage_permille (struct frame_damage *damage, int width, int height);
+
+#endif /*__FRAME_QUEUE_H__*/
@@ -0,0 +1,715 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include <gbm/gbm.h>
+#include <drm_fourcc.h>
+
+#include "gl_composite.h"
+#include "drm_gbm.h"
+#include "frame_queue.h"
+#include "stats.h"
+#include "program_cache.h"
+#include "trace.h"
+#ifdef USE_FAKEKMS
+#include "fake_kms.h"
+#endif
+
+/* damage of this many previous compositions is kept for EGL_EXT_buffer_age */
+#define COMPOSITE_DAMAGE_HISTORY (4)
+
+static const char *composite_vertex_source =
+	"attribute vec2 in_position;        \n"
+	"uniform vec4 rect;                 \n"
+	"uniform vec4 texrect;              \n"
+	"varying vec2 vTexCoord;            \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    vTexCoord = texrect.xy + in_position * texrect.zw;\n"
+	"    gl_Position = vec4(rect.xy + in_position * rect.zw, 0.0, 1.0);\n"
+	"}                                  \n";
+
+static const char *composite_fragment_source =
+	"#extension GL_OES_EGL_image_external : require\n"
+	"precision mediump float;           \n"
+	"                                   \n"
+	"uniform samplerExternalOES tex;    \n"
+	"varying vec2 vTexCoord;            \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    gl_FragColor = texture2D(tex, vTexCoord);\n"
+	"}                                  \n";
+
+/* unit quad, y pointing down like the scanout buffer rows */
+static const GLfloat quad[] = {
+	0.0f, 0.0f,
+	1.0f, 0.0f,
+	0.0f, 1.0f,
+	1.0f, 1.0f,
+};
+
+struct composite_rect {
+	int x1, y1, x2, y2;
+};
+
+/* EGLImage and texture of a layer buffer, kept as the bo's user data */
+struct composite_image {
+	struct gl_composite *comp;
+	EGLImageKHR image;
+	GLuint tex;
+#ifdef USE_FAKEKMS
+	GLuint backing;		/* stands in for the buffer's memory */
+#endif
+};
+
+struct composite_layer {
+	struct plane_data *pdata;
+	struct gbm_bo *bo;	/* frame being shown, NULL until the first one */
+	struct composite_image *image;
+	unsigned int src_width;		/* its drawn part, see dynres.h */
+	unsigned int src_height;
+};
+
+struct gl_composite {
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface surface;
+	struct gbm_surface *gbm_surf;
+	int width;
+	int height;
+
+	GLuint program;
+	GLint rect;
+	GLint texrect;
+	GLuint vbo;
+
+	PFNEGLCREATEIMAGEKHRPROC create_image;
+	PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture;
+	int import_modifiers;	/* EGL_EXT_image_dma_buf_import_modifiers */
+	int buffer_age;
+
+	/* EGL_ANDROID_native_fence_sync and EGL_KHR_wait_sync, NULL without */
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLWAITSYNCKHRPROC wait_sync;
+
+	struct frame_queue queue;
+
+	int count_layers;
+	struct composite_layer layers[MAX_COMPOSITE_LAYERS];
+
+	/* newest first */
+	struct composite_rect damage[COMPOSITE_DAMAGE_HISTORY];
+	int count_damage;
+
+	/* CPU time to submit a composition, render fences are waited for by the GPU */
+	struct stats_hist composite_time;
+};
+
+static int composite_setup_gl(struct gl_composite *comp)
+{
+	static const char *const attribs[] = { "in_position", NULL };
+
+	comp->program = program_cache_create("composite", composite_vertex_source,
+			composite_fragment_source, attribs);
+	if(!comp->program)
+		return -1;
+
+	glUseProgram(comp->program);
+	comp->rect = glGetUniformLocation(comp->program, "rect");
+	comp->texrect = glGetUniformLocation(comp->program, "texrect");
+	glUniform1i(glGetUniformLocation(comp->program, "tex"), 0);
+
+	glGenBuffers(1, &comp->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, comp->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+
+	glViewport(0, 0, comp->width, comp->height);
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+
+	return 0;
+}
+
+static EGLConfig composite_config(EGLDisplay display, uint32_t format)
+{
+	static const EGLint config_attribs[] = {
+#ifdef USE_FAKEKMS
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+#else
+		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+#endif
+		EGL_RED_SIZE, 1,
+		EGL_GREEN_SIZE, 1,
+		EGL_BLUE_SIZE, 1,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	EGLConfig configs[64];
+	EGLint n, count, id;
+
+	if (!eglChooseConfig(display, config_attribs, configs, 64, &n) || n < 1) {
+		printf("composite : no EGL config\n");
+		return NULL;
+	}
+
+	/* the GBM surface needs a config of exactly its format */
+	for(count = 0; count < n; count++) {
+		if(eglGetConfigAttrib(display, configs[count], EGL_NATIVE_VISUAL_ID, &id) &&
+				(uint32_t)id == format)
+			return configs[count];
+	}
+
+#ifdef USE_FAKEKMS
+	/* pbuffer configs have no visual, the composition is always XRGB8888 */
+	for(count = 0; format == DRM_FORMAT_XRGB8888 && count < n; count++) {
+		EGLint red = 0, green = 0, blue = 0, alpha = 0;
+
+		eglGetConfigAttrib(display, configs[count], EGL_RED_SIZE, &red);
+		eglGetConfigAttrib(display, configs[count], EGL_GREEN_SIZE, &green);
+		eglGetConfigAttrib(display, configs[count], EGL_BLUE_SIZE, &blue);
+		eglGetConfigAttrib(display, configs[count], EGL_ALPHA_SIZE, &alpha);
+		if(red == 8 && green == 8 && blue == 8 && alpha == 0)
+			return configs[count];
+	}
+#endif
+
+	printf("composite : no EGL config of format %.4s\n", (char *)&format);
+	return NULL;
+}
+
+struct gl_composite *gl_composite_create(struct gbm_device *gbm_dev,
+		int width, int height, uint32_t format,
+		const uint64_t *modifiers, int count_modifiers)
+{
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	const char *extensions;
+	EGLConfig config;
+	EGLint major, minor;
+#ifdef USE_FAKEKMS
+	const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+#endif
+
+	struct gl_composite *comp = calloc(sizeof(struct gl_composite), 1);
+	if(!comp) {
+		printf("composite data alloc failed\n");
+		return NULL;
+	}
+
+	comp->width = width;
+	comp->height = height;
+
+	if(count_modifiers)
+		comp->gbm_surf = gbm_surface_create_with_modifiers(gbm_dev, width, height, format,
+				modifiers, count_modifiers);
+	if(!comp->gbm_surf)
+		comp->gbm_surf = gbm_surface_create(gbm_dev, width, height, format,
+				GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+	if(!comp->gbm_surf) {
+		printf("composite surface alloc failed\n");
+		return NULL;
+	}
+
+#ifdef USE_FAKEKMS
+	/* the GBM surface has no memory, draw into a pbuffer instead */
+	comp->display = fake_kms_egl_display();
+#else
+	comp->display = eglGetDisplay((EGLNativeDisplayType)gbm_dev);
+#endif
+	if (!eglInitialize(comp->display, &major, &minor)) {
+		printf("composite : failed to initialize EGL\n");
+		return NULL;
+	}
+
+	extensions = eglQueryString(comp->display, EGL_EXTENSIONS);
+#ifdef USE_FAKEKMS
+	if(!extensions || !strstr(extensions, "EGL_KHR_gl_texture_2D_image")) {
+		printf("composite : EGL_KHR_gl_texture_2D_image not supported\n");
+		return NULL;
+	}
+#else
+	if(!extensions || !strstr(extensions, "EGL_EXT_image_dma_buf_import")) {
+		printf("composite : EGL_EXT_image_dma_buf_import not supported\n");
+		return NULL;
+	}
+#endif
+	comp->import_modifiers = strstr(extensions, "EGL_EXT_image_dma_buf_import_modifiers") != NULL;
+	comp->buffer_age = strstr(extensions, "EGL_EXT_buffer_age") != NULL;
+	comp->create_image = (PFNEGLCREATEIMAGEKHRPROC)
+		eglGetProcAddress("eglCreateImageKHR");
+	comp->destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)
+		eglGetProcAddress("eglDestroyImageKHR");
+	comp->image_target_texture = (PFNGLEGLIMAGETARGETTEXTURE2DOESPROC)
+		eglGetProcAddress("glEGLImageTargetTexture2DOES");
+	if(!comp->create_image || !comp->destroy_image || !comp->image_target_texture) {
+		printf("composite : EGLImage entry points not found\n");
+		return NULL;
+	}
+
+	if(strstr(extensions, "EGL_ANDROID_native_fence_sync") &&
+			strstr(extensions, "EGL_KHR_wait_sync")) {
+		comp->create_sync = (PFNEGLCREATESYNCKHRPROC)
+			eglGetProcAddress("eglCreateSyncKHR");
+		comp->destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+			eglGetProcAddress("eglDestroySyncKHR");
+		comp->wait_sync = (PFNEGLWAITSYNCKHRPROC)
+			eglGetProcAddress("eglWaitSyncKHR");
+	}
+	if(!comp->create_sync || !comp->destroy_sync || !comp->wait_sync) {
+		printf("composite : no GPU side fence waits, render fences are waited for on the CPU\n");
+		comp->wait_sync = NULL;
+	}
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+	config = composite_config(comp->display, format);
+	if(!config)
+		return NULL;
+
+	comp->context = eglCreateContext(comp->display, config,
+			EGL_NO_CONTEXT, context_attribs);
+	if(comp->context == EGL_NO_CONTEXT) {
+		printf("composite : failed to create context\n");
+		return NULL;
+	}
+
+#ifdef USE_FAKEKMS
+	comp->surface = eglCreatePbufferSurface(comp->display, config, pbuffer_attribs);
+#else
+	comp->surface = eglCreateWindowSurface(comp->display, config,
+			(EGLNativeWindowType)comp->gbm_surf, NULL);
+#endif
+	if(comp->surface == EGL_NO_SURFACE) {
+		printf("composite : failed to create egl surface\n");
+		return NULL;
+	}
+
+	/* the compositor thread has no other context, so this one stays current */
+	eglMakeCurrent(comp->display, comp->surface, comp->surface, comp->context);
+
+	if(composite_setup_gl(comp))
+		return NULL;
+
+	if(frame_queue_init(&comp->queue, comp->gbm_surf))
+		return NULL;
+
+	stats_register(&comp->composite_time, 0, "gpu composite");
+
+	return comp;
+}
+
+struct gbm_surface *gl_composite_get_surface(struct gl_composite *comp)
+{
+	return comp->gbm_surf;
+}
+
+struct frame_queue *gl_composite_get_queue(struct gl_composite *comp)
+{
+	return &comp->queue;
+}
+
+int gl_composite_add_layer(struct gl_composite *comp, struct plane_data *pdata)
+{
+	if(comp->count_layers == MAX_COMPOSITE_LAYERS) {
+		printf("composite : too many layers\n");
+		return -1;
+	}
+
+	comp->layers[comp->count_layers].pdata = pdata;
+	comp->layers[comp->count_layers].bo = NULL;
+	comp->count_layers++;
+
+	return 0;
+}
+
+static void composite_image_destroy(struct gbm_bo *bo, void *data)
+{
+	struct composite_image *img = data;
+
+	glDeleteTextures(1, &img->tex);
+	img->comp->destroy_image(img->comp->display, img->image);
+#ifdef USE_FAKEKMS
+	glDeleteTextures(1, &img->backing);
+#endif
+	free(img);
+}
+
+#ifdef USE_FAKEKMS
+/*
+ * The fake buffers have no memory to import. A texture of the buffer's
+ * size stands in for it, so the composition samples as many texels, through
+ * the same EGLImage and external texture, as with a real dma-buf.
+ */
+static EGLImageKHR composite_import(struct gl_composite *comp, struct gbm_bo *bo,
+		GLuint *backing)
+{
+	EGLImageKHR image;
+
+	glGenTextures(1, backing);
+	glBindTexture(GL_TEXTURE_2D, *backing);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
+			0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+
+	image = comp->create_image(comp->display, comp->context, EGL_GL_TEXTURE_2D_KHR,
+			(EGLClientBuffer)(uintptr_t)*backing, NULL);
+	if(image == EGL_NO_IMAGE_KHR)
+		glDeleteTextures(1, backing);
+
+	return image;
+}
+#else
+/* fd, offset, pitch, modifier lo and hi of every dma-buf plane */
+static const EGLint plane_attribs[4][5] = {
+	{ EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT,
+		EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+		EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT,
+		EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT },
+	{ EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT,
+		EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT },
+};
+
+static EGLImageKHR composite_import(struct gl_composite *comp, struct gbm_bo *bo)
+{
+	uint64_t modifier = gbm_bo_get_modifier(bo);
+	EGLint attribs[6 + 4 * 10 + 1];
+	EGLImageKHR image;
+	int count, n = 0;
+	int fd;
+
+	fd = gbm_bo_get_fd(bo);
+	if(fd < 0)
+		return EGL_NO_IMAGE_KHR;
+
+	attribs[n++] = EGL_WIDTH;
+	attribs[n++] = gbm_bo_get_width(bo);
+	attribs[n++] = EGL_HEIGHT;
+	attribs[n++] = gbm_bo_get_height(bo);
+	attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n++] = gbm_bo_get_format(bo);
+
+	/* all planes of a GBM buffer are in the one dma-buf */
+	for(count = 0; count < gbm_bo_get_plane_count(bo) && count < 4; count++) {
+		attribs[n++] = plane_attribs[count][0];
+		attribs[n++] = fd;
+		attribs[n++] = plane_attribs[count][1];
+		attribs[n++] = gbm_bo_get_offset(bo, count);
+		attribs[n++] = plane_attribs[count][2];
+		attribs[n++] = gbm_bo_get_stride_for_plane(bo, count);
+		if(comp->import_modifiers && modifier != DRM_FORMAT_MOD_INVALID) {
+			attribs[n++] = plane_attribs[count][3];
+			attribs[n++] = modifier & 0xffffffff;
+			attribs[n++] = plane_attribs[count][4];
+			attribs[n++] = modifier >> 32;
+		}
+	}
+	attribs[n++] = EGL_NONE;
+
+	image = comp->create_image(comp->display, EGL_NO_CONTEXT,
+			EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+	/* the image holds its own reference to the dma-buf */
+	close(fd);
+
+	return image;
+}
+#endif
+
+/* a GBM surface cycles through a few buffers, each is imported only once */
+static struct composite_image *composite_get_image(struct gl_composite *comp,
+		struct gbm_bo *bo)
+{
+	struct composite_image *img = gbm_bo_get_user_data(bo);
+
+	if(img)
+		return img;
+
+	img = calloc(sizeof(struct composite_image), 1);
+	if(!img)
+		return NULL;
+
+	img->comp = comp;
+#ifdef USE_FAKEKMS
+	img->image = composite_import(comp, bo, &img->backing);
+#else
+	img->image = composite_import(comp, bo);
+#endif
+	if(img->image == EGL_NO_IMAGE_KHR) {
+		printf("composite : buffer import failed\n");
+		free(img);
+		return NULL;
+	}
+
+	glGenTextures(1, &img->tex);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, img->tex);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	comp->image_target_texture(GL_TEXTURE_EXTERNAL_OES, img->image);
+
+	gbm_bo_set_user_data(bo, img, composite_image_destroy);
+
+	return img;
+}
+
+static void rect_union(struct composite_rect *dst, struct composite_rect *src)
+{
+	if(src->x1 >= src->x2 || src->y1 >= src->y2)
+		return;
+	if(dst->x1 >= dst->x2 || dst->y1 >= dst->y2) {
+		*dst = *src;
+		return;
+	}
+
+	if(src->x1 < dst->x1)
+		dst->x1 = src->x1;
+	if(src->y1 < dst->y1)
+		dst->y1 = src->y1;
+	if(src->x2 > dst->x2)
+		dst->x2 = src->x2;
+	if(src->y2 > dst->y2)
+		dst->y2 = src->y2;
+}
+
+static int rect_intersects(struct composite_rect *a, struct composite_rect *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+static void layer_rect(struct composite_layer *layer, struct composite_rect *rect)
+{
+	rect->x1 = layer->pdata->posx;
+	rect->y1 = layer->pdata->posy;
+	rect->x2 = layer->pdata->posx + layer->pdata->width;
+	rect->y2 = layer->pdata->posy + layer->pdata->height;
+}
+
+/*
+ * Area of the back buffer that is stale: what changed now plus whatever
+ * changed since this buffer was last drawn. Without buffer age that is
+ * the whole buffer.
+ */
+static void composite_repaint_rect(struct gl_composite *comp,
+		struct composite_rect *damage, struct composite_rect *repaint)
+{
+	EGLint age = 0;
+	int count;
+
+	if(comp->buffer_age)
+		eglQuerySurface(comp->display, comp->surface, EGL_BUFFER_AGE_EXT, &age);
+
+	if(age <= 0 || age - 1 > comp->count_damage) {
+		repaint->x1 = repaint->y1 = 0;
+		repaint->x2 = comp->width;
+		repaint->y2 = comp->height;
+	} else {
+		*repaint = *damage;
+		for(count = 0; count < age - 1; count++)
+			rect_union(repaint, &comp->damage[count]);
+	}
+
+	memmove(&comp->damage[1], &comp->damage[0],
+			sizeof(comp->damage[0]) * (COMPOSITE_DAMAGE_HISTORY - 1));
+	comp->damage[0] = *damage;
+	if(comp->count_damage < COMPOSITE_DAMAGE_HISTORY)
+		comp->count_damage++;
+}
+
+/*
+ * Make the composition wait for a layer's render fence. The GPU does the
+ * waiting where it can, so the compositor thread goes on to the next
+ * layer right away. Takes ownership of fence_fd.
+ */
+static void wait_fence(struct gl_composite *comp, int fence_fd)
+{
+	struct pollfd pfd;
+
+	if(fence_fd < 0)
+		return;
+
+	if(comp->wait_sync) {
+		const EGLint attribs[] = {
+			EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fence_fd,
+			EGL_NONE,
+		};
+		EGLSyncKHR sync = comp->create_sync(comp->display,
+				EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+
+		/* EGL owns the fd once the sync exists */
+		if(sync != EGL_NO_SYNC_KHR) {
+			comp->wait_sync(comp->display, sync, 0);
+			comp->destroy_sync(comp->display, sync);
+			return;
+		}
+	}
+
+	pfd.fd = fence_fd;
+	pfd.events = POLLIN;
+	while(poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+	close(fence_fd);
+}
+
+int gl_composite_update(struct gl_composite *comp, int lockstep)
+{
+	struct gbm_bo *old_bos[MAX_COMPOSITE_LAYERS];
+	struct composite_rect damage = { 0, 0, 0, 0 };
+	struct composite_rect repaint, rect;
+	struct frame out;
+	unsigned long long t0;
+	int count, ready = 0;
+
+	for(count = 0; count < comp->count_layers; count++) {
+		struct frame_queue *queue = comp->layers[count].pdata->queue;
+		if(queue && frame_queue_ready(queue))
+			ready++;
+	}
+
+	if(!ready)
+		return 0;
+	if(lockstep && ready < comp->count_layers)
+		return 0;
+
+	/* both buffers are on their way to the screen, try again after a flip */
+	frame_queue_reclaim(&comp->queue);
+	if(!gbm_surface_has_free_buffers(comp->gbm_surf))
+		return 0;
+
+	t0 = stats_now_nsec();
+	TRACE_BEGIN("composite");
+	out.start_nsec = 0;
+
+	for(count = 0; count < comp->count_layers; count++) {
+		struct composite_layer *layer = &comp->layers[count];
+		struct composite_image *img;
+		struct frame frame;
+
+		old_bos[count] = NULL;
+
+		if(!layer->pdata->queue || !frame_queue_take(layer->pdata->queue, &frame))
+			continue;
+		if(!frame.bo)
+			continue;
+
+		wait_fence(comp, frame.fence_fd);
+
+		img = composite_get_image(comp, frame.bo);
+		if(!img) {
+			frame_queue_release(layer->pdata->queue, frame.bo);
+			frame_queue_signal(layer->pdata->queue);
+			continue;
+		}
+
+		/* the output is as late as the oldest frame it shows for the first time */
+		if(!out.start_nsec || frame.start_nsec < out.start_nsec)
+			out.start_nsec = frame.start_nsec;
+
+		if(!layer->bo)
+			plane_data_report_layout(layer->pdata, frame.bo);
+
+		layer_rect(layer, &rect);
+		if(!layer->bo || frame.damage.full ||
+				frame.width != layer->src_width || frame.height != layer->src_height) {
+			rect_union(&damage, &rect);
+		} else {
+			int r;
+			for(r = 0; r < frame.damage.count; r++) {
+				struct composite_rect dirty = {
+					rect.x1 + frame.damage.rects[r].x1,
+					rect.y1 + frame.damage.rects[r].y1,
+					rect.x1 + frame.damage.rects[r].x2,
+					rect.y1 + frame.damage.rects[r].y2,
+				};
+				rect_union(&damage, &dirty);
+			}
+		}
+
+		old_bos[count] = layer->bo;
+		layer->bo = frame.bo;
+		layer->image = img;
+		layer->src_width = frame.width;
+		layer->src_height = frame.height;
+	}
+
+	composite_repaint_rect(comp, &damage, &repaint);
+
+	/* GL has its origin at the bottom left */
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(repaint.x1, comp->height - repaint.y2,
+			repaint.x2 - repaint.x1, repaint.y2 - repaint.y1);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	for(count = 0; count < comp->count_layers; count++) {
+		struct composite_layer *layer = &comp->layers[count];
+
+		if(!layer->bo)
+			continue;
+		layer_rect(layer, &rect);
+		if(!rect_intersects(&rect, &repaint))
+			continue;
+
+		glBindTexture(GL_TEXTURE_EXTERNAL_OES, layer->image->tex);
+		glUniform4f(comp->rect,
+				-1.0f + 2.0f * rect.x1 / comp->width,
+				1.0f - 2.0f * rect.y1 / comp->height,
+				2.0f * (rect.x2 - rect.x1) / comp->width,
+				-2.0f * (rect.y2 - rect.y1) / comp->height);
+		/* scaled up from the bottom left, where GL drew it */
+		glUniform4f(comp->texrect, 0.0f,
+				1.0f - (float)layer->src_height / layer->pdata->height,
+				(float)layer->src_width / layer->pdata->width,
+				(float)layer->src_height / layer->pdata->height);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+
+#ifdef USE_FAKEKMS
+	/* swapping a pbuffer is a no-op, the composition time includes the GPU */
+	glFinish();
+#endif
+	eglSwapBuffers(comp->display, comp->surface);
+
+	out.bo = gbm_surface_lock_front_buffer(comp->gbm_surf);
+	out.fence_fd = -1;
+	frame_damage_reset(&out.damage);
+	frame_damage_add(&out.damage, damage.x1, damage.y1,
+			damage.x2 - damage.x1, damage.y2 - damage.y1);
+	out.width = comp->width;
+	out.height = comp->height;
+	frame_queue_publish(&comp->queue, &out);
+
+	/* the swap flushed the last reads of the replaced buffers */
+	for(count = 0; count < comp->count_layers; count++) {
+		struct composite_layer *layer = &comp->layers[count];
+
+		if(!old_bos[count])
+			continue;
+		frame_queue_release(layer->pdata->queue, old_bos[count]);
+		frame_queue_signal(layer->pdata->queue);
+	}
+
+	stats_record(&comp->composite_time, stats_now_nsec() - t0);
+	TRACE_END("composite");
+
+	return 1;
+}
@@ -0,0 +1,40 @@
+#ifndef __GL_COMPOSITE_H__
+#define __GL_COMPOSITE_H__
+
+#include <stdint.h>
+
+struct gbm_device;
+struct gbm_surface;
+struct frame_queue;
+struct plane_data;
+
+#define MAX_COMPOSITE_LAYERS (16)
+
+struct gl_composite;
+
+/*
+ * GPU composition of the surfaces that did not get a hardware plane.
+ *
+ * The layers' buffers are imported as EGLImages and drawn as textured
+ * quads into one buffer of width x height, which goes to the display like
+ * any other plane through the frame queue returned by
+ * gl_composite_get_queue, allocated with one of the modifiers if the
+ * driver can render to any. Runs on the compositor thread.
+ */
+struct gl_composite *gl_composite_create(struct gbm_device *gbm_dev,
+		int width, int height, uint32_t format,
+		const uint64_t *modifiers, int count_modifiers);
+struct gbm_surface *gl_composite_get_surface(struct gl_composite *comp);
+struct frame_queue *gl_composite_get_queue(struct gl_composite *comp);
+
+/* position, size and frame queue are read from pdata on every update */
+int gl_composite_add_layer(struct gl_composite *comp, struct plane_data *pdata);
+
+/*
+ * Take the new frames of the layers and redraw what their damage covers. With
+ * lockstep set nothing happens until every layer has a new frame.
+ * Returns 1 if a composed frame was queued, 0 otherwise.
+ */
+int gl_composite_update(struct gl_composite *comp, int lockstep);
+
+#endif /*__GL_COMPOSITE_H__*/
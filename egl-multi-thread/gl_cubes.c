@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "render_thread.h"
+#include "gl_cubes.h"
+#include "esUtil.h"
+#include "program_cache.h"
+
+#define CUBE_VERTICES (24)
+#define CUBE_INDICES (36)
+#define VERTEX_FLOATS (6)	/* position, normal */
+#define INSTANCE_FLOATS (12)	/* affine modelview, see pack_modelview */
+
+/* cubes per draw with 16 bit indices */
+#define MAX_SHORT_CUBES (65536 / CUBE_VERTICES)
+
+/* same faces and corners as kmscube, the color is derived from the corner */
+static const GLfloat cube_positions[CUBE_VERTICES * 3] = {
+	-1.0f, -1.0f, +1.0f,  +1.0f, -1.0f, +1.0f,  -1.0f, +1.0f, +1.0f,  +1.0f, +1.0f, +1.0f,
+	+1.0f, -1.0f, -1.0f,  -1.0f, -1.0f, -1.0f,  +1.0f, +1.0f, -1.0f,  -1.0f, +1.0f, -1.0f,
+	+1.0f, -1.0f, +1.0f,  +1.0f, -1.0f, -1.0f,  +1.0f, +1.0f, +1.0f,  +1.0f, +1.0f, -1.0f,
+	-1.0f, -1.0f, -1.0f,  -1.0f, -1.0f, +1.0f,  -1.0f, +1.0f, -1.0f,  -1.0f, +1.0f, +1.0f,
+	-1.0f, +1.0f, +1.0f,  +1.0f, +1.0f, +1.0f,  -1.0f, +1.0f, -1.0f,  +1.0f, +1.0f, -1.0f,
+	-1.0f, -1.0f, -1.0f,  +1.0f, -1.0f, -1.0f,  -1.0f, -1.0f, +1.0f,  +1.0f, -1.0f, +1.0f,
+};
+
+static const GLfloat face_normals[6 * 3] = {
+	+0.0f, +0.0f, +1.0f,
+	+0.0f, +0.0f, -1.0f,
+	+1.0f, +0.0f, +0.0f,
+	-1.0f, +0.0f, +0.0f,
+	+0.0f, +1.0f, +0.0f,
+	+0.0f, -1.0f, +0.0f,
+};
+
+static const char *vertex_shader_source =
+	"attribute vec3 in_position;        \n"
+	"attribute vec3 in_normal;          \n"
+	"attribute vec4 in_model0;          \n"
+	"attribute vec4 in_model1;          \n"
+	"attribute vec4 in_model2;          \n"
+	"attribute vec4 in_projection;      \n"
+	"\n"
+	"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);\n"
+	"                                   \n"
+	"varying vec4 vVaryingColor;        \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    mat3 rotation = mat3(in_model0.xyz, in_model1.xyz, in_model2.xyz);\n"
+	"    vec3 translation = vec3(in_model0.w, in_model1.w, in_model2.w);\n"
+	"    vec3 vPosition3 = rotation * in_position + translation;\n"
+	"    gl_Position = vec4(in_projection.xy * vPosition3.xy,\n"
+	"        in_projection.z * vPosition3.z + in_projection.w, -vPosition3.z);\n"
+	"    vec3 vEyeNormal = normalize(rotation * in_normal);\n"
+	"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
+	"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
+	"    vVaryingColor = vec4(diff * (in_position * 0.5 + 0.5), 1.0);\n"
+	"}                                  \n";
+
+static const char *fragment_shader_source =
+	"precision mediump float;           \n"
+	"                                   \n"
+	"varying vec4 vVaryingColor;        \n"
+	"                                   \n"
+	"void main()                        \n"
+	"{                                  \n"
+	"    gl_FragColor = vVaryingColor;  \n"
+	"}                                  \n";
+
+struct gl_cubes_data {
+	GLuint program;
+
+	GLuint vbo;		/* one cube, or num_objects of them without instancing */
+	GLuint ibo;		/* vbo and ibo belong to the share group */
+	GLuint instance_vbo;	/* INSTANCE_FLOATS per cube, or per vertex without instancing */
+
+	PFNGLDRAWELEMENTSINSTANCEDEXTPROC draw_instanced;
+	PFNGLVERTEXATTRIBDIVISOREXTPROC attrib_divisor;
+	GLenum index_type;
+	int cubes_per_draw;
+
+	int num_objects;
+	ESMatrix *orient;	/* scale and random orientation of every cube */
+	GLfloat *positions;	/* 3 per cube */
+	ESMatrix *modelviews;
+	GLfloat *instance_data;
+
+	GLuint bgcolor;
+	GLuint width;
+	GLuint height;
+	int depth_test;		/* the cubes overlap, when the config has a depth buffer */
+	int frame;
+};
+
+static void cubes_find_instancing(struct gl_cubes_data *priv, int disabled)
+{
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	int major = 2;
+
+	sscanf((const char *)glGetString(GL_VERSION), "OpenGL ES %d", &major);
+
+	priv->index_type = GL_UNSIGNED_SHORT;
+	if(major >= 3 || (extensions && strstr(extensions, "GL_OES_element_index_uint")))
+		priv->index_type = GL_UNSIGNED_INT;
+
+	if(disabled)
+		return;
+
+	if(major >= 3) {
+		priv->draw_instanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+			eglGetProcAddress("glDrawElementsInstanced");
+		priv->attrib_divisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+			eglGetProcAddress("glVertexAttribDivisor");
+	} else if(extensions && strstr(extensions, "GL_EXT_instanced_arrays")) {
+		priv->draw_instanced = (PFNGLDRAWELEMENTSINSTANCEDEXTPROC)
+			eglGetProcAddress("glDrawElementsInstancedEXT");
+		priv->attrib_divisor = (PFNGLVERTEXATTRIBDIVISOREXTPROC)
+			eglGetProcAddress("glVertexAttribDivisorEXT");
+	}
+
+	if(!priv->draw_instanced || !priv->attrib_divisor) {
+		priv->draw_instanced = NULL;
+		priv->attrib_divisor = NULL;
+	}
+}
+
+/* two triangles per face, in the order of the kmscube strips */
+static void *cubes_indices(int count_cubes, GLenum type)
+{
+	size_t size = type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort);
+	char *indices = malloc(count_cubes * CUBE_INDICES * size);
+	int cube, face, n = 0;
+
+	if(!indices)
+		return NULL;
+
+	for(cube = 0; cube < count_cubes; cube++) {
+		for(face = 0; face < 6; face++) {
+			static const int quad[6] = { 0, 1, 2, 2, 1, 3 };
+			int corner;
+
+			for(corner = 0; corner < 6; corner++, n++) {
+				GLuint index = cube * CUBE_VERTICES + face * 4 + quad[corner];
+
+				if(type == GL_UNSIGNED_INT)
+					((GLuint *)indices)[n] = index;
+				else
+					((GLushort *)indices)[n] = index;
+			}
+		}
+	}
+
+	return indices;
+}
+
+/* program and static buffers, the same for every surface of a share group */
+struct cubes_objects {
+	GLuint program;
+	GLuint vbo;
+	GLuint ibo;
+	size_t bytes;
+};
+
+static int cubes_setup_buffers(struct gl_cubes_data *priv, struct cubes_objects *objects)
+{
+	int copies = priv->draw_instanced ? 1 : priv->num_objects;
+	int count_indices = priv->draw_instanced ? 1 : priv->cubes_per_draw;
+	size_t vertices_size = copies * CUBE_VERTICES * VERTEX_FLOATS * sizeof(GLfloat);
+	size_t indices_size = count_indices * CUBE_INDICES *
+		(priv->index_type == GL_UNSIGNED_INT ? sizeof(GLuint) : sizeof(GLushort));
+	GLfloat *vertices;
+	void *indices;
+	int cube, vertex;
+
+	vertices = malloc(vertices_size);
+	indices = cubes_indices(count_indices, priv->index_type);
+	if(!vertices || !indices) {
+		printf("cubes : could not allocate the vertices\n");
+		return -1;
+	}
+
+	for(cube = 0; cube < copies; cube++) {
+		for(vertex = 0; vertex < CUBE_VERTICES; vertex++) {
+			GLfloat *v = &vertices[(cube * CUBE_VERTICES + vertex) * VERTEX_FLOATS];
+
+			memcpy(&v[0], &cube_positions[vertex * 3], 3 * sizeof(GLfloat));
+			memcpy(&v[3], &face_normals[vertex / 4 * 3], 3 * sizeof(GLfloat));
+		}
+	}
+
+	glGenBuffers(1, &objects->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, objects->vbo);
+	glBufferData(GL_ARRAY_BUFFER, vertices_size, vertices, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &objects->ibo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, objects->ibo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices_size, indices, GL_STATIC_DRAW);
+
+	objects->bytes += vertices_size + indices_size;
+
+	free(vertices);
+	free(indices);
+
+	return 0;
+}
+
+static struct cubes_objects *cubes_create_objects(struct gl_cubes_data *priv)
+{
+	static const char *const attribs[] = {
+		"in_position", "in_normal", "in_model0", "in_model1", "in_model2", "in_projection", NULL
+	};
+	struct cubes_objects *objects = calloc(sizeof(struct cubes_objects), 1);
+
+	if(!objects) {
+		printf("cubes : could not allocate objects\n");
+		return NULL;
+	}
+
+	objects->program = program_cache_create("cubes", vertex_shader_source,
+			fragment_shader_source, attribs);
+	if(!objects->program || cubes_setup_buffers(priv, objects)) {
+		free(objects);
+		return NULL;
+	}
+	objects->bytes += program_cache_binary_size(objects->program);
+
+	return objects;
+}
+
+/* a grid of cubes filling a 4x4x4 box, each turned a different way */
+static int cubes_setup_scene(struct gl_cubes_data *priv)
+{
+	int n = priv->num_objects;
+	int side = ceilf(cbrtf(n));
+	float spacing = 4.0f / side;
+	int count;
+
+	priv->orient = malloc(n * sizeof(ESMatrix));
+	priv->modelviews = malloc(n * sizeof(ESMatrix));
+	priv->positions = malloc(n * 3 * sizeof(GLfloat));
+	priv->instance_data = malloc(n * (priv->draw_instanced ? 1 : CUBE_VERTICES) *
+			INSTANCE_FLOATS * sizeof(GLfloat));
+	if(!priv->orient || !priv->modelviews || !priv->positions || !priv->instance_data) {
+		printf("cubes : could not allocate the scene\n");
+		return -1;
+	}
+
+	for(count = 0; count < n; count++) {
+		esMatrixLoadIdentity(&priv->orient[count]);
+		esScale(&priv->orient[count], spacing * 0.3f, spacing * 0.3f, spacing * 0.3f);
+		esRotate(&priv->orient[count], rand() % 360, rand() % 100 / 100.0f + 0.1f,
+				rand() % 100 / 100.0f, rand() % 100 / 100.0f);
+
+		priv->positions[count * 3 + 0] = -2.0f + spacing * (count % side + 0.5f);
+		priv->positions[count * 3 + 1] = -2.0f + spacing * (count / side % side + 0.5f);
+		priv->positions[count * 3 + 2] = -2.0f + spacing * (count / (side * side) + 0.5f);
+	}
+
+	return 0;
+}
+
+/*
+ * Program, buffers and attributes are per context state, bind them again
+ * in case another context of the share group drew the previous frame.
+ */
+static void bind_cubes(struct gl_cubes_data *priv)
+{
+	GLsizei stride = VERTEX_FLOATS * sizeof(GLfloat);
+	int count;
+
+	glUseProgram(priv->program);
+	glBindBuffer(GL_ARRAY_BUFFER, priv->vbo);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, priv->ibo);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid *)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid *)(3 * sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+
+	for(count = 2; count < 5; count++) {
+		glEnableVertexAttribArray(count);
+		if(priv->attrib_divisor)
+			priv->attrib_divisor(count, 1);
+	}
+}
+
+/* the instance attributes of the cubes from first on */
+static void point_instances(struct gl_cubes_data *priv, int first)
+{
+	GLsizei stride = INSTANCE_FLOATS * sizeof(GLfloat);
+	size_t base = first * (priv->draw_instanced ? 1 : CUBE_VERTICES) * stride;
+	int count;
+
+	glBindBuffer(GL_ARRAY_BUFFER, priv->instance_vbo);
+	for(count = 0; count < 3; count++)
+		glVertexAttribPointer(2 + count, 4, GL_FLOAT, GL_FALSE, stride,
+				(const GLvoid *)(base + count * 4 * sizeof(GLfloat)));
+}
+
+/*
+ * void *setup_cubes (struct render_thread_param *prm)
+ * NOTE:  Must be called after eglMakeCurrent returns successfully.
+ */
+void *setup_cubes (struct render_thread_param *prm)
+{
+	struct cubes_objects *objects;
+	struct gl_cubes_data *priv = calloc(sizeof(struct gl_cubes_data), 1);
+	if(!priv) {
+		printf("cubes : could not allocate priv data\n");
+		return NULL;
+	}
+
+	priv->num_objects = prm->num_objects;
+	if(priv->num_objects < 1 || priv->num_objects > CUBES_MAX_OBJECTS) {
+		printf("cubes : number of cubes must be between 1 and %d\n", CUBES_MAX_OBJECTS);
+		return NULL;
+	}
+
+	cubes_find_instancing(priv, prm->no_instancing);
+	priv->cubes_per_draw = priv->num_objects;
+	if(!priv->draw_instanced && priv->index_type == GL_UNSIGNED_SHORT &&
+			priv->cubes_per_draw > MAX_SHORT_CUBES)
+		priv->cubes_per_draw = MAX_SHORT_CUBES;
+
+	objects = render_share_lock(prm);
+	if(!objects) {
+		objects = cubes_create_objects(priv);
+		if(!objects) {
+			render_share_unlock(prm, NULL, 0);
+			return NULL;
+		}
+	}
+	render_share_unlock(prm, objects, objects->bytes);
+
+	priv->program = objects->program;
+	priv->vbo = objects->vbo;
+	priv->ibo = objects->ibo;
+	glGenBuffers(1, &priv->instance_vbo);
+
+	if(cubes_setup_scene(priv))
+		return NULL;
+
+	priv->bgcolor = rand();
+	priv->width = prm->frame_width;
+	priv->height = prm->frame_height;
+	priv->depth_test = prm->depth_stencil_bits > 0;
+
+	printf("cubes : %d cubes, %s, %d draw(s) and %d vertices per frame\n", priv->num_objects,
+			priv->draw_instanced ? "instanced" : "packed attributes",
+			(priv->num_objects + priv->cubes_per_draw - 1) / priv->cubes_per_draw,
+			priv->num_objects * CUBE_VERTICES);
+
+	return priv;
+}
+
+/*
+ * A modelview without projective part as the shader takes it: three vec4,
+ * each with a column of the 3x3 part and one component of the translation.
+ */
+static void pack_modelview(GLfloat *out, const ESMatrix *mv)
+{
+	int row;
+
+	for(row = 0; row < 3; row++) {
+		out[row * 4 + 0] = mv->m[row][0];
+		out[row * 4 + 1] = mv->m[row][1];
+		out[row * 4 + 2] = mv->m[row][2];
+		out[row * 4 + 3] = mv->m[3][row];
+	}
+}
+
+/* every cube spins in place, the whole grid spins around the center */
+static void cubes_update(struct gl_cubes_data *priv)
+{
+	int n = priv->num_objects;
+	int j = priv->frame;
+	ESMatrix spin, view;
+	int count;
+
+	esMatrixLoadIdentity(&spin);
+	esRotate(&spin, 2.0f * j, 0.0f, 1.0f, 0.0f);
+	esMatrixMultiplyBatch(priv->modelviews, priv->orient, &spin, n);
+
+	for(count = 0; count < n; count++) {
+		priv->modelviews[count].m[3][0] = priv->positions[count * 3 + 0];
+		priv->modelviews[count].m[3][1] = priv->positions[count * 3 + 1];
+		priv->modelviews[count].m[3][2] = priv->positions[count * 3 + 2];
+	}
+
+	esMatrixLoadIdentity(&view);
+	esTranslate(&view, 0.0f, 0.0f, -8.0f);
+	esRotate(&view, 45.0f + (0.25f * j), 1.0f, 0.0f, 0.0f);
+	esRotate(&view, 45.0f - (0.5f * j), 0.0f, 1.0f, 0.0f);
+	esMatrixMultiplyBatch(priv->modelviews, priv->modelviews, &view, n);
+
+	if(priv->draw_instanced) {
+		for(count = 0; count < n; count++)
+			pack_modelview(&priv->instance_data[count * INSTANCE_FLOATS], &priv->modelviews[count]);
+	} else {
+		for(count = 0; count < n; count++) {
+			GLfloat *first = &priv->instance_data[count * CUBE_VERTICES * INSTANCE_FLOATS];
+			int vertex;
+
+			pack_modelview(first, &priv->modelviews[count]);
+			for(vertex = 1; vertex < CUBE_VERTICES; vertex++)
+				memcpy(first + vertex * INSTANCE_FLOATS, first, INSTANCE_FLOATS * sizeof(GLfloat));
+		}
+	}
+}
+
+void resize_cubes (void *data, unsigned int width, unsigned int height)
+{
+	struct gl_cubes_data *priv = data;
+
+	priv->width = width;
+	priv->height = height;
+}
+
+/*
+ * int render_cubes (void *priv)
+ * NOTE: Caller thread must be current
+ */
+int render_cubes (void *data)
+{
+	struct gl_cubes_data *priv = data;
+	GLfloat aspect = (GLfloat)(priv->height) / (GLfloat)(priv->width);
+	size_t instance_size = priv->num_objects * (priv->draw_instanced ? 1 : CUBE_VERTICES) *
+		INSTANCE_FLOATS * sizeof(GLfloat);
+	ESMatrix projection;
+	int first;
+
+	cubes_update(priv);
+
+	bind_cubes(priv);
+
+	glViewport(0, 0, priv->width, priv->height);
+	glEnable(GL_CULL_FACE);
+
+	glClearColor(((priv->bgcolor >> 16) & 0xff) / 256.0, ((priv->bgcolor >> 8) & 0xff) / 256.0,
+			(priv->bgcolor & 0xff) / 256.0, ((priv->bgcolor >> 24) & 0xff) / 256.0);
+	if(priv->depth_test) {
+		glEnable(GL_DEPTH_TEST);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	} else {
+		glClear(GL_COLOR_BUFFER_BIT);
+	}
+
+	esMatrixLoadIdentity(&projection);
+	esFrustum(&projection, -1.9f, +1.9f, -1.9f * aspect, +1.9f * aspect, 4.0f, 12.0f);
+	glVertexAttrib4f(5, projection.m[0][0], projection.m[1][1], projection.m[2][2], projection.m[3][2]);
+
+	/* orphan the previous frame's transforms, the GPU may still read them */
+	glBindBuffer(GL_ARRAY_BUFFER, priv->instance_vbo);
+	glBufferData(GL_ARRAY_BUFFER, instance_size, NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, instance_size, priv->instance_data);
+
+	if(priv->draw_instanced) {
+		point_instances(priv, 0);
+		priv->draw_instanced(GL_TRIANGLES, CUBE_INDICES, priv->index_type, 0, priv->num_objects);
+	} else {
+		for(first = 0; first < priv->num_objects; first += priv->cubes_per_draw) {
+			int count = priv->num_objects - first;
+			GLsizei stride = VERTEX_FLOATS * sizeof(GLfloat);
+			size_t base = first * CUBE_VERTICES * stride;
+
+			if(count > priv->cubes_per_draw)
+				count = priv->cubes_per_draw;
+
+			/* 16 bit indices only reach one batch, move the vertices instead */
+			glBindBuffer(GL_ARRAY_BUFFER, priv->vbo);
+			glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (const GLvoid *)base);
+			glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride,
+					(const GLvoid *)(base + 3 * sizeof(GLfloat)));
+			point_instances(priv, first);
+
+			glDrawElements(GL_TRIANGLES, count * CUBE_INDICES, priv->index_type, 0);
+		}
+	}
+
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_DEPTH_TEST);
+
+	priv->frame++;
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef __GL_CUBES_H__
+#define __GL_CUBES_H__
+
+#include "render_thread.h"
+
+#define CUBES_MAX_OBJECTS (65536)
+
+/* the cubes overlap, so they ask for a depth buffer (prm->depth_size) */
+#define CUBES_DEPTH_SIZE (16)
+
+/*
+ * Stress variant of kmscube: prm->num_objects spinning cubes in a grid,
+ * drawn with a single indexed draw per frame. Per cube transforms are
+ * instanced attributes with GLES3 or GL_EXT_instanced_arrays, otherwise
+ * (or with prm->no_instancing) the cube is replicated in the vertex
+ * buffer and the transforms are packed into every vertex.
+ */
+void *setup_cubes (struct render_thread_param *prm);
+int render_cubes (void *priv);
+void resize_cubes (void *priv, unsigned int width, unsigned int height);
+
+#endif /*__GL_CUBES_H__*/
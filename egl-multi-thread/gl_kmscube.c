@@ -1,118 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <GLES2/gl2.h>
 
 #include "render_thread.h"
 #include "gl_kmscube.h"
 #include "esUtil.h"
+#include "gl_mesh.h"
+#include "program_cache.h"
 
-static const GLfloat vVertices[] = {
-			// front
-	-1.0f, -1.0f, +1.0f, // point blue
-	+1.0f, -1.0f, +1.0f, // point magenta
-	-1.0f, +1.0f, +1.0f, // point cyan
-	+1.0f, +1.0f, +1.0f, // point white
-	// back
-	+1.0f, -1.0f, -1.0f, // point red
-	-1.0f, -1.0f, -1.0f, // point black
-	+1.0f, +1.0f, -1.0f, // point yellow
-	-1.0f, +1.0f, -1.0f, // point green
-	// right
-	+1.0f, -1.0f, +1.0f, // point magenta
-	+1.0f, -1.0f, -1.0f, // point red
-	+1.0f, +1.0f, +1.0f, // point white
-	+1.0f, +1.0f, -1.0f, // point yellow
-	// left
-	-1.0f, -1.0f, -1.0f, // point black
-	-1.0f, -1.0f, +1.0f, // point blue
-	-1.0f, +1.0f, -1.0f, // point green
-	-1.0f, +1.0f, +1.0f, // point cyan
-	// top
-	-1.0f, +1.0f, +1.0f, // point cyan
-	+1.0f, +1.0f, +1.0f, // point white
-	-1.0f, +1.0f, -1.0f, // point green
-	+1.0f, +1.0f, -1.0f, // point yellow
-	// bottom
-	-1.0f, -1.0f, -1.0f, // point black
-	+1.0f, -1.0f, -1.0f, // point red
-	-1.0f, -1.0f, +1.0f, // point blue
-	+1.0f, -1.0f, +1.0f  // point magenta
-};
-
-static const GLfloat vColors[] = {
-	// front
-	0.0f,  0.0f,  1.0f, // blue
-	1.0f,  0.0f,  1.0f, // magenta
-	0.0f,  1.0f,  1.0f, // cyan
-	1.0f,  1.0f,  1.0f, // white
-	// back
-	1.0f,  0.0f,  0.0f, // red
-	0.0f,  0.0f,  0.0f, // black
-	1.0f,  1.0f,  0.0f, // yellow
-	0.0f,  1.0f,  0.0f, // green
-	// right
-	1.0f,  0.0f,  1.0f, // magenta
-	1.0f,  0.0f,  0.0f, // red
-	1.0f,  1.0f,  1.0f, // white
-	1.0f,  1.0f,  0.0f, // yellow
-	// left
-	0.0f,  0.0f,  0.0f, // black
-	0.0f,  0.0f,  1.0f, // blue
-	0.0f,  1.0f,  0.0f, // green
-	0.0f,  1.0f,  1.0f, // cyan
-	// top
-	0.0f,  1.0f,  1.0f, // cyan
-	1.0f,  1.0f,  1.0f, // white
-	0.0f,  1.0f,  0.0f, // green
-	1.0f,  1.0f,  0.0f, // yellow
-	// bottom
-	0.0f,  0.0f,  0.0f, // black
-	1.0f,  0.0f,  0.0f, // red
-	0.0f,  0.0f,  1.0f, // blue
-	1.0f,  0.0f,  1.0f  // magenta
-};
-
-static const GLfloat vNormals[] = {
-	// front
-	+0.0f, +0.0f, +1.0f, // forward
-	+0.0f, +0.0f, +1.0f, // forward
-	+0.0f, +0.0f, +1.0f, // forward
-	+0.0f, +0.0f, +1.0f, // forward
-	// back
-	+0.0f, +0.0f, -1.0f, // backbard
-	+0.0f, +0.0f, -1.0f, // backbard
-	+0.0f, +0.0f, -1.0f, // backbard
-	+0.0f, +0.0f, -1.0f, // backbard
-	// right
-	+1.0f, +0.0f, +0.0f, // right
-	+1.0f, +0.0f, +0.0f, // right
-	+1.0f, +0.0f, +0.0f, // right
-	+1.0f, +0.0f, +0.0f, // right
-	// left
-	-1.0f, +0.0f, +0.0f, // left
-	-1.0f, +0.0f, +0.0f, // left
-	-1.0f, +0.0f, +0.0f, // left
-	-1.0f, +0.0f, +0.0f, // left
-	// top
-	+0.0f, +1.0f, +0.0f, // up
-	+0.0f, +1.0f, +0.0f, // up
-	+0.0f, +1.0f, +0.0f, // up
-	+0.0f, +1.0f, +0.0f, // up
-	// bottom
-	+0.0f, -1.0f, +0.0f, // down
-	+0.0f, -1.0f, +0.0f, // down
-	+0.0f, -1.0f, +0.0f, // down
-	+0.0f, -1.0f, +0.0f  // down
-};
-
+/*
+ * The transforms are constant vertex attributes rather than uniforms:
+ * those are per context state, so render threads can share the program.
+ * in_modelview holds the columns of the rotation and the translation of
+ * the modelview, in_projection the four factors of a symmetric frustum.
+ */
 static const char *vertex_shader_source =
-	"uniform mat4 modelviewMatrix;      \n"
-	"uniform mat4 modelviewprojectionMatrix;\n"
-	"uniform mat3 normalMatrix;         \n"
-	"                                   \n"
 	"attribute vec4 in_position;        \n"
 	"attribute vec3 in_normal;          \n"
 	"attribute vec4 in_color;           \n"
+	"attribute vec4 in_modelview0;      \n"
+	"attribute vec4 in_modelview1;      \n"
+	"attribute vec4 in_modelview2;      \n"
+	"attribute vec4 in_projection;      \n"
 	"\n"
 	"vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);\n"
 	"                                   \n"
@@ -120,10 +30,12 @@ static const char *vertex_shader_source =
 	"                                   \n"
 	"void main()                        \n"
 	"{                                  \n"
-	"    gl_Position = modelviewprojectionMatrix * in_position;\n"
+	"    mat3 normalMatrix = mat3(in_modelview0.xyz, in_modelview1.xyz, in_modelview2.xyz);\n"
+	"    vec3 translation = vec3(in_modelview0.w, in_modelview1.w, in_modelview2.w);\n"
+	"    vec3 vPosition3 = normalMatrix * in_position.xyz + translation;\n"
+	"    gl_Position = vec4(in_projection.xy * vPosition3.xy,\n"
+	"        in_projection.z * vPosition3.z + in_projection.w, -vPosition3.z);\n"
 	"    vec3 vEyeNormal = normalMatrix * in_normal;\n"
-	"    vec4 vPosition4 = modelviewMatrix * in_position;\n"
-	"    vec3 vPosition3 = vPosition4.xyz / vPosition4.w;\n"
 	"    vec3 vLightDir = normalize(lightSource.xyz - vPosition3);\n"
 	"    float diff = max(0.0, dot(vEyeNormal, vLightDir));\n"
 	"    vVaryingColor = vec4(diff * in_color.rgb, 1.0);\n"
@@ -141,21 +53,58 @@ static const char *fragment_shader_source =
 
 struct gl_kmscube_data {
 	GLuint program;
-	GLint modelviewmatrix;
-	GLint modelviewprojectionmatrix;
-	GLint normalmatrix;
-	GLuint vbo;
-	GLuint positionsoffset;
-	GLuint colorsoffset;
-	GLuint normalsoffset;
-	GLuint vertex_shader;
-	GLuint fragment_shader;
+	struct gl_mesh mesh;
+	int mesh_repeat;
 	GLuint bgcolor;
 	GLuint alpha;
 	GLuint width;
 	GLuint height;
+	int static_background;
+};
+
+
+/*
+ * Program and vertex attributes are per context state, bind them again
+ * in case another context of the share group drew the previous frame.
+ */
+static void bind_kmscube (struct gl_kmscube_data *priv)
+{
+	glUseProgram(priv->program);
+	gl_mesh_bind(&priv->mesh);
+}
+
+/* what the surfaces of a share group have in common */
+struct kmscube_objects {
+	GLuint program;
+	struct gl_mesh mesh;
+	size_t bytes;
 };
 
+static struct kmscube_objects *kmscube_create_objects (struct render_thread_param *prm)
+{
+	static const char *const attribs[] = {
+		"in_position", "in_normal", "in_color",
+		"in_modelview0", "in_modelview1", "in_modelview2", "in_projection", NULL
+	};
+	struct kmscube_objects *objects = calloc(sizeof(struct kmscube_objects), 1);
+
+	if(!objects) {
+		printf("kmscube: could not allocate objects\n");
+		return NULL;
+	}
+
+	objects->program = program_cache_create("kmscube", vertex_shader_source,
+			fragment_shader_source, attribs);
+	if(!objects->program || gl_mesh_create(&objects->mesh, prm->mesh_layout)) {
+		free(objects);
+		return NULL;
+	}
+
+	objects->bytes = program_cache_binary_size(objects->program) +
+		gl_mesh_fetch_size(&objects->mesh);
+
+	return objects;
+}
 
 /*
  * kmscube setup
@@ -172,112 +121,80 @@ struct gl_kmscube_data {
  */
 void *setup_kmscube (struct render_thread_param *prm)
 {
-
-	int ret;
-
+	struct kmscube_objects *shared;
 	struct gl_kmscube_data *priv = calloc(sizeof(struct gl_kmscube_data), 1);
 	if(!priv) {
 		printf("kmscube: could not allocate priv data\n");
 		return NULL;
 	}
 
-	priv->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-
-	glShaderSource(priv->vertex_shader, 1, &vertex_shader_source, NULL);
-	glCompileShader(priv->vertex_shader);
-
-	glGetShaderiv(priv->vertex_shader, GL_COMPILE_STATUS, &ret);
-	if (!ret) {
-		char *log;
-
-		printf("kmscube : vertex shader compilation failed!:\n");
-		glGetShaderiv(priv->vertex_shader, GL_INFO_LOG_LENGTH, &ret);
-		if (ret > 1) {
-			log = malloc(ret);
-			glGetShaderInfoLog(priv->vertex_shader, ret, NULL, log);
-			printf("kmscube : %s", log);
+	shared = render_share_lock(prm);
+	if(!shared) {
+		shared = kmscube_create_objects(prm);
+		if(!shared) {
+			render_share_unlock(prm, NULL, 0);
+			return NULL;
 		}
-
-		return NULL;
 	}
+	render_share_unlock(prm, shared, shared->bytes);
 
-	priv->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-
-	glShaderSource(priv->fragment_shader, 1, &fragment_shader_source, NULL);
-	glCompileShader(priv->fragment_shader);
+	priv->program = shared->program;
+	priv->mesh = shared->mesh;
+	priv->mesh_repeat = prm->mesh_repeat > 0 ? prm->mesh_repeat : 1;
+	printf("kmscube : %s mesh, %zu bytes per vertex, %zu bytes fetched per frame\n",
+			gl_mesh_layout_name(prm->mesh_layout), priv->mesh.vertex_size,
+			gl_mesh_fetch_size(&priv->mesh) * priv->mesh_repeat);
 
-	glGetShaderiv(priv->fragment_shader, GL_COMPILE_STATUS, &ret);
-	if (!ret) {
-		char *log;
+	bind_kmscube(priv);
 
-		printf("kmscube : fragment shader compilation failed!:\n");
-		glGetShaderiv(priv->fragment_shader, GL_INFO_LOG_LENGTH, &ret);
-
-		if (ret > 1) {
-			log = malloc(ret);
-			glGetShaderInfoLog(priv->fragment_shader, ret, NULL, log);
-			printf("kmscube : %s", log);
-		}
-
-		return NULL;
-	}
-
-	priv->program = glCreateProgram();
-
-	glAttachShader(priv->program, priv->vertex_shader);
-	glAttachShader(priv->program, priv->fragment_shader);
-
-	glBindAttribLocation(priv->program, 0, "in_position");
-	glBindAttribLocation(priv->program, 1, "in_normal");
-	glBindAttribLocation(priv->program, 2, "in_color");
-
-	glLinkProgram(priv->program);
-
-	glGetProgramiv(priv->program, GL_LINK_STATUS, &ret);
-	if (!ret) {
-		char *log;
+	priv->bgcolor = rand();
+	priv->alpha = (priv->bgcolor & 0xff000000) >> 24;
+	priv->width = prm->frame_width;
+	priv->height = prm->frame_height;
 
-		printf("kmscube : program linking failed!:\n");
-		glGetProgramiv(priv->program, GL_INFO_LOG_LENGTH, &ret);
+	/* a background changing every frame would damage all of it anyway */
+	priv->static_background = prm->render_priv_damage != NULL;
 
-		if (ret > 1) {
-			log = malloc(ret);
-			glGetProgramInfoLog(priv->program, ret, NULL, log);
-			printf("kmscube : %s", log);
-		}
+	return (void *)priv;
+}
 
-		return NULL;
+/*
+ * kmscube damage
+ * The cube spins in place, so it never leaves the screen area of its
+ * bounding sphere (radius sqrt(3), 8 units in front of the eye). That
+ * area is the damage of every frame when the background is static.
+ */
+void damage_kmscube (void *priv, struct frame_damage *damage)
+{
+	struct gl_kmscube_data *prm = priv;
+	GLfloat aspect = (GLfloat)(prm->height) / (GLfloat)(prm->width);
+	/* tangent of the half angle the sphere covers */
+	float t = sqrtf(3.0f) / sqrtf(64.0f - 3.0f);
+	/* same frustum as render_kmscube, scaled to pixels */
+	int half_w = t * 6.0f / 2.8f * prm->width / 2 + 2;
+	int half_h = t * 6.0f / (2.8f * aspect) * prm->height / 2 + 2;
+
+	if(!prm->static_background) {
+		damage->full = 1;
+		return;
 	}
 
-	glUseProgram(priv->program);
+	if(half_w > (int)prm->width / 2)
+		half_w = prm->width / 2;
+	if(half_h > (int)prm->height / 2)
+		half_h = prm->height / 2;
 
-	priv->modelviewmatrix = glGetUniformLocation(priv->program, "modelviewMatrix");
-	priv->modelviewprojectionmatrix = glGetUniformLocation(priv->program, "modelviewprojectionMatrix");
-	priv->normalmatrix = glGetUniformLocation(priv->program, "normalMatrix");
-
-
-	priv->positionsoffset = 0;
-	priv->colorsoffset = sizeof(vVertices);
-	priv->normalsoffset = sizeof(vVertices) + sizeof(vColors);
-	glGenBuffers(1, &priv->vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, priv->vbo);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vVertices) + sizeof(vColors) + sizeof(vNormals), 0, GL_STATIC_DRAW);
-	glBufferSubData(GL_ARRAY_BUFFER, priv->positionsoffset, sizeof(vVertices), &vVertices[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, priv->colorsoffset, sizeof(vColors), &vColors[0]);
-	glBufferSubData(GL_ARRAY_BUFFER, priv->normalsoffset, sizeof(vNormals), &vNormals[0]);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)priv->positionsoffset);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)priv->normalsoffset);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (const GLvoid*)priv->colorsoffset);
-	glEnableVertexAttribArray(2);
+	frame_damage_add(damage, (int)prm->width / 2 - half_w, (int)prm->height / 2 - half_h,
+			2 * half_w, 2 * half_h);
+}
 
-	priv->bgcolor = rand();
-	priv->alpha = (priv->bgcolor & 0xff000000) >> 24;
-	priv->width = prm->frame_width;
-	priv->height = prm->frame_height;
+/* the aspect ratio stays, the cube just takes fewer pixels */
+void resize_kmscube (void *priv, unsigned int width, unsigned int height)
+{
+	struct gl_kmscube_data *prm = priv;
 
-	return (void *)priv;
+	prm->width = width;
+	prm->height = height;
 }
 
 /*
@@ -294,13 +211,15 @@ void *setup_kmscube (struct render_thread_param *prm)
 int render_kmscube (void *priv)
 {
 	static int j = 0;
-	int r, g, b;
+	int r, g, b, i;
 	struct gl_kmscube_data *prm = priv;
 	/* connect the context to the surface */
 
-	r = (((prm->bgcolor & 0x00ff0000) >> 16) + j) % 512;
-	g = (((prm->bgcolor & 0x0000ff00) >> 8) + j) % 512;
-	b = ((prm->bgcolor & 0x000000ff) + j) % 512;
+	int k = prm->static_background ? 0 : j;
+
+	r = (((prm->bgcolor & 0x00ff0000) >> 16) + k) % 512;
+	g = (((prm->bgcolor & 0x0000ff00) >> 8) + k) % 512;
+	b = ((prm->bgcolor & 0x000000ff) + k) % 512;
 
 	if(r >= 256) 
 		r = 511 - r;
@@ -309,6 +228,8 @@ int render_kmscube (void *priv)
 	if(b >= 256) 
 		b = 511 - b;
 
+	bind_kmscube(prm);
+
 	glViewport(0, 0, prm->width, prm->height);
 	glEnable(GL_CULL_FACE);
 
@@ -334,31 +255,15 @@ int render_kmscube (void *priv)
 	esMatrixLoadIdentity(&projection);
 	esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
 
-	ESMatrix modelviewprojection;
-	esMatrixLoadIdentity(&modelviewprojection);
-	esMatrixMultiply(&modelviewprojection, &modelview, &projection);
-
-	float normal[9];
-	normal[0] = modelview.m[0][0];
-	normal[1] = modelview.m[0][1];
-	normal[2] = modelview.m[0][2];
-	normal[3] = modelview.m[1][0];
-	normal[4] = modelview.m[1][1];
-	normal[5] = modelview.m[1][2];
-	normal[6] = modelview.m[2][0];
-	normal[7] = modelview.m[2][1];
-	normal[8] = modelview.m[2][2];
-
-	glUniformMatrix4fv(prm->modelviewmatrix, 1, GL_FALSE, &modelview.m[0][0]);
-	glUniformMatrix4fv(prm->modelviewprojectionmatrix, 1, GL_FALSE, &modelviewprojection.m[0][0]);
-	glUniformMatrix3fv(prm->normalmatrix, 1, GL_FALSE, normal);
-
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 4, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 8, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 12, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 16, 4);
-	glDrawArrays(GL_TRIANGLE_STRIP, 20, 4);
+	for(i = 0; i < 3; i++)
+		glVertexAttrib4f(3 + i, modelview.m[i][0], modelview.m[i][1], modelview.m[i][2],
+				modelview.m[3][i]);
+	glVertexAttrib4f(6, projection.m[0][0], projection.m[1][1], projection.m[2][2],
+			projection.m[3][2]);
+
+	/* more than once only to load the vertex fetch, see bench_layout.sh */
+	for(i = 0; i < prm->mesh_repeat; i++)
+		gl_mesh_draw(&prm->mesh);
 
 	glDisable(GL_CULL_FACE);
 
@@ -5,5 +5,7 @@
 
 void *setup_kmscube (struct render_thread_param *prm);
 int render_kmscube (void *prm);
+void damage_kmscube (void *prm, struct frame_damage *damage);
+void resize_kmscube (void *prm, unsigned int width, unsigned int height);
 
 #endif /*__GL_KMSCUBE_H__*/
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "gl_mesh.h"
+
+/* GLES3 vertex types, gl3.h does not mix with gl2.h */
+#ifndef GL_HALF_FLOAT
+#define GL_HALF_FLOAT 0x140B
+#endif
+#ifndef GL_INT_2_10_10_10_REV
+#define GL_INT_2_10_10_10_REV 0x8D9F
+#endif
+
+#define MESH_VERTICES (24)
+#define MESH_INDICES (36)
+#define CACHE_SIZE (16)	/* FIFO post-transform cache the order is optimized for */
+
+static const GLfloat vVertices[] = {
+	// front
+	-1.0f, -1.0f, +1.0f, // point blue
+	+1.0f, -1.0f, +1.0f, // point magenta
+	-1.0f, +1.0f, +1.0f, // point cyan
+	+1.0f, +1.0f, +1.0f, // point white
+	// back
+	+1.0f, -1.0f, -1.0f, // point red
+	-1.0f, -1.0f, -1.0f, // point black
+	+1.0f, +1.0f, -1.0f, // point yellow
+	-1.0f, +1.0f, -1.0f, // point green
+	// right
+	+1.0f, -1.0f, +1.0f, // point magenta
+	+1.0f, -1.0f, -1.0f, // point red
+	+1.0f, +1.0f, +1.0f, // point white
+	+1.0f, +1.0f, -1.0f, // point yellow
+	// left
+	-1.0f, -1.0f, -1.0f, // point black
+	-1.0f, -1.0f, +1.0f, // point blue
+	-1.0f, +1.0f, -1.0f, // point green
+	-1.0f, +1.0f, +1.0f, // point cyan
+	// top
+	-1.0f, +1.0f, +1.0f, // point cyan
+	+1.0f, +1.0f, +1.0f, // point white
+	-1.0f, +1.0f, -1.0f, // point green
+	+1.0f, +1.0f, -1.0f, // point yellow
+	// bottom
+	-1.0f, -1.0f, -1.0f, // point black
+	+1.0f, -1.0f, -1.0f, // point red
+	-1.0f, -1.0f, +1.0f, // point blue
+	+1.0f, -1.0f, +1.0f  // point magenta
+};
+
+static const GLfloat vColors[] = {
+	// front
+	0.0f,  0.0f,  1.0f, // blue
+	1.0f,  0.0f,  1.0f, // magenta
+	0.0f,  1.0f,  1.0f, // cyan
+	1.0f,  1.0f,  1.0f, // white
+	// back
+	1.0f,  0.0f,  0.0f, // red
+	0.0f,  0.0f,  0.0f, // black
+	1.0f,  1.0f,  0.0f, // yellow
+	0.0f,  1.0f,  0.0f, // green
+	// right
+	1.0f,  0.0f,  1.0f, // magenta
+	1.0f,  0.0f,  0.0f, // red
+	1.0f,  1.0f,  1.0f, // white
+	1.0f,  1.0f,  0.0f, // yellow
+	// left
+	0.0f,  0.0f,  0.0f, // black
+	0.0f,  0.0f,  1.0f, // blue
+	0.0f,  1.0f,  0.0f, // green
+	0.0f,  1.0f,  1.0f, // cyan
+	// top
+	0.0f,  1.0f,  1.0f, // cyan
+	1.0f,  1.0f,  1.0f, // white
+	0.0f,  1.0f,  0.0f, // green
+	1.0f,  1.0f,  0.0f, // yellow
+	// bottom
+	0.0f,  0.0f,  0.0f, // black
+	1.0f,  0.0f,  0.0f, // red
+	0.0f,  0.0f,  1.0f, // blue
+	1.0f,  0.0f,  1.0f  // magenta
+};
+
+static const GLfloat vNormals[] = {
+	// front
+	+0.0f, +0.0f, +1.0f, // forward
+	+0.0f, +0.0f, +1.0f, // forward
+	+0.0f, +0.0f, +1.0f, // forward
+	+0.0f, +0.0f, +1.0f, // forward
+	// back
+	+0.0f, +0.0f, -1.0f, // backbard
+	+0.0f, +0.0f, -1.0f, // backbard
+	+0.0f, +0.0f, -1.0f, // backbard
+	+0.0f, +0.0f, -1.0f, // backbard
+	// right
+	+1.0f, +0.0f, +0.0f, // right
+	+1.0f, +0.0f, +0.0f, // right
+	+1.0f, +0.0f, +0.0f, // right
+	+1.0f, +0.0f, +0.0f, // right
+	// left
+	-1.0f, +0.0f, +0.0f, // left
+	-1.0f, +0.0f, +0.0f, // left
+	-1.0f, +0.0f, +0.0f, // left
+	-1.0f, +0.0f, +0.0f, // left
+	// top
+	+0.0f, +1.0f, +0.0f, // up
+	+0.0f, +1.0f, +0.0f, // up
+	+0.0f, +1.0f, +0.0f, // up
+	+0.0f, +1.0f, +0.0f, // up
+	// bottom
+	+0.0f, -1.0f, +0.0f, // down
+	+0.0f, -1.0f, +0.0f, // down
+	+0.0f, -1.0f, +0.0f, // down
+	+0.0f, -1.0f, +0.0f  // down
+};
+
+static const char *layout_names[MESH_NUM_LAYOUTS] = {
+	[MESH_SEPARATE] = "separate",
+	[MESH_INTERLEAVED] = "interleaved",
+	[MESH_INDEXED] = "indexed",
+	[MESH_PACKED] = "packed",
+};
+
+int gl_mesh_parse_layout (const char *name)
+{
+	int count;
+
+	for(count = 0; count < MESH_NUM_LAYOUTS; count++)
+		if(strcmp(name, layout_names[count]) == 0)
+			return count;
+
+	printf("unknown mesh layout '%s'\n", name);
+	return -1;
+}
+
+const char *gl_mesh_layout_name (enum mesh_layout layout)
+{
+	return layout_names[layout];
+}
+
+static int has_gles3 (void)
+{
+	int major = 2;
+
+	sscanf((const char *)glGetString(GL_VERSION), "OpenGL ES %d", &major);
+
+	return major >= 3;
+}
+
+static int has_extension (const char *name)
+{
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+
+	return extensions && strstr(extensions, name);
+}
+
+/* average cache misses per triangle of a FIFO cache */
+static float mesh_acmr (const GLushort *indices, int count_indices)
+{
+	GLushort cache[CACHE_SIZE];
+	int cached = 0, misses = 0, count, slot;
+
+	for(count = 0; count < count_indices; count++) {
+		for(slot = 0; slot < cached; slot++)
+			if(cache[slot] == indices[count])
+				break;
+		if(slot < cached)
+			continue;
+
+		misses++;
+		if(cached == CACHE_SIZE)
+			memmove(cache, cache + 1, (CACHE_SIZE - 1) * sizeof(GLushort));
+		else
+			cached++;
+		cache[cached - 1] = indices[count];
+	}
+
+	return misses / (count_indices / 3.0f);
+}
+
+/*
+ * Greedy triangle order for a FIFO cache: take the triangle with the most
+ * vertices in the cache next. Quadratic, which is fine for small meshes.
+ */
+static void mesh_optimize_order (GLushort *indices, int count_indices)
+{
+	int count_triangles = count_indices / 3;
+	GLushort *out = malloc(count_indices * sizeof(GLushort));
+	char *emitted = calloc(count_triangles, 1);
+	GLushort cache[CACHE_SIZE];
+	int cached = 0, n, tri, corner, slot;
+
+	if(!out || !emitted) {
+		free(out);
+		free(emitted);
+		return;
+	}
+
+	for(n = 0; n < count_triangles; n++) {
+		int best = -1, best_hits = -1;
+
+		for(tri = 0; tri < count_triangles; tri++) {
+			int hits = 0;
+
+			if(emitted[tri])
+				continue;
+			for(corner = 0; corner < 3; corner++)
+				for(slot = 0; slot < cached; slot++)
+					if(cache[slot] == indices[tri * 3 + corner])
+						hits++;
+			if(hits > best_hits) {
+				best = tri;
+				best_hits = hits;
+			}
+		}
+
+		emitted[best] = 1;
+		for(corner = 0; corner < 3; corner++) {
+			GLushort index = indices[best * 3 + corner];
+
+			out[n * 3 + corner] = index;
+			for(slot = 0; slot < cached; slot++)
+				if(cache[slot] == index)
+					break;
+			if(slot < cached)
+				continue;
+			if(cached == CACHE_SIZE)
+				memmove(cache, cache + 1, (CACHE_SIZE - 1) * sizeof(GLushort));
+			else
+				cached++;
+			cache[cached - 1] = index;
+		}
+	}
+
+	memcpy(indices, out, count_indices * sizeof(GLushort));
+	free(out);
+	free(emitted);
+}
+
+/*
+ * Number the vertices in the order the indices first use them, so the
+ * vertex fetch walks the buffer forward. remap[old] is the new index.
+ */
+static void mesh_optimize_fetch (GLushort *indices, int count_indices, int *remap, int count_vertices)
+{
+	int count, next = 0;
+
+	for(count = 0; count < count_vertices; count++)
+		remap[count] = -1;
+
+	for(count = 0; count < count_indices; count++) {
+		if(remap[indices[count]] < 0)
+			remap[indices[count]] = next++;
+		indices[count] = remap[indices[count]];
+	}
+
+	/* vertices no triangle uses go last */
+	for(count = 0; count < count_vertices; count++)
+		if(remap[count] < 0)
+			remap[count] = next++;
+}
+
+static uint16_t float_to_half (float value)
+{
+	union { float f; uint32_t u; } v = { .f = value };
+	uint32_t sign = (v.u >> 16) & 0x8000;
+	int exponent = ((v.u >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = v.u & 0x7fffff;
+
+	if(exponent <= 0)
+		return sign;
+	if(exponent >= 31)
+		return sign | 0x7c00;
+
+	return sign | (exponent << 10) | ((mantissa + 0x1000) >> 13);
+}
+
+static int32_t snorm10 (float value)
+{
+	return ((int32_t)(value * 511.0f + (value < 0 ? -0.5f : 0.5f))) & 0x3ff;
+}
+
+static void set_attrib (struct mesh_attrib *attrib, GLint size, GLenum type, GLboolean normalized,
+		GLsizei stride, size_t offset)
+{
+	attrib->size = size;
+	attrib->type = type;
+	attrib->normalized = normalized;
+	attrib->stride = stride;
+	attrib->offset = offset;
+}
+
+/* write vertex v of the source arrays at dst in the packed format */
+static void pack_vertex (struct gl_mesh *mesh, char *dst, int v)
+{
+	struct mesh_attrib *position = &mesh->attribs[0], *normal = &mesh->attribs[1];
+	uint8_t *color = (uint8_t *)(dst + mesh->attribs[2].offset);
+	int count;
+
+	if(position->type == GL_FLOAT) {
+		memcpy(dst, &vVertices[v * 3], 3 * sizeof(GLfloat));
+	} else {
+		uint16_t *half = (uint16_t *)dst;
+		for(count = 0; count < 3; count++)
+			half[count] = float_to_half(vVertices[v * 3 + count]);
+		half[3] = float_to_half(1.0f);
+	}
+
+	if(normal->type == GL_INT_2_10_10_10_REV) {
+		int32_t packed = snorm10(vNormals[v * 3]) | (snorm10(vNormals[v * 3 + 1]) << 10) |
+			(snorm10(vNormals[v * 3 + 2]) << 20);
+		memcpy(dst + normal->offset, &packed, sizeof(packed));
+	} else {
+		int8_t *bytes = (int8_t *)(dst + normal->offset);
+		for(count = 0; count < 3; count++)
+			bytes[count] = vNormals[v * 3 + count] * 127.0f;
+		bytes[3] = 0;
+	}
+
+	for(count = 0; count < 3; count++)
+		color[count] = vColors[v * 3 + count] * 255.0f;
+	color[3] = 255;
+}
+
+static void *mesh_vertices (struct gl_mesh *mesh, const int *remap)
+{
+	char *data = malloc(MESH_VERTICES * mesh->vertex_size);
+	GLfloat *floats = (GLfloat *)data;
+	int v;
+
+	if(!data)
+		return NULL;
+
+	switch(mesh->layout) {
+	case MESH_SEPARATE:
+		memcpy(data + mesh->attribs[0].offset, vVertices, sizeof(vVertices));
+		memcpy(data + mesh->attribs[1].offset, vNormals, sizeof(vNormals));
+		memcpy(data + mesh->attribs[2].offset, vColors, sizeof(vColors));
+		break;
+	case MESH_INTERLEAVED:
+	case MESH_INDEXED:
+		for(v = 0; v < MESH_VERTICES; v++) {
+			GLfloat *dst = &floats[remap[v] * 9];
+			memcpy(&dst[0], &vVertices[v * 3], 3 * sizeof(GLfloat));
+			memcpy(&dst[3], &vNormals[v * 3], 3 * sizeof(GLfloat));
+			memcpy(&dst[6], &vColors[v * 3], 3 * sizeof(GLfloat));
+		}
+		break;
+	case MESH_PACKED:
+		for(v = 0; v < MESH_VERTICES; v++)
+			pack_vertex(mesh, data + remap[v] * mesh->vertex_size, v);
+		break;
+	default:
+		break;
+	}
+
+	return data;
+}
+
+int gl_mesh_create (struct gl_mesh *mesh, enum mesh_layout layout)
+{
+	GLushort indices[MESH_INDICES];
+	int remap[MESH_VERTICES];
+	GLsizei stride;
+	void *vertices;
+	int face, count;
+
+	memset(mesh, 0, sizeof(*mesh));
+	mesh->layout = layout;
+	mesh->count_vertices = MESH_VERTICES;
+
+	/* the two triangles of every face strip */
+	for(face = 0; face < 6; face++) {
+		static const int quad[6] = { 0, 1, 2, 2, 1, 3 };
+		for(count = 0; count < 6; count++)
+			indices[face * 6 + count] = face * 4 + quad[count];
+	}
+	for(count = 0; count < MESH_VERTICES; count++)
+		remap[count] = count;
+
+	switch(layout) {
+	case MESH_SEPARATE:
+		mesh->vertex_size = 9 * sizeof(GLfloat);
+		set_attrib(&mesh->attribs[0], 3, GL_FLOAT, GL_FALSE, 0, 0);
+		set_attrib(&mesh->attribs[2], 3, GL_FLOAT, GL_FALSE, 0, sizeof(vVertices));
+		set_attrib(&mesh->attribs[1], 3, GL_FLOAT, GL_FALSE, 0, sizeof(vVertices) + sizeof(vColors));
+		break;
+	case MESH_INTERLEAVED:
+	case MESH_INDEXED:
+		stride = 9 * sizeof(GLfloat);
+		mesh->vertex_size = stride;
+		set_attrib(&mesh->attribs[0], 3, GL_FLOAT, GL_FALSE, stride, 0);
+		set_attrib(&mesh->attribs[1], 3, GL_FLOAT, GL_FALSE, stride, 3 * sizeof(GLfloat));
+		set_attrib(&mesh->attribs[2], 3, GL_FLOAT, GL_FALSE, stride, 6 * sizeof(GLfloat));
+		break;
+	case MESH_PACKED: {
+		int gles3 = has_gles3();
+		size_t offset;
+
+		if(gles3 || has_extension("GL_OES_vertex_half_float")) {
+			set_attrib(&mesh->attribs[0], 4, gles3 ? GL_HALF_FLOAT : GL_HALF_FLOAT_OES,
+					GL_FALSE, 0, 0);
+			offset = 4 * sizeof(uint16_t);
+		} else {
+			set_attrib(&mesh->attribs[0], 3, GL_FLOAT, GL_FALSE, 0, 0);
+			offset = 3 * sizeof(GLfloat);
+		}
+		/* GLES2 has no 2_10_10_10 vertices, bytes are as small */
+		set_attrib(&mesh->attribs[1], 4, gles3 ? GL_INT_2_10_10_10_REV : GL_BYTE, GL_TRUE, 0, offset);
+		set_attrib(&mesh->attribs[2], 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, offset + 4);
+		mesh->vertex_size = offset + 8;
+		for(count = 0; count < 3; count++)
+			mesh->attribs[count].stride = mesh->vertex_size;
+		break;
+	}
+	default:
+		return -1;
+	}
+
+	if(layout >= MESH_INDEXED) {
+		float before = mesh_acmr(indices, MESH_INDICES);
+
+		mesh_optimize_order(indices, MESH_INDICES);
+		mesh_optimize_fetch(indices, MESH_INDICES, remap, MESH_VERTICES);
+		printf("mesh : %s layout, ACMR %.2f -> %.2f with a %d entry cache\n",
+				layout_names[layout], before, mesh_acmr(indices, MESH_INDICES), CACHE_SIZE);
+
+		mesh->count_indices = MESH_INDICES;
+		mesh->index_type = GL_UNSIGNED_SHORT;
+		glGenBuffers(1, &mesh->ibo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	}
+
+	vertices = mesh_vertices(mesh, remap);
+	if(!vertices) {
+		printf("mesh : could not allocate the vertices\n");
+		return -1;
+	}
+
+	glGenBuffers(1, &mesh->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	glBufferData(GL_ARRAY_BUFFER, MESH_VERTICES * mesh->vertex_size, vertices, GL_STATIC_DRAW);
+	free(vertices);
+
+	return 0;
+}
+
+void gl_mesh_bind (struct gl_mesh *mesh)
+{
+	int count;
+
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+	if(mesh->ibo)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ibo);
+
+	for(count = 0; count < 3; count++) {
+		struct mesh_attrib *attrib = &mesh->attribs[count];
+
+		glVertexAttribPointer(count, attrib->size, attrib->type, attrib->normalized,
+				attrib->stride, (const GLvoid *)attrib->offset);
+		glEnableVertexAttribArray(count);
+	}
+}
+
+void gl_mesh_draw (struct gl_mesh *mesh)
+{
+	int face;
+
+	if(mesh->count_indices) {
+		glDrawElements(GL_TRIANGLES, mesh->count_indices, mesh->index_type, 0);
+		return;
+	}
+
+	for(face = 0; face < 6; face++)
+		glDrawArrays(GL_TRIANGLE_STRIP, face * 4, 4);
+}
+
+size_t gl_mesh_fetch_size (struct gl_mesh *mesh)
+{
+	return mesh->count_vertices * mesh->vertex_size + mesh->count_indices * sizeof(GLushort);
+}
@@ -0,0 +1,61 @@
+#ifndef __GL_MESH_H__
+#define __GL_MESH_H__
+
+#include <stddef.h>
+#include <GLES2/gl2.h>
+
+/*
+ * Vertex buffer layouts of the kmscube mesh, from the original one to
+ * the cheapest to fetch.
+ *   separate     position, color and normal float arrays one after the
+ *                other, six strips (the original kmscube)
+ *   interleaved  the same floats, one vertex after the other
+ *   indexed      interleaved, one indexed triangle list in vertex cache
+ *                order
+ *   packed       indexed with half float positions, 2_10_10_10 normals
+ *                and normalized byte colors
+ */
+enum mesh_layout {
+	MESH_SEPARATE,
+	MESH_INTERLEAVED,
+	MESH_INDEXED,
+	MESH_PACKED,
+	MESH_NUM_LAYOUTS
+};
+
+struct mesh_attrib {
+	GLint size;
+	GLenum type;
+	GLboolean normalized;
+	GLsizei stride;
+	size_t offset;
+};
+
+/* attribute locations are 0 position, 1 normal, 2 color */
+struct gl_mesh {
+	enum mesh_layout layout;
+	GLuint vbo;
+	GLuint ibo;
+
+	struct mesh_attrib attribs[3];
+	size_t vertex_size;	/* bytes of all attributes of one vertex */
+	int count_vertices;
+	int count_indices;	/* 0 without index buffer */
+	GLenum index_type;
+};
+
+/* -1 if there is no such layout */
+int gl_mesh_parse_layout (const char *name);
+const char *gl_mesh_layout_name (enum mesh_layout layout);
+
+/* NOTE: Must be called with a current context. Returns -1 on failure. */
+int gl_mesh_create (struct gl_mesh *mesh, enum mesh_layout layout);
+
+/* buffers and attribute pointers are per context, bind them every frame */
+void gl_mesh_bind (struct gl_mesh *mesh);
+void gl_mesh_draw (struct gl_mesh *mesh);
+
+/* bytes the GPU reads for the vertices of one draw of the mesh */
+size_t gl_mesh_fetch_size (struct gl_mesh *mesh);
+
+#endif /*__GL_MESH_H__*/
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "headless.h"
+
+/*
+ * Headless backend.
+ *
+ * There is no display and no scanout: every render thread draws into its
+ * own pbuffer on an EGL_MESA_platform_surfaceless display, so the whole
+ * pipeline can run on a software rasterizer like llvmpipe. The render
+ * threads are not throttled by anything but the GPU, and
+ * update_all_surfaces only paces the main loop like a 60Hz display would.
+ */
+
+#define HEADLESS_PERIOD_USEC (16667)
+
+struct headless_data *init_headless (void)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	const char *extensions;
+
+	extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if(!extensions || !strstr(extensions, "EGL_MESA_platform_surfaceless")) {
+		printf("EGL_MESA_platform_surfaceless not supported\n");
+		return NULL;
+	}
+
+	get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+			eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if(!get_platform_display) {
+		printf("eglGetPlatformDisplayEXT not found\n");
+		return NULL;
+	}
+
+	struct headless_data *headless = calloc(sizeof(struct headless_data), 1);
+	if(!headless) {
+		printf("headless data alloc failed\n");
+		return NULL;
+	}
+
+	headless->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+			EGL_DEFAULT_DISPLAY, NULL);
+	if(headless->display == EGL_NO_DISPLAY) {
+		printf("surfaceless display not available\n");
+		free(headless);
+		return NULL;
+	}
+
+	headless->period_usec = HEADLESS_PERIOD_USEC;
+
+	return headless;
+}
+
+struct headless_surface_data *get_new_surface(struct headless_data *headless, int posx, int posy, int width, int height)
+{
+	int count;
+
+	for(count = 0; count < HEADLESS_MAX_SURFACES; count++) {
+		if(!headless->sdata[count].occupied)
+			break;
+	}
+
+	if(count == HEADLESS_MAX_SURFACES) {
+		printf("no more surfaces\n");
+		return NULL;
+	}
+
+	headless->sdata[count].posx = posx;
+	headless->sdata[count].posy = posy;
+	headless->sdata[count].width = width;
+	headless->sdata[count].height = height;
+	headless->sdata[count].occupied = 1;
+	headless->count_surfaces++;
+
+	return &headless->sdata[count];
+}
+
+int update_all_surfaces(struct headless_data *headless)
+{
+	struct timespec t;
+
+	t.tv_sec = headless->period_usec / 1000000;
+	t.tv_nsec = (headless->period_usec % 1000000) * 1000;
+
+	nanosleep(&t, NULL);
+
+	return 0;
+}
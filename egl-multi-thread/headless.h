@@ -0,0 +1,31 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+#include <EGL/egl.h>
+
+#define HEADLESS_MAX_SURFACES (64)
+
+struct headless_surface_data {
+	int width;
+	int height;
+	int posx;
+	int posy;
+
+	int occupied;
+};
+
+struct headless_data {
+	EGLDisplay display;
+
+	/* simulated refresh period of the fake display */
+	unsigned int period_usec;
+
+	int count_surfaces;
+	struct headless_surface_data sdata[HEADLESS_MAX_SURFACES];
+};
+
+struct headless_data *init_headless (void);
+struct headless_surface_data *get_new_surface(struct headless_data *headless, int posx, int posy, int width, int height);
+int update_all_surfaces(struct headless_data *headless);
+
+#endif /*__HEADLESS_H__*/
@@ -1,62 +1,304 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #include "esUtil.h"
 #include "render_thread.h"
 #include "gl_kmscube.h"
-
-#ifndef USE_WAYLAND
-#include "drm_gbm.h"
-#else
+#include "gl_cubes.h"
+#include "gl_mesh.h"
+#include "program_cache.h"
+#include "stats.h"
+#include "event_loop.h"
+#include "render_pool.h"
+#include "thread_sched.h"
+#include "matrix_simd.h"
+#include "startup.h"
+#include "trace.h"
+
+#if defined(USE_WAYLAND)
 #include "wayland_window.h"
+#elif defined(USE_HEADLESS)
+#include "headless.h"
+#else
+#include "drm_gbm.h"
 #endif
 
-#ifndef USE_WAYLAND
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
 int CONNECTOR_ID = (24);
+int mailbox = 0;
+int explicit_fencing = 0;
 #endif
 
 #define FRAME_W (1280) /* should mach your fullscreen size maybe 1920*1080 */
 #define FRAME_H (720)  /* my fullscreen size is 1280*720 */
 
-#define MAX_NUM_THREADS (8)
+#define MAX_NUM_THREADS (64)
 
 int num_threads = 3;
+int num_workers = 0; /* 0: one render thread per surface */
+int num_cubes = 0; /* 0: the single kmscube */
+int no_instancing = 0;
+int mesh_layout = MESH_SEPARATE;
+int mesh_repeat = 0;
+int frame_w = FRAME_W;
+int frame_h = FRAME_H;
+int duration = 0; /* seconds, 0 runs until interrupted */
+int stats_interval = 5; /* seconds between two stats dumps */
+int damage_tracking = 0;
+int share_contexts = 0;
+int serial_init = 0;
+double frame_budget_ms = 0; /* 0: fixed resolution */
+int min_scale = 50; /* percent */
+
+/* per surface, the last one repeats for the surfaces after it */
+static const struct render_format *surface_formats[MAX_NUM_THREADS];
+static int num_formats = 0;
+
+struct surface_values {
+	int count;	/* 0: not given, the default applies */
+	int values[MAX_NUM_THREADS];
+};
+
+static struct surface_values swap_intervals;
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+static struct surface_values max_in_flight;
+static struct surface_values max_buffers;
+#endif
 
-#ifndef USE_WAYLAND
-static uint32_t gettime_msec()
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t trace_toggle = 0;
+static const char *trace_path = NULL;
+
+static void quit_handler(int sig)
 {
-	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
-	return (uint32_t)(t.tv_sec * 1000) + (uint32_t)(t.tv_nsec / 1000000);
+	quit = 1;
 }
 
-static uint32_t gettime_usec()
+static void trace_handler(int sig)
 {
-	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
-	return (uint32_t)(t.tv_sec * 1000000) + (uint32_t)(t.tv_nsec / 1000);
+	trace_toggle = 1;
 }
 
-unsigned long long gettime_nsec()
+/* SIGUSR1 starts tracing, the next one stops it and writes the file */
+static void handle_trace_toggle(void)
 {
-	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
-	return ((unsigned long long)t.tv_sec) * 1000000000 + t.tv_nsec;
+	if(!trace_toggle)
+		return;
+	trace_toggle = 0;
+
+	if(!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) {
+		printf("trace: started\n");
+		trace_set_enabled(1);
+	} else {
+		trace_set_enabled(0);
+		trace_write(trace_path);
+	}
 }
 
-unsigned long long __gettime()
+/* resident memory of the process in KiB, GL drivers allocate most of it */
+static long read_rss_kib(void)
 {
-	struct timespec t;
-	clock_gettime(CLOCK_REALTIME, &t);
-	return ((unsigned long long)t.tv_sec) * 1000000000 + t.tv_nsec;
+	char line[128];
+	long rss = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if(!f)
+		return 0;
+	while(fgets(line, sizeof(line), f))
+		if(sscanf(line, "VmRSS: %ld", &rss) == 1)
+			break;
+	fclose(f);
+
+	return rss;
+}
+
+static int parse_formats(char *list)
+{
+	char *name, *save = NULL;
+
+	num_formats = 0;
+	for(name = strtok_r(list, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if(num_formats == MAX_NUM_THREADS)
+			break;
+		surface_formats[num_formats] = render_format_parse(name);
+		if(!surface_formats[num_formats])
+			return -1;
+		num_formats++;
+	}
+
+	return 0;
+}
+
+static int parse_surface_values(char *list, struct surface_values *out, int min)
+{
+	char *value, *end, *save = NULL;
+
+	out->count = 0;
+	for(value = strtok_r(list, ",", &save); value; value = strtok_r(NULL, ",", &save)) {
+		if(out->count == MAX_NUM_THREADS)
+			break;
+		out->values[out->count] = strtol(value, &end, 10);
+		if(*end || out->values[out->count] < min) {
+			printf("invalid value %s, at least %d\n", value, min);
+			return -1;
+		}
+		out->count++;
+	}
+
+	return 0;
+}
+
+static int surface_value(const struct surface_values *list, int index, int def)
+{
+	if(!list->count)
+		return def;
+
+	return list->values[index < list->count ? index : list->count - 1];
+}
+
+/*
+ * What the color and depth buffers of every surface take and what
+ * reading them out at the display refresh costs. GBM and Wayland keep
+ * two or three color buffers per surface, only one is read per refresh.
+ */
+static void print_footprint(struct render_thread_param *prms, int count_prms,
+		int refresh_hz, int *planes)
+{
+	size_t total_color = 0, total_depth = 0;
+	double total_read = 0;
+	int count;
+
+	for(count = 0; count < count_prms; count++) {
+		struct render_thread_param *prm = &prms[count];
+		size_t pixels = (size_t)prm->frame_width * prm->frame_height;
+		size_t color = pixels * prm->format->bytes_per_pixel;
+		size_t depth = pixels * prm->depth_stencil_bits / 8;
+		double read = (double)color * refresh_hz / (1024 * 1024);
+
+		printf("surface %d: %s %ux%u, %zu KiB per color buffer, %zu KiB depth/stencil, "
+				"%.1f MiB/s read at %d Hz", count, prm->format->name,
+				prm->frame_width, prm->frame_height, color / 1024, depth / 1024,
+				read, refresh_hz);
+		if(planes && planes[count])
+			printf(" (scanout, plane %d)", planes[count]);
+		else if(planes)
+			printf(" (GPU composition)");
+		printf("\n");
+
+		total_color += color;
+		total_depth += depth;
+		total_read += read;
+	}
+
+	printf("surfaces: %zu KiB per set of color buffers, %zu KiB depth/stencil, %.1f MiB/s read\n",
+			total_color / 1024, total_depth / 1024, total_read);
+}
+
+static int stats_cb(int fd, void *data)
+{
+	stats_dump(0);
+	return 0;
+}
+
+static int duration_cb(int fd, void *data)
+{
+	quit = 1;
+	return 0;
+}
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+static int drm_event_cb(int fd, void *data)
+{
+	struct drm_data *dev = data;
+
+	handle_drm_events(dev);
+
+	/* the flip slot is free again, frames may be waiting for it */
+	return commit_ready_surfaces(dev);
+}
+
+static int frame_ready_cb(int fd, void *data)
+{
+	uint64_t frames;
+
+	/* another callback may have drained it already */
+	if(read(fd, &frames, sizeof(frames)) != sizeof(frames) && errno != EAGAIN) {
+		printf("frame queue read failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return commit_ready_surfaces(data);
 }
 #endif
 
+static void print_options(void)
+{
+	printf("Common options:\n");
+	printf("  --stats-interval <S>  print frame timing stats every S seconds,\n");
+	printf("                        0 prints them only at exit (default %d)\n", stats_interval);
+	printf("  --damage              keep the background static and only redraw,\n");
+	printf("                        swap and scan out the area around the cube\n");
+	printf("  --size <W>x<H>        size of every surface (default %dx%d)\n", FRAME_W, FRAME_H);
+	printf("  --workers <M>         render all surfaces with a pool of M threads\n");
+	printf("                        instead of one thread per surface\n");
+	printf("  --duration <S>        exit after S seconds\n");
+	printf("  --cubes <N>           draw N cubes per surface with a single draw call\n");
+	printf("                        instead of one kmscube\n");
+	printf("  --no-instancing       draw the cubes with per vertex transforms even\n");
+	printf("                        where instancing is supported\n");
+	printf("  --layout <name>       vertex layout of the kmscube mesh: separate (default),\n");
+	printf("                        interleaved, indexed or packed\n");
+	printf("  --mesh-repeat <N>     draw the kmscube mesh N times per frame\n");
+	printf("  --program-cache <dir> keep linked shader programs in dir and load them\n");
+	printf("                        from there instead of compiling\n");
+	printf("  --share-context       put all render contexts in one share group and create\n");
+	printf("                        programs and buffers once (always done with --workers)\n");
+	printf("  --format <f>[,<f>...] color format of every surface: rgb565, xrgb8888\n");
+	printf("                        (default) or argb8888, the last one repeats\n");
 #ifndef USE_WAYLAND
+	printf("  --frame-budget <ms>   lower the render resolution of a surface whose frames\n");
+	printf("                        take longer, raise it again when there is headroom\n");
+	printf("  --min-scale <percent> lowest render resolution (default %d)\n", min_scale);
+#endif
+	printf("  --swap-interval <n>[,<n>...]\n");
+	printf("                        eglSwapInterval of every surface, the last one repeats\n");
+	printf("  --serial-init         set up one render thread after the other in main\n");
+	printf("                        instead of all at once on their own threads\n");
+	printf("  --render-sched <spec> CPUs and policy of the render threads or workers\n");
+	printf("  --compositor-sched <spec>\n");
+	printf("                        same for the main (compositor) thread, specs are\n");
+	printf("                        comma separated cpus=0-3:6, spread, fifo=<prio|max>,\n");
+	printf("                        rr=<prio|max> and nice=<n>\n");
+	printf("  --trace <file>        record what every thread does and write it to file\n");
+	printf("                        as Chrome trace JSON at exit, for ui.perfetto.dev\n");
+	printf("                        or chrome://tracing. SIGUSR1 stops and writes it,\n");
+	printf("                        the next SIGUSR1 starts recording again\n");
+	printf("  --mlockall            lock all memory to avoid page faults while rendering\n");
+	printf("  --matrix-bench        check the SIMD matrix kernels against the scalar one,\n");
+	printf("                        time them and exit\n");
+}
+
+#if defined(USE_HEADLESS)
+void print_usage(char *app)
+{
+	printf("./%s [--threads <N>]\n", app);
+	printf("Renders N instances (at most %d) into pbuffers on a surfaceless\n \
+		EGL display and reports the frame timing of every render thread.\n", MAX_NUM_THREADS);
+	print_options();
+}
+#elif !defined(USE_WAYLAND)
 void print_usage(char *app)
 {
-	printf("./%s --connector <CONNECTOR ID>\n", app); 
+	printf("./%s --connector <CONNECTOR ID> [--threads <N>] [--mailbox] [--max-in-flight <N>[,<N>...]]\n \
+		[--buffers <N>[,<N>...]] [--fences]\n", app);
 	printf("You can get the CONNECTOR_ID by running modetest on the \n \
 			target. For example our board shows the following:\n \
 		Connectors: \n \
@@ -69,11 +311,31 @@ void print_usage(char *app)
 		  \n \
 		  On the above board, the CONNECTOR_ID will be set to 26.\n \
 	\n");
+	printf("With --threads, N instances (at most %d) are rendered. The ones that\n \
+		do not get a hardware plane are composited by the GPU into the\n \
+		primary plane.\n", MAX_NUM_THREADS);
+	printf("With --mailbox, every plane only latches a new buffer when its\n \
+		render thread has finished a frame, instead of waiting for all of them.\n");
+	printf("With --max-in-flight, a render thread does not start a new frame while\n \
+		N of its frames are still waiting to be latched (default: no limit).\n");
+	printf("With --buffers, a render thread uses at most N GBM buffers, including\n \
+		the ones on screen and queued, 2 for double buffering (default: all).\n \
+		Both take one value per surface, the last one repeats. Fewer frames\n \
+		in flight and fewer buffers lower the plane render-flip latency.\n");
+	printf("With --fences, render-done fences are passed to KMS as IN_FENCE_FD and\n \
+		buffers are released on the commit's OUT_FENCE_PTR fence.\n");
+#ifdef USE_FAKEKMS
+	printf("This build runs on a fake KMS device, set FAKEKMS_MODE=<W>x<H>@<Hz>,\n \
+		FAKEKMS_PLANES=<overlays> and FAKEKMS_MAX_ACTIVE=<planes> to shape it.\n \
+		Surfaces beyond the overlays go through the GPU composition.\n");
+#endif
+	print_options();
 }
 #else
 void print_usage(char *app)
 {
 	printf("./%s\n", app);
+	print_options();
 }
 #endif
 
@@ -82,73 +344,254 @@ int main(int argc, char **argv)
 	int ret;
 	int count;
 	
-#ifndef USE_WAYLAND
-	struct drm_data *dev;
-#else
+#if defined(USE_WAYLAND)
 	struct wayland_data *dev;
+#elif defined(USE_HEADLESS)
+	struct headless_data *dev;
+#else
+	struct drm_data *dev;
 #endif
 
-	pthread_t threadid[MAX_NUM_THREADS];
-	struct render_thread_param threadparams[MAX_NUM_THREADS];
-
-#ifndef USE_WAYLAND
-	float fps;
-	int frame_num = 0;
-	unsigned long long starttime = 0;
+	static struct render_thread_param threadparams[MAX_NUM_THREADS];
+	pthread_barrier_t start_barrier;
+	int parallel_init;
+	unsigned long long setup_start;
+	struct render_pool *pool;
+	struct thread_sched render_sched, compositor_sched;
+	struct render_share share = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	long rss;
+	int use_render_sched = 0, use_compositor_sched = 0, lock_memory = 0;
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	struct event_loop *loop;
+	static int surface_planes[MAX_NUM_THREADS];	/* 0 for GPU composition */
+#else
+	unsigned long long last_dump, start;
 #endif
 
+	startup_init();
+	memset(threadparams, 0, sizeof(threadparams));
+
 	for(count = 0; count < argc; count++) {
-#ifndef USE_WAYLAND
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
 		if(strcmp(argv[count], "--connector") == 0)
 			if(count + 1 < argc)
 				CONNECTOR_ID = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--mailbox") == 0)
+			mailbox = 1;
+		if(strcmp(argv[count], "--fences") == 0)
+			explicit_fencing = 1;
+		if(strcmp(argv[count], "--max-in-flight") == 0) {
+			if(count + 1 < argc && parse_surface_values(argv[count+1], &max_in_flight, 0))
+				return -1;
+		}
+		if(strcmp(argv[count], "--buffers") == 0) {
+			if(count + 1 < argc && parse_surface_values(argv[count+1], &max_buffers, 2))
+				return -1;
+		}
 #endif
+#ifndef USE_WAYLAND
+		if(strcmp(argv[count], "--threads") == 0)
+			if(count + 1 < argc)
+				num_threads = atoi(argv[count+1]);
+#endif
+		if(strcmp(argv[count], "--damage") == 0)
+			damage_tracking = 1;
+		if(strcmp(argv[count], "--size") == 0)
+			if(count + 1 < argc)
+				sscanf(argv[count+1], "%dx%d", &frame_w, &frame_h);
+		if(strcmp(argv[count], "--workers") == 0)
+			if(count + 1 < argc)
+				num_workers = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--cubes") == 0)
+			if(count + 1 < argc)
+				num_cubes = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--no-instancing") == 0)
+			no_instancing = 1;
+		if(strcmp(argv[count], "--layout") == 0) {
+			if(count + 1 < argc && (mesh_layout = gl_mesh_parse_layout(argv[count+1])) < 0)
+				return -1;
+		}
+		if(strcmp(argv[count], "--program-cache") == 0)
+			if(count + 1 < argc)
+				program_cache_set_dir(argv[count+1]);
+		if(strcmp(argv[count], "--share-context") == 0)
+			share_contexts = 1;
+		if(strcmp(argv[count], "--serial-init") == 0)
+			serial_init = 1;
+		if(strcmp(argv[count], "--swap-interval") == 0) {
+			if(count + 1 < argc && parse_surface_values(argv[count+1], &swap_intervals, 0))
+				return -1;
+		}
+		if(strcmp(argv[count], "--frame-budget") == 0) {
+#if defined(USE_WAYLAND)
+			/* the compositor shows the whole buffer, nothing scales the drawn part up */
+			printf("--frame-budget is not supported with Wayland\n");
+			return -1;
+#else
+			if(count + 1 < argc)
+				frame_budget_ms = atof(argv[count+1]);
+#endif
+		}
+		if(strcmp(argv[count], "--min-scale") == 0)
+			if(count + 1 < argc)
+				min_scale = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--format") == 0) {
+			if(count + 1 < argc && parse_formats(argv[count+1]))
+				return -1;
+		}
+		if(strcmp(argv[count], "--mesh-repeat") == 0)
+			if(count + 1 < argc)
+				mesh_repeat = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--duration") == 0)
+			if(count + 1 < argc)
+				duration = atoi(argv[count+1]);
+		if(strcmp(argv[count], "--render-sched") == 0) {
+			if(count + 1 >= argc) {
+				print_usage(argv[0]);
+				return -1;
+			}
+			if(thread_sched_parse(argv[count+1], &render_sched))
+				return -1;
+			use_render_sched = 1;
+		}
+		if(strcmp(argv[count], "--compositor-sched") == 0) {
+			if(count + 1 >= argc) {
+				print_usage(argv[0]);
+				return -1;
+			}
+			if(thread_sched_parse(argv[count+1], &compositor_sched))
+				return -1;
+			use_compositor_sched = 1;
+		}
+		if(strcmp(argv[count], "--mlockall") == 0)
+			lock_memory = 1;
+		if(strcmp(argv[count], "--trace") == 0)
+			if(count + 1 < argc)
+				trace_path = argv[count+1];
+		if(strcmp(argv[count], "--matrix-bench") == 0)
+			return matrix_bench(100000) ? -1 : 0;
+		if(strcmp(argv[count], "--stats-interval") == 0)
+			if(count + 1 < argc)
+				stats_interval = atoi(argv[count+1]);
 
 		if (strcmp(argv[count], "--help") == 0)
 			print_usage(argv[0]);
 	}
 	
+	if(num_threads < 1 || num_threads > MAX_NUM_THREADS) {
+		printf("number of threads must be between 1 and %d\n", MAX_NUM_THREADS);
+		return -1;
+	}
+
+	if(trace_path)
+		trace_set_enabled(1);
+
 	srand(time(0));
+	printf("matrix kernel: %s\n", matrix_kernel_get()->name);
 
-#ifndef USE_WAYLAND
-	dev = init_drm_gbm(CONNECTOR_ID);
-#else
+	if(lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+		printf("mlockall failed, continuing without\n");
+
+	/* before any thread starts, see thread_sched.h */
+	thread_sched_track("compositor");
+
+#if defined(USE_WAYLAND)
 	dev = init_wayland_display();
+#elif defined(USE_HEADLESS)
+	dev = init_headless();
+#else
+	dev = init_drm_gbm(CONNECTOR_ID);
 #endif
 	if(!dev) {
 		print_usage(argv[0]);
 		return -1;
 	}
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	if(mailbox)
+		set_latch_mode(dev, LATCH_MAILBOX);
+	if(explicit_fencing && set_explicit_fencing(dev, 1))
+		explicit_fencing = 0;
+#endif
 
+	if(!num_formats)
+		surface_formats[num_formats++] = render_format_parse("xrgb8888");
+
+	/* the damage would have to follow the scale */
+	if(frame_budget_ms > 0 && damage_tracking) {
+		printf("--damage is ignored with --frame-budget\n");
+		damage_tracking = 0;
+	}
 
 	for(count = 0; count < num_threads; count++) {
-#ifndef USE_WAYLAND
+		const struct render_format *format =
+			surface_formats[count < num_formats ? count : num_formats - 1];
+#if defined(USE_WAYLAND)
+		struct wayland_window_data *pdata = get_new_surface(dev, count * frame_w, count * frame_h, frame_w, frame_h);
+#elif defined(USE_HEADLESS)
+		struct headless_surface_data *pdata = get_new_surface(dev, 0, 0, frame_w, frame_h);
+#else
 	/* Ignore overlap issue. 
 	 * We just want to test GBM surface init with double instance and fullscreen.  
 	 * Make sure, It's create more than one gbm surface instance.
 	 */
 		printf("start create gbm surface %d\n", count);
-		struct plane_data *pdata = get_new_surface(dev, 0, 0, FRAME_W, FRAME_H); 	
+		struct plane_data *pdata = get_new_surface(dev, 0, 0, frame_w, frame_h, format->fourcc);
 	/*I always encounter this problem 
 	* The error message is:  Failed to allocate DBM buffer: Cannot allocate memory
 	*/
-#else
-		struct wayland_window_data *pdata = get_new_surface(dev, count * FRAME_W, count * FRAME_H, FRAME_W, FRAME_H);
 #endif
 		if(!pdata) {
 			break;
 		}
-#ifndef USE_WAYLAND
-		threadparams[count].dev = pdata->gbm_dev;
-		threadparams[count].surf = pdata->gbm_surf;
-#else
+#if defined(USE_WAYLAND)
 		threadparams[count].dev = dev->display;
 		threadparams[count].surf = pdata->surf;
+#elif defined(USE_HEADLESS)
+		threadparams[count].dev = NULL;
+		threadparams[count].surf = NULL;
+		threadparams[count].display = dev->display;
+#else
+		threadparams[count].dev = pdata->gbm_dev;
+		threadparams[count].surf = pdata->gbm_surf;
+		pdata->queue = &threadparams[count].queue;
+		threadparams[count].max_frames_in_flight = surface_value(&max_in_flight, count, 0);
+		threadparams[count].max_buffers = surface_value(&max_buffers, count, 0);
+		threadparams[count].use_fences = explicit_fencing;
+		surface_planes[count] = pdata->plane;
+#endif
+		threadparams[count].index = count;
+		if(use_render_sched)
+			threadparams[count].sched = &render_sched;
+		threadparams[count].frame_width = frame_w;
+		threadparams[count].frame_height = frame_h;
+		threadparams[count].format = format;
+		threadparams[count].set_swap_interval = swap_intervals.count > 0;
+		threadparams[count].swap_interval = surface_value(&swap_intervals, count, 1);
+		dynres_init(&threadparams[count].dynres, frame_budget_ms * 1000000, min_scale * 10);
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+		if(frame_budget_ms > 0 && pdata->plane && pdata->caps.can_scale == 0) {
+			printf("plane %d cannot scale, surface %d keeps its resolution\n",
+					pdata->plane, count);
+			dynres_init(&threadparams[count].dynres, 0, 1000);
+		}
 #endif
-		threadparams[count].frame_width = FRAME_W;
-		threadparams[count].frame_height = FRAME_H;
-		threadparams[count].render_priv_setup = setup_kmscube;
-		threadparams[count].render_priv_render = render_kmscube;
+		if(num_cubes) {
+			threadparams[count].depth_size = CUBES_DEPTH_SIZE;
+			threadparams[count].num_objects = num_cubes;
+			threadparams[count].no_instancing = no_instancing;
+			threadparams[count].render_priv_setup = setup_cubes;
+			threadparams[count].render_priv_render = render_cubes;
+			threadparams[count].render_priv_resize = resize_cubes;
+		} else {
+			threadparams[count].mesh_layout = mesh_layout;
+			threadparams[count].mesh_repeat = mesh_repeat;
+			threadparams[count].render_priv_setup = setup_kmscube;
+			threadparams[count].render_priv_render = render_kmscube;
+			threadparams[count].render_priv_resize = resize_kmscube;
+			if(damage_tracking)
+				threadparams[count].render_priv_damage = damage_kmscube;
+		}
 	}
 
 	printf("requested %d instances, rendering %d instances\n", num_threads, count);
@@ -156,45 +599,192 @@ int main(int argc, char **argv)
 	
 
 	/*
-	 * Create the different GBM surfaces and start the draw threads
+	 * Set up EGL and the scene of every surface. The render threads do it
+	 * themselves, all at once, and wait at the start barrier until the
+	 * compositor is ready for their first frame. A pool renders all
+	 * surfaces with the one context of surface 0, which can only be
+	 * current on one thread at a time, so it is set up here one by one.
 	 */
 
+	share.shared = share_contexts || num_workers;
+	parallel_init = !serial_init && !num_workers;
+	if(parallel_init)
+		pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+	setup_start = stats_now_nsec();
+	rss = read_rss_kib();
+
 	for(count = 0; count < num_threads; count++) {
+		unsigned long long t0 = stats_now_nsec();
+		long thread_rss;
+
+		/*
+		 * Pooled surfaces share one share group, see render_pool.h.
+		 * A context only works with surfaces of its own config, so every
+		 * format gets one.
+		 */
+		if(num_workers && count > 0) {
+			int other;
+
+			threadparams[count].share_context = threadparams[0].context;
+			for(other = 0; other < count; other++)
+				if(threadparams[other].format == threadparams[count].format) {
+					threadparams[count].context = threadparams[other].context;
+					break;
+				}
+		} else if(share_contexts && count > 0) {
+			threadparams[count].share_context = threadparams[0].context;
+		}
+		threadparams[count].share = &share;
+
+		/* the others need its context to share with before they start */
+		if(!parallel_init || (share_contexts && count == 0)) {
+			thread_rss = read_rss_kib();
+			int ret = setup_render_thread(&threadparams[count]);
+			if(ret != 0) {
+				printf("render_thread setup failed\n");
+				return -1;
+			}
+			if(!parallel_init)
+				printf("thread %d setup: %.3f ms, RSS %+ld KiB\n", count,
+						(stats_now_nsec() - t0) / 1e6, read_rss_kib() - thread_rss);
+		}
 
-		int ret = setup_render_thread(&threadparams[count]);
-		if(ret != 0) {
-			printf("render_thread setup failed\n");
-			return -1;
+		if(parallel_init) {
+			threadparams[count].start_barrier = &start_barrier;
+			if(start_render_thread(&threadparams[count]) == (pthread_t)-1) {
+				printf("render thread %d start failed\n", count);
+				return -1;
+			}
+		}
+	}
+
+	if(parallel_init) {
+		pthread_barrier_wait(&start_barrier);
+		for(count = 0; count < num_threads; count++) {
+			if(threadparams[count].setup_result) {
+				printf("render_thread setup failed\n");
+				return -1;
+			}
+			printf("thread %d setup: %.3f ms\n", count, threadparams[count].setup_nsec / 1e6);
 		}
 	}
+	printf("setup of %d surfaces: %.3f ms, RSS %+ld KiB\n", num_threads,
+			(stats_now_nsec() - setup_start) / 1e6, read_rss_kib() - rss);
 
 	for(count = 0; count < num_threads; count++) {
-		start_render_thread(&threadparams[count]);
+		stats_register(&threadparams[count].render_time, 0, "thread %d render", count);
+		stats_register(&threadparams[count].swap_time, 0, "thread %d swap", count);
+		stats_register(&threadparams[count].wait_time, 0, "thread %d wait", count);
+		if(threadparams[count].render_priv_damage && !threadparams[count].dynres.budget_nsec)
+			stats_register(&threadparams[count].damage_ratio, STATS_PERMILLE,
+					"thread %d damage", count);
+		if(threadparams[count].dynres.budget_nsec)
+			stats_register(&threadparams[count].render_scale, STATS_PERMILLE,
+					"thread %d scale", count);
 	}
 
+#if defined(USE_WAYLAND)
+	print_footprint(threadparams, num_threads, 60, NULL);
+#elif defined(USE_HEADLESS)
+	print_footprint(threadparams, num_threads,
+			(1000000 + dev->period_usec / 2) / dev->period_usec, NULL);
+#else
+	print_footprint(threadparams, num_threads, get_refresh_rate(dev), surface_planes);
+#endif
 
-#ifndef USE_WAYLAND
-	starttime = __gettime();
+	/* what every surface after the first saves by sharing */
+	printf("GL objects: %zu KiB created, %zu KiB reused from the share group",
+			share.created_bytes / 1024, share.reused_bytes / 1024);
+	if(num_threads > 1)
+		printf(" (%zu KiB per surface)", share.reused_bytes / 1024 / (num_threads - 1));
+	printf("\n");
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	/*
+	 * The compositor sleeps until the DRM fd has a flip event, a commit's
+	 * out-fence has signalled, a render thread has swapped a new frame,
+	 * or it is time to print the stats.
+	 */
+	loop = event_loop_create();
+	if(!loop)
+		return -1;
+
+	if(event_loop_add_fd(loop, get_drm_fd(dev), drm_event_cb, dev))
+		return -1;
+	set_event_loop(dev, loop);
+	for(count = 0; count < num_threads; count++)
+		if(event_loop_add_fd(loop, threadparams[count].queue.event_fd, frame_ready_cb, dev))
+			return -1;
+	if(stats_interval > 0 && event_loop_add_timer(loop, stats_interval * 1000, stats_cb, NULL))
+		return -1;
+	if(duration > 0 && event_loop_add_timer(loop, duration * 1000, duration_cb, NULL))
+		return -1;
 #endif
 
-	while(1) {
+	if(num_workers) {
+		pool = render_pool_create(threadparams, num_threads, num_workers,
+				use_render_sched ? &render_sched : NULL);
+		if(!pool || render_pool_start(pool))
+			return -1;
+		printf("rendering %d instances with %d workers\n", num_threads, num_workers);
+	} else if(parallel_init) {
+		/* the render threads are set up already, let them draw */
+		pthread_barrier_wait(&start_barrier);
+	} else {
+		for(count = 0; count < num_threads; count++) {
+			start_render_thread(&threadparams[count]);
+		}
+	}
+
+	/* only now, so the render threads do not inherit it */
+	if(use_compositor_sched)
+		thread_sched_apply(&compositor_sched, 0);
+
+	signal(SIGINT, quit_handler);
+	signal(SIGTERM, quit_handler);
+	if(trace_path)
+		signal(SIGUSR1, trace_handler);
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	while(!quit) {
+		event_loop_dispatch(loop, -1);
+		handle_trace_toggle();
+	}
+#else
+	last_dump = stats_now_nsec();
+	start = last_dump;
+
+	while(!quit) {
 
 		update_all_surfaces(dev);
 
-#ifndef USE_WAYLAND
-		unsigned long long __time;
-		frame_num++;
-		if(frame_num == 60) {
-			__time = __gettime();
-			fps = (60.0 * 1000000000) / (__time - starttime);
-			frame_num = 0;
-			starttime = __time;
-			printf("FPS = %f\n", fps);
-		
+		/* there is no flip, the first frame of every surface will do */
+		for(count = 0; count < num_threads; count++)
+			if(!__atomic_load_n(&threadparams[count].queue.produced, __ATOMIC_ACQUIRE))
+				break;
+		if(count == num_threads)
+			startup_done("first frame");
+
+		unsigned long long now = stats_now_nsec();
+		if(stats_interval > 0 && now - last_dump >= stats_interval * 1000000000ULL) {
+			stats_cb(-1, NULL);
+			last_dump = now;
 		}
+		if(duration > 0 && now - start >= duration * 1000000000ULL)
+			duration_cb(-1, NULL);
+		handle_trace_toggle();
+
+	}
 #endif
 
+	stats_dump(1);
+
+	if(trace_path && __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED)) {
+		trace_set_enabled(0);
+		trace_write(trace_path);
 	}
 
+	return 0;
 }
 
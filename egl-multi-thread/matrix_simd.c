@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "matrix_simd.h"
+#include "stats.h"
+
+/*
+ * Every kernel sums a[i][0]*b[0] + a[i][1]*b[1] + a[i][2]*b[2] + a[i][3]*b[3]
+ * in that order with separate multiplies and adds, like the scalar code,
+ * so they only differ from it where the compiler contracts to FMA.
+ */
+
+static int always (void)
+{
+	return 1;
+}
+
+static void multiply_scalar (ESMatrix *result, const ESMatrix *a, const ESMatrix *b)
+{
+	ESMatrix tmp;
+	int i;
+
+	for(i = 0; i < 4; i++) {
+		tmp.m[i][0] = (a->m[i][0] * b->m[0][0]) + (a->m[i][1] * b->m[1][0]) +
+			(a->m[i][2] * b->m[2][0]) + (a->m[i][3] * b->m[3][0]);
+		tmp.m[i][1] = (a->m[i][0] * b->m[0][1]) + (a->m[i][1] * b->m[1][1]) +
+			(a->m[i][2] * b->m[2][1]) + (a->m[i][3] * b->m[3][1]);
+		tmp.m[i][2] = (a->m[i][0] * b->m[0][2]) + (a->m[i][1] * b->m[1][2]) +
+			(a->m[i][2] * b->m[2][2]) + (a->m[i][3] * b->m[3][2]);
+		tmp.m[i][3] = (a->m[i][0] * b->m[0][3]) + (a->m[i][1] * b->m[1][3]) +
+			(a->m[i][2] * b->m[2][3]) + (a->m[i][3] * b->m[3][3]);
+	}
+	memcpy(result, &tmp, sizeof(ESMatrix));
+}
+
+static void multiply_batch_scalar (ESMatrix *results, const ESMatrix *a, const ESMatrix *b, int count)
+{
+	int n;
+
+	for(n = 0; n < count; n++)
+		multiply_scalar(&results[n], &a[n], b);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+static inline __m128 row_sse (const GLfloat *a, __m128 b0, __m128 b1, __m128 b2, __m128 b3)
+{
+	__m128 r = _mm_mul_ps(_mm_set1_ps(a[0]), b0);
+
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[1]), b1));
+	r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[2]), b2));
+	return _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[3]), b3));
+}
+
+static void multiply_batch_sse (ESMatrix *results, const ESMatrix *a, const ESMatrix *b, int count)
+{
+	__m128 b0 = _mm_loadu_ps(b->m[0]);
+	__m128 b1 = _mm_loadu_ps(b->m[1]);
+	__m128 b2 = _mm_loadu_ps(b->m[2]);
+	__m128 b3 = _mm_loadu_ps(b->m[3]);
+	int n;
+
+	for(n = 0; n < count; n++) {
+		__m128 r0 = row_sse(a[n].m[0], b0, b1, b2, b3);
+		__m128 r1 = row_sse(a[n].m[1], b0, b1, b2, b3);
+		__m128 r2 = row_sse(a[n].m[2], b0, b1, b2, b3);
+		__m128 r3 = row_sse(a[n].m[3], b0, b1, b2, b3);
+
+		_mm_storeu_ps(results[n].m[0], r0);
+		_mm_storeu_ps(results[n].m[1], r1);
+		_mm_storeu_ps(results[n].m[2], r2);
+		_mm_storeu_ps(results[n].m[3], r3);
+	}
+}
+
+/* all of a and b are loaded before anything is stored, so in place works */
+static void multiply_sse (ESMatrix *result, const ESMatrix *a, const ESMatrix *b)
+{
+	multiply_batch_sse(result, a, b, 1);
+}
+
+static int sse_supported (void)
+{
+	return __builtin_cpu_supports("sse");
+}
+
+/* two rows per register, the lanes do not mix so permute_ps splats per row */
+__attribute__((target("avx")))
+static inline __m256 rows_avx (const GLfloat *a, __m256 b0, __m256 b1, __m256 b2, __m256 b3)
+{
+	__m256 rows = _mm256_loadu_ps(a);
+	__m256 r = _mm256_mul_ps(_mm256_permute_ps(rows, 0x00), b0);
+
+	r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(rows, 0x55), b1));
+	r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(rows, 0xaa), b2));
+	return _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(rows, 0xff), b3));
+}
+
+__attribute__((target("avx")))
+static inline __m256 dup_row_avx (const GLfloat *row)
+{
+	__m128 r = _mm_loadu_ps(row);
+
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(r), r, 1);
+}
+
+__attribute__((target("avx")))
+static void multiply_batch_avx (ESMatrix *results, const ESMatrix *a, const ESMatrix *b, int count)
+{
+	__m256 b0 = dup_row_avx(b->m[0]);
+	__m256 b1 = dup_row_avx(b->m[1]);
+	__m256 b2 = dup_row_avx(b->m[2]);
+	__m256 b3 = dup_row_avx(b->m[3]);
+	int n;
+
+	for(n = 0; n < count; n++) {
+		__m256 r01 = rows_avx(a[n].m[0], b0, b1, b2, b3);
+		__m256 r23 = rows_avx(a[n].m[2], b0, b1, b2, b3);
+
+		_mm256_storeu_ps(results[n].m[0], r01);
+		_mm256_storeu_ps(results[n].m[2], r23);
+	}
+}
+
+__attribute__((target("avx")))
+static void multiply_avx (ESMatrix *result, const ESMatrix *a, const ESMatrix *b)
+{
+	multiply_batch_avx(result, a, b, 1);
+}
+
+static int avx_supported (void)
+{
+	return __builtin_cpu_supports("avx");
+}
+
+#elif defined(__ARM_NEON)
+
+static inline float32x4_t row_neon (const GLfloat *a, float32x4_t b0, float32x4_t b1,
+		float32x4_t b2, float32x4_t b3)
+{
+	float32x4_t r = vmulq_n_f32(b0, a[0]);
+
+	r = vaddq_f32(r, vmulq_n_f32(b1, a[1]));
+	r = vaddq_f32(r, vmulq_n_f32(b2, a[2]));
+	return vaddq_f32(r, vmulq_n_f32(b3, a[3]));
+}
+
+static void multiply_batch_neon (ESMatrix *results, const ESMatrix *a, const ESMatrix *b, int count)
+{
+	float32x4_t b0 = vld1q_f32(b->m[0]);
+	float32x4_t b1 = vld1q_f32(b->m[1]);
+	float32x4_t b2 = vld1q_f32(b->m[2]);
+	float32x4_t b3 = vld1q_f32(b->m[3]);
+	int n;
+
+	for(n = 0; n < count; n++) {
+		float32x4_t r0 = row_neon(a[n].m[0], b0, b1, b2, b3);
+		float32x4_t r1 = row_neon(a[n].m[1], b0, b1, b2, b3);
+		float32x4_t r2 = row_neon(a[n].m[2], b0, b1, b2, b3);
+		float32x4_t r3 = row_neon(a[n].m[3], b0, b1, b2, b3);
+
+		vst1q_f32(results[n].m[0], r0);
+		vst1q_f32(results[n].m[1], r1);
+		vst1q_f32(results[n].m[2], r2);
+		vst1q_f32(results[n].m[3], r3);
+	}
+}
+
+static void multiply_neon (ESMatrix *result, const ESMatrix *a, const ESMatrix *b)
+{
+	multiply_batch_neon(result, a, b, 1);
+}
+
+#endif
+
+/* slowest first, matrix_kernel_get takes the last supported one */
+static const struct matrix_kernel kernels[] = {
+	{ "scalar", always, multiply_scalar, multiply_batch_scalar },
+#ifdef HAVE_X86_KERNELS
+	{ "sse", sse_supported, multiply_sse, multiply_batch_sse },
+	{ "avx", avx_supported, multiply_avx, multiply_batch_avx },
+#elif defined(__ARM_NEON)
+	{ "neon", always, multiply_neon, multiply_batch_neon },
+#endif
+};
+
+#define NUM_KERNELS ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+static const struct matrix_kernel *selected;
+
+static const struct matrix_kernel *matrix_kernel_select (void)
+{
+	const char *name = getenv("ES_MATRIX_KERNEL");
+	int count;
+
+	if(name) {
+		for(count = 0; count < NUM_KERNELS; count++)
+			if(strcmp(kernels[count].name, name) == 0 && kernels[count].supported())
+				return &kernels[count];
+		printf("matrix kernel '%s' is not available\n", name);
+	}
+
+	for(count = NUM_KERNELS - 1; count > 0; count--)
+		if(kernels[count].supported())
+			break;
+
+	return &kernels[count];
+}
+
+const struct matrix_kernel *matrix_kernel_get (void)
+{
+	const struct matrix_kernel *kernel = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+
+	/* racing threads pick the same one */
+	if(!kernel) {
+		kernel = matrix_kernel_select();
+		__atomic_store_n(&selected, kernel, __ATOMIC_RELEASE);
+	}
+
+	return kernel;
+}
+
+const struct matrix_kernel *matrix_kernel_list (int *count)
+{
+	*count = NUM_KERNELS;
+	return kernels;
+}
+
+#define BENCH_MATRICES (64)
+#define MAX_ERROR (4.0)	/* in FLT_EPSILON of the sum of the term magnitudes */
+
+static void random_matrix (ESMatrix *m)
+{
+	int i, j;
+
+	for(i = 0; i < 4; i++)
+		for(j = 0; j < 4; j++)
+			m->m[i][j] = (rand() / (float)RAND_MAX - 0.5f) * 20.0f;
+}
+
+/*
+ * Error of r against the scalar result, relative to the rounding error
+ * the sums may have: one FLT_EPSILON of sum |a[i][k] * b[k][j]|.
+ */
+static double matrix_error (const ESMatrix *r, const ESMatrix *ref, const ESMatrix *a, const ESMatrix *b)
+{
+	double worst = 0.0;
+	int i, j, k;
+
+	for(i = 0; i < 4; i++) {
+		for(j = 0; j < 4; j++) {
+			double scale = 0.0, error;
+
+			for(k = 0; k < 4; k++)
+				scale += fabs((double)a->m[i][k] * b->m[k][j]);
+			error = fabs((double)r->m[i][j] - ref->m[i][j]) / (scale * FLT_EPSILON + FLT_MIN);
+			if(error > worst)
+				worst = error;
+		}
+	}
+
+	return worst;
+}
+
+int matrix_bench (int iterations)
+{
+	static ESMatrix a[BENCH_MATRICES], results[BENCH_MATRICES], ref[BENCH_MATRICES];
+	ESMatrix b;
+	int count, n, it, ret = 0;
+	double scalar_ns = 0.0;
+
+	srand(1);
+	for(n = 0; n < BENCH_MATRICES; n++)
+		random_matrix(&a[n]);
+	random_matrix(&b);
+	for(n = 0; n < BENCH_MATRICES; n++)
+		multiply_scalar(&ref[n], &a[n], &b);
+
+	printf("matrix kernel in use: %s\n", matrix_kernel_get()->name);
+	printf("%-8s %10s %14s %14s %8s\n", "kernel", "max error", "single ns", "batch ns/mat", "speedup");
+
+	for(count = 0; count < NUM_KERNELS; count++) {
+		const struct matrix_kernel *kernel = &kernels[count];
+		unsigned long long t0;
+		double error = 0.0, single_ns, batch_ns;
+		volatile GLfloat sink;
+
+		if(!kernel->supported()) {
+			printf("%-8s not supported by this CPU\n", kernel->name);
+			continue;
+		}
+
+		for(n = 0; n < BENCH_MATRICES; n++) {
+			double e;
+
+			kernel->multiply(&results[n], &a[n], &b);
+			e = matrix_error(&results[n], &ref[n], &a[n], &b);
+			if(e > error)
+				error = e;
+		}
+		kernel->multiply_batch(results, a, &b, BENCH_MATRICES);
+		for(n = 0; n < BENCH_MATRICES; n++) {
+			double e = matrix_error(&results[n], &ref[n], &a[n], &b);
+			if(e > error)
+				error = e;
+		}
+
+		t0 = stats_now_nsec();
+		for(it = 0; it < iterations; it++)
+			for(n = 0; n < BENCH_MATRICES; n++)
+				kernel->multiply(&results[n], &a[n], &b);
+		single_ns = (stats_now_nsec() - t0) / ((double)iterations * BENCH_MATRICES);
+		sink = results[BENCH_MATRICES - 1].m[3][3];
+
+		t0 = stats_now_nsec();
+		for(it = 0; it < iterations; it++)
+			kernel->multiply_batch(results, a, &b, BENCH_MATRICES);
+		batch_ns = (stats_now_nsec() - t0) / ((double)iterations * BENCH_MATRICES);
+		sink = results[BENCH_MATRICES - 1].m[3][3];
+		(void)sink;
+
+		if(count == 0)
+			scalar_ns = single_ns;
+
+		printf("%-8s %10.2f %14.2f %14.2f %7.2fx%s\n", kernel->name, error, single_ns, batch_ns,
+				scalar_ns / batch_ns, error > MAX_ERROR ? "  MISMATCH" : "");
+		if(error > MAX_ERROR)
+			ret = -1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef __MATRIX_SIMD_H__
+#define __MATRIX_SIMD_H__
+
+#include "esUtil.h"
+
+/*
+ * Implementations of the 4x4 matrix product behind esMatrixMultiply and
+ * esMatrixMultiplyBatch. result = a * b in the row order of ESMatrix.
+ * The single product may be done in place, the batch must not have b in
+ * its results.
+ */
+struct matrix_kernel {
+	const char *name;
+	int (*supported) (void);
+	void (*multiply) (ESMatrix *result, const ESMatrix *a, const ESMatrix *b);
+	void (*multiply_batch) (ESMatrix *results, const ESMatrix *a, const ESMatrix *b, int count);
+};
+
+/*
+ * The fastest kernel this CPU runs, NEON is picked at compile time and
+ * SSE/AVX at runtime. ES_MATRIX_KERNEL=<name> in the environment forces
+ * one, for comparisons.
+ */
+const struct matrix_kernel *matrix_kernel_get (void);
+
+/* all kernels built in, the first one is the scalar reference */
+const struct matrix_kernel *matrix_kernel_list (int *count);
+
+/*
+ * Check every supported kernel against the scalar one on random matrices
+ * and time single and batched products. Returns -1 if one of them is
+ * further off than a few ulps.
+ */
+int matrix_bench (int iterations);
+
+#endif /*__MATRIX_SIMD_H__*/
@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <EGL/egl.h>
+#include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
+
+#include "program_cache.h"
+#include "stats.h"
+#include "startup.h"
+
+#define CACHE_MAGIC (0x43475250)	/* "PRGC" */
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+};
+
+static const char *cache_dir;
+
+static int hits, misses, rejected;
+
+static void program_cache_dump (int total)
+{
+	/* the counts only ever grow, every dump shows the totals */
+	printf("  %-24s hits=%d misses=%d rejected=%d\n", "program cache",
+			__atomic_load_n(&hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&misses, __ATOMIC_RELAXED),
+			__atomic_load_n(&rejected, __ATOMIC_RELAXED));
+}
+
+void program_cache_set_dir (const char *dir)
+{
+	cache_dir = dir;
+	if(dir)
+		stats_register_dump(program_cache_dump);
+}
+
+static uint64_t fnv1a (uint64_t hash, const char *str)
+{
+	/* including the terminating 0, so "ab" "c" and "a" "bc" differ */
+	do {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ULL;
+	} while(*str++);
+
+	return hash;
+}
+
+static uint64_t program_key (const char *vertex_source, const char *fragment_source,
+		const char *const *attribs)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	hash = fnv1a(hash, vertex_source);
+	hash = fnv1a(hash, fragment_source);
+	for(; *attribs; attribs++)
+		hash = fnv1a(hash, *attribs);
+	hash = fnv1a(hash, (const char *)glGetString(GL_RENDERER));
+	hash = fnv1a(hash, (const char *)glGetString(GL_VERSION));
+
+	return hash;
+}
+
+static GLuint compile_shader (const char *name, GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	GLint ret;
+
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &ret);
+	if (!ret) {
+		char log[512];
+
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("%s : %s shader compilation failed: %s\n", name,
+				type == GL_VERTEX_SHADER ? "vertex" : "fragment", log);
+		glDeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+static GLuint compile_program (const char *name, const char *vertex_source,
+		const char *fragment_source, const char *const *attribs)
+{
+	GLuint program, vs, fs;
+	GLint ret, count;
+
+	vs = compile_shader(name, GL_VERTEX_SHADER, vertex_source);
+	fs = compile_shader(name, GL_FRAGMENT_SHADER, fragment_source);
+	if(!vs || !fs)
+		return 0;
+
+	program = glCreateProgram();
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	for(count = 0; attribs[count]; count++)
+		glBindAttribLocation(program, count, attribs[count]);
+	glLinkProgram(program);
+
+	/* the program keeps them until it is deleted */
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	glGetProgramiv(program, GL_LINK_STATUS, &ret);
+	if (!ret) {
+		char log[512];
+
+		glGetProgramInfoLog(program, sizeof(log), NULL, log);
+		printf("%s : program linking failed: %s\n", name, log);
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	return program;
+}
+
+static GLuint load_binary (const char *path, PFNGLPROGRAMBINARYOESPROC program_binary)
+{
+	struct cache_header header;
+	GLuint program = 0;
+	GLint ret;
+	void *data = NULL;
+	FILE *f = fopen(path, "rb");
+
+	if(!f)
+		return 0;
+
+	if(fread(&header, sizeof(header), 1, f) != 1 || header.magic != CACHE_MAGIC)
+		goto out;
+	data = malloc(header.length);
+	if(!data || fread(data, 1, header.length, f) != header.length)
+		goto out;
+
+	program = glCreateProgram();
+	program_binary(program, header.format, data, header.length);
+	glGetProgramiv(program, GL_LINK_STATUS, &ret);
+	if(!ret) {
+		/* a driver update or a different GPU, it is compiled again */
+		glDeleteProgram(program);
+		program = 0;
+		__atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+	}
+
+out:
+	free(data);
+	fclose(f);
+	return program;
+}
+
+/* written under a temporary name and renamed, other threads may read it */
+static void store_binary (const char *path, GLuint program, PFNGLGETPROGRAMBINARYOESPROC get_binary)
+{
+	struct cache_header header = { .magic = CACHE_MAGIC };
+	char tmp[512];
+	GLint length = 0;
+	GLenum format;
+	void *data;
+	FILE *f;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if(length <= 0)
+		return;
+
+	data = malloc(length);
+	if(!data)
+		return;
+	get_binary(program, length, &length, &format, data);
+	header.format = format;
+	header.length = length;
+
+	snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)syscall(SYS_gettid));
+	f = fopen(tmp, "wb");
+	if(!f) {
+		printf("program cache: cannot write %s\n", tmp);
+		free(data);
+		return;
+	}
+	if(fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(data, 1, length, f) == (size_t)length) {
+		fclose(f);
+		rename(tmp, path);
+	} else {
+		fclose(f);
+		unlink(tmp);
+	}
+
+	free(data);
+}
+
+GLuint program_cache_create (const char *name, const char *vertex_source,
+		const char *fragment_source, const char *const *attribs)
+{
+	PFNGLGETPROGRAMBINARYOESPROC get_binary = NULL;
+	PFNGLPROGRAMBINARYOESPROC program_binary = NULL;
+	unsigned long long t0 = stats_now_nsec();
+	const char *extensions;
+	const char *result = "compiled";
+	char path[512];
+	GLint formats = 0;
+	GLuint program = 0;
+
+	extensions = (const char *)glGetString(GL_EXTENSIONS);
+	if(cache_dir && extensions && strstr(extensions, "GL_OES_get_program_binary")) {
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+		get_binary = (PFNGLGETPROGRAMBINARYOESPROC)eglGetProcAddress("glGetProgramBinaryOES");
+		program_binary = (PFNGLPROGRAMBINARYOESPROC)eglGetProcAddress("glProgramBinaryOES");
+	}
+
+	/* a driver may have the extension without any format to save */
+	if(formats > 0 && get_binary && program_binary) {
+		snprintf(path, sizeof(path), "%s/%016llx.bin", cache_dir,
+				(unsigned long long)program_key(vertex_source, fragment_source, attribs));
+
+		program = load_binary(path, program_binary);
+		if(program) {
+			result = "cache hit";
+			__atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+		} else {
+			program = compile_program(name, vertex_source, fragment_source, attribs);
+			if(program) {
+				store_binary(path, program, get_binary);
+				result = "cache miss";
+				__atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+			}
+		}
+	} else {
+		program = compile_program(name, vertex_source, fragment_source, attribs);
+	}
+
+	if(program) {
+		startup_record(STARTUP_SHADERS, t0);
+		printf("%s : program %s in %.3f ms\n", name, result, (stats_now_nsec() - t0) / 1e6);
+	}
+
+	return program;
+}
+
+size_t program_cache_binary_size (GLuint program)
+{
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	GLint length = 0;
+
+	if(extensions && strstr(extensions, "GL_OES_get_program_binary"))
+		glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+
+	return length > 0 ? length : 0;
+}
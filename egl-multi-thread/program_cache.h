@@ -0,0 +1,28 @@
+#ifndef __PROGRAM_CACHE_H__
+#define __PROGRAM_CACHE_H__
+
+#include <stddef.h>
+#include <GLES2/gl2.h>
+
+/*
+ * Directory of the GL_OES_get_program_binary cache, NULL (the default)
+ * always compiles. Set it before any program is created.
+ */
+void program_cache_set_dir (const char *dir);
+
+/*
+ * Linked program from the two shaders, with attribs[i] bound to location
+ * i (a NULL terminated list). Loaded from the cache when the sources, the
+ * attributes, GL_RENDERER and GL_VERSION all match, compiled and stored
+ * otherwise or when the driver rejects the binary. Prints what happened
+ * and how long it took, and adds it to the hit/miss counts of the stats.
+ * Returns 0 on failure.
+ * NOTE: Must be called with a current context.
+ */
+GLuint program_cache_create (const char *name, const char *vertex_source,
+		const char *fragment_source, const char *const *attribs);
+
+/* size of the program binary, 0 if the driver cannot tell */
+size_t program_cache_binary_size (GLuint program);
+
+#endif /*__PROGRAM_CACHE_H__*/
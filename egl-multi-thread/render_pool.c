@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <EGL/egl.h>
+
+#include "render_pool.h"
+
+#define DEQUE_MASK (RENDER_POOL_MAX_JOBS - 1)
+
+/*
+ * Only the owner pushes, anyone (the owner included) takes from the top.
+ * A pool never has more jobs than a deque has slots, so a slot is never
+ * reused while a thief may still read it.
+ */
+static void deque_push (struct job_deque *d, struct render_thread_param *job)
+{
+	long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&d->jobs[b & DEQUE_MASK], job, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+static struct render_thread_param *deque_take (struct job_deque *d)
+{
+	struct render_thread_param *job;
+	long t, b;
+
+	while(1) {
+		t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+		if(t >= b)
+			return NULL;
+
+		job = __atomic_load_n(&d->jobs[t & DEQUE_MASK], __ATOMIC_RELAXED);
+		if(__atomic_compare_exchange_n(&d->top, &t, t + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			return job;
+	}
+}
+
+static long deque_size (struct job_deque *d)
+{
+	return __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * A worker with a single job takes it right back after every frame, so
+ * only a worker with a backlog has something worth stealing.
+ */
+static struct render_thread_param *steal (struct render_pool *pool, struct render_worker *worker)
+{
+	struct render_thread_param *job;
+	int count;
+
+	for(count = 1; count < pool->count_workers; count++) {
+		struct render_worker *victim =
+			&pool->workers[(worker->index + count) % pool->count_workers];
+
+		if(deque_size(&victim->deque) < 2)
+			continue;
+		job = deque_take(&victim->deque);
+		if(job)
+			return job;
+	}
+
+	return NULL;
+}
+
+static int has_backlog (struct render_pool *pool)
+{
+	int count;
+
+	for(count = 0; count < pool->count_workers; count++)
+		if(deque_size(&pool->workers[count].deque) >= 2)
+			return 1;
+
+	return 0;
+}
+
+/* called by the compositor through frame_queue_signal */
+static void pool_wake (void *data)
+{
+	struct render_pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void park (struct render_pool *pool, struct render_thread_param *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->parked[pool->count_parked] = job;
+	__atomic_store_n(&pool->count_parked, pool->count_parked + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* move the parked jobs that may render now to the worker, pool->lock held */
+static int unpark_locked (struct render_pool *pool, struct render_worker *worker)
+{
+	int count = 0, moved = 0;
+
+	while(count < pool->count_parked) {
+		struct render_thread_param *job = pool->parked[count];
+
+		if(!render_thread_can_render(job)) {
+			count++;
+			continue;
+		}
+
+		deque_push(&worker->deque, job);
+		pool->parked[count] = pool->parked[pool->count_parked - 1];
+		__atomic_store_n(&pool->count_parked, pool->count_parked - 1, __ATOMIC_RELEASE);
+		moved++;
+	}
+
+	return moved;
+}
+
+static void unpark (struct render_pool *pool, struct render_worker *worker)
+{
+	if(pthread_mutex_trylock(&pool->lock))
+		return;
+	unpark_locked(pool, worker);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_sleep (struct render_pool *pool, struct render_worker *worker)
+{
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+	while(!unpark_locked(pool, worker) && !has_backlog(pool))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void worker_push (struct render_pool *pool, struct render_worker *worker,
+		struct render_thread_param *job)
+{
+	deque_push(&worker->deque, job);
+
+	/* pairs with the sleeping count and backlog check in pool_sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) &&
+			deque_size(&worker->deque) >= 2) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* a surface can only be current in one thread, let go of it before it is stolen */
+static void worker_release (struct render_worker *worker)
+{
+	if(!worker->current)
+		return;
+
+	eglMakeCurrent(worker->current->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	worker->current = NULL;
+}
+
+static int pool_config (struct render_pool *pool, EGLConfig config)
+{
+	int count;
+
+	for(count = 0; count < pool->count_configs; count++)
+		if(pool->configs[count] == config)
+			return count;
+
+	return -1;
+}
+
+/*
+ * Returns 1 while the worker the job was stolen from still has it current,
+ * -1 if the surface cannot be made current at all.
+ */
+static int worker_switch (struct render_worker *worker, struct render_thread_param *job)
+{
+	unsigned long long t0;
+	EGLint error;
+
+	if(worker->current == job)
+		return 0;
+
+	t0 = stats_now_nsec();
+	if(!eglMakeCurrent(job->display, job->surface, job->surface,
+				worker->contexts[pool_config(worker->pool, job->config)])) {
+		error = eglGetError();
+		if(error == EGL_BAD_ACCESS)
+			return 1;
+		printf("worker %d: eglMakeCurrent failed for surface %d: 0x%x\n",
+				worker->index, job->index, error);
+		return -1;
+	}
+	stats_record(&worker->make_current, stats_now_nsec() - t0);
+
+	worker->current = job;
+
+	return 0;
+}
+
+static void *render_worker (void *arg)
+{
+	struct render_worker *worker = arg;
+	struct render_pool *pool = worker->pool;
+	struct render_thread_param *job;
+
+	if(pool->sched)
+		thread_sched_apply(pool->sched, worker->index);
+	thread_sched_track("worker %d", worker->index);
+
+	while(1) {
+		if(__atomic_load_n(&pool->count_parked, __ATOMIC_ACQUIRE))
+			unpark(pool, worker);
+
+		job = deque_take(&worker->deque);
+		if(!job) {
+			worker_release(worker);
+			job = steal(pool, worker);
+		}
+		if(!job) {
+			pool_sleep(pool, worker);
+			continue;
+		}
+
+		if(!render_thread_can_render(job)) {
+			park(pool, job);
+			continue;
+		}
+
+		switch(worker_switch(worker, job)) {
+		case 1:
+			deque_push(&worker->deque, job);
+			sched_yield();
+			continue;
+		case -1:
+			/* reported, the surface stops updating */
+			continue;
+		}
+
+		render_thread_frame(job);
+
+		worker_push(pool, worker, job);
+	}
+
+	return NULL;
+}
+
+struct render_pool *render_pool_create (struct render_thread_param *prms, int count_prms,
+		int count_workers, struct thread_sched *sched)
+{
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	int count;
+
+	if(count_workers < 1 || count_workers > RENDER_POOL_MAX_WORKERS) {
+		printf("number of workers must be between 1 and %d\n", RENDER_POOL_MAX_WORKERS);
+		return NULL;
+	}
+	if(count_prms > RENDER_POOL_MAX_JOBS) {
+		printf("render pool: too many surfaces\n");
+		return NULL;
+	}
+
+	struct render_pool *pool = calloc(sizeof(struct render_pool), 1);
+	if(!pool) {
+		printf("render pool alloc failed\n");
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->count_workers = count_workers;
+	pool->sched = sched;
+
+	for(count = 0; count < count_prms; count++) {
+		if(pool_config(pool, prms[count].config) >= 0)
+			continue;
+		if(pool->count_configs == RENDER_POOL_MAX_CONFIGS) {
+			printf("render pool: too many EGL configs\n");
+			return NULL;
+		}
+		pool->configs[pool->count_configs++] = prms[count].config;
+	}
+
+	for(count = 0; count < count_workers; count++) {
+		struct render_worker *worker = &pool->workers[count];
+		int config;
+
+		worker->pool = pool;
+		worker->index = count;
+		for(config = 0; config < pool->count_configs; config++) {
+			worker->contexts[config] = eglCreateContext(prms[0].display,
+					pool->configs[config], prms[0].context, context_attribs);
+			if(worker->contexts[config] == EGL_NO_CONTEXT) {
+				printf("render pool: failed to create context\n");
+				return NULL;
+			}
+		}
+
+		stats_register(&worker->make_current, 0, "worker %d make-current", count);
+	}
+
+	for(count = 0; count < count_prms; count++) {
+		prms[count].queue.notify = pool_wake;
+		prms[count].queue.notify_data = pool;
+		deque_push(&pool->workers[count % count_workers].deque, &prms[count]);
+	}
+
+	return pool;
+}
+
+int render_pool_start (struct render_pool *pool)
+{
+	int count;
+
+	for(count = 0; count < pool->count_workers; count++) {
+		if(pthread_create(&pool->workers[count].thread, NULL, render_worker,
+					&pool->workers[count])) {
+			printf("render pool: failed to start worker %d\n", count);
+			return -1;
+		}
+	}
+
+	return 0;
+}
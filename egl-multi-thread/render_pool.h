@@ -0,0 +1,75 @@
+#ifndef __RENDER_POOL_H__
+#define __RENDER_POOL_H__
+
+#include <pthread.h>
+
+#include "render_thread.h"
+#include "stats.h"
+#include "thread_sched.h"
+
+#define RENDER_POOL_MAX_WORKERS (16)
+#define RENDER_POOL_MAX_JOBS (64)	/* a power of two */
+#define RENDER_POOL_MAX_CONFIGS (4)
+
+/* jobs of one worker, pushed at the bottom by the owner, taken from the top */
+struct job_deque {
+	long top;
+	long bottom;
+	struct render_thread_param *jobs[RENDER_POOL_MAX_JOBS];
+};
+
+struct render_pool;
+
+struct render_worker {
+	struct render_pool *pool;
+	int index;
+	pthread_t thread;
+	EGLContext contexts[RENDER_POOL_MAX_CONFIGS];	/* one per pool config */
+
+	struct job_deque deque;
+
+	/* surface whose context state is current on this worker, or NULL */
+	struct render_thread_param *current;
+
+	/* written by this worker only */
+	struct stats_hist make_current;
+};
+
+/*
+ * A fixed number of worker threads, each with its own contexts in the
+ * share group of the surfaces, that render frames of any surface. A
+ * worker has a context for every EGL config the surfaces use, since a
+ * context can only be made current with surfaces of its own config.
+ *
+ * Every surface is one job. A worker runs the job at the top of its own
+ * deque, pushes it back at the bottom and takes the next one, so its
+ * surfaces take turns. A worker with an empty deque steals from the
+ * others. A job that may not render yet (back-pressure) is parked until
+ * its frame queue is signalled. eglMakeCurrent is only called when a
+ * worker switches surfaces.
+ */
+struct render_pool {
+	int count_workers;
+	struct thread_sched *sched;	/* of every worker, or NULL */
+
+	int count_configs;
+	EGLConfig configs[RENDER_POOL_MAX_CONFIGS];
+	struct render_worker workers[RENDER_POOL_MAX_WORKERS];
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int sleeping;
+
+	int count_parked;
+	struct render_thread_param *parked[RENDER_POOL_MAX_JOBS];
+};
+
+/*
+ * The surfaces must be set up already, all in the share group of the
+ * context of prms[0] so that they share their GL objects.
+ */
+struct render_pool *render_pool_create (struct render_thread_param *prms, int count_prms,
+		int count_workers, struct thread_sched *sched);
+int render_pool_start (struct render_pool *pool);
+
+#endif /*__RENDER_POOL_H__*/
@@ -1,14 +1,84 @@
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 
 #include <EGL/egl.h>
+#include <GLES2/gl2.h>
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+#include <gbm/gbm.h>
+#endif
 
 #include "render_thread.h"
+#ifdef USE_FAKEKMS
+#include "fake_kms.h"
+#endif
+#include "startup.h"
+#include "trace.h"
+
+#define FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
+		((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+static const struct render_format formats[] = {
+	{ "rgb565", FOURCC('R', 'G', '1', '6'), 5, 6, 5, 0, 2 },
+	{ "xrgb8888", FOURCC('X', 'R', '2', '4'), 8, 8, 8, 0, 4 },
+	{ "argb8888", FOURCC('A', 'R', '2', '4'), 8, 8, 8, 8, 4 },
+};
+
+const struct render_format *render_format_parse (const char *name)
+{
+	unsigned int count;
+
+	for(count = 0; count < sizeof(formats) / sizeof(formats[0]); count++)
+		if(strcmp(name, formats[count].name) == 0)
+			return &formats[count];
+
+	printf("unknown format %s, use rgb565, xrgb8888 or argb8888\n", name);
+	return NULL;
+}
+
+static int config_attrib (EGLDisplay display, EGLConfig config, EGLint attrib)
+{
+	EGLint value = 0;
+
+	eglGetConfigAttrib(display, config, attrib, &value);
+
+	return value;
+}
+
+/*
+ * eglChooseConfig sorts deeper colors first, so the first config is
+ * 8888 even when 565 is asked for. Take the first one that is exactly
+ * the format: same native visual where the driver sets one (GBM), the
+ * same channel sizes otherwise (pbuffers, Wayland).
+ */
+static EGLConfig choose_config (struct render_thread_param *prm, const EGLint *attribs)
+{
+	const struct render_format *format = prm->format;
+	EGLConfig configs[64];
+	EGLint n, count, id;
+
+	if (!eglChooseConfig(prm->display, attribs, configs, 64, &n))
+		return NULL;
+
+	for(count = 0; count < n; count++) {
+		id = config_attrib(prm->display, configs[count], EGL_NATIVE_VISUAL_ID);
+		if(id && (uint32_t)id == format->fourcc)
+			return configs[count];
+		if(!id && config_attrib(prm->display, configs[count], EGL_RED_SIZE) == format->red &&
+				config_attrib(prm->display, configs[count], EGL_GREEN_SIZE) == format->green &&
+				config_attrib(prm->display, configs[count], EGL_BLUE_SIZE) == format->blue &&
+				config_attrib(prm->display, configs[count], EGL_ALPHA_SIZE) == format->alpha)
+			return configs[count];
+	}
+
+	return NULL;
+}
 
 int setup_render_thread (struct render_thread_param *prm)
 {
 	EGLConfig config;
-	EGLint major, minor, n;
+	EGLint major, minor;
+	unsigned long long t0 = stats_now_nsec(), t1;
 	int ret;
 
 	EGLint context_attribs[] = {
@@ -17,17 +87,36 @@ int setup_render_thread (struct render_thread_param *prm)
 	};
 
 	EGLint config_attribs[] = {
+#if defined(USE_HEADLESS) || defined(USE_FAKEKMS)
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+#else
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
-		EGL_RED_SIZE, 1,
-		EGL_GREEN_SIZE, 1,
-		EGL_BLUE_SIZE, 1,
-		EGL_ALPHA_SIZE, 0,
-		EGL_DEPTH_SIZE, 8,
+#endif
+		EGL_RED_SIZE, prm->format->red,
+		EGL_GREEN_SIZE, prm->format->green,
+		EGL_BLUE_SIZE, prm->format->blue,
+		EGL_ALPHA_SIZE, prm->format->alpha,
+		EGL_DEPTH_SIZE, prm->depth_size,
 		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
 		EGL_NONE
 	};
 
+#if defined(USE_HEADLESS) || defined(USE_FAKEKMS)
+	EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, prm->frame_width,
+		EGL_HEIGHT, prm->frame_height,
+		EGL_NONE
+	};
+#endif
+
+#if defined(USE_HEADLESS)
+	/* the surfaceless display is opened by the backend and passed in */
+#elif defined(USE_FAKEKMS)
+	/* the GBM surface has no memory, draw into a pbuffer instead */
+	prm->display = fake_kms_egl_display();
+#else
 	prm->display = eglGetDisplay((EGLNativeDisplayType)prm->dev);
+#endif
 
 	if (!eglInitialize(prm->display, &major, &minor)) {
 		printf("failed to initialize\n");
@@ -39,26 +128,57 @@ int setup_render_thread (struct render_thread_param *prm)
 		return -1;
 	}
 
-	if (!eglChooseConfig(prm->display, config_attribs, &config, 1, &n) || n != 1) {
-		printf("failed to choose config: %d\n", n);
+	config = choose_config(prm, config_attribs);
+	if (!config) {
+		printf("no EGL config for %s\n", prm->format->name);
 		return -1;
 	}
 
-	prm->context = eglCreateContext(prm->display, config,
-				EGL_NO_CONTEXT, context_attribs);
+	prm->config = config;
+	prm->depth_stencil_bits = config_attrib(prm->display, config, EGL_DEPTH_SIZE) +
+		config_attrib(prm->display, config, EGL_STENCIL_SIZE);
+	t1 = stats_now_nsec();
+	startup_record(STARTUP_EGL_INIT, t0);
+
+	/* a render pool hands in the context of its share group */
+	if (prm->context == EGL_NO_CONTEXT)
+		prm->context = eglCreateContext(prm->display, config,
+					prm->share_context, context_attribs);
 	if (prm->context == NULL) {
 		printf("failed to create context\n");
 		return -1;
 	}
 
+#if defined(USE_HEADLESS) || defined(USE_FAKEKMS)
+	prm->surface = eglCreatePbufferSurface(prm->display, config, pbuffer_attribs);
+#else
 	prm->surface = eglCreateWindowSurface(prm->display, config, prm->surf, NULL);
+#endif
 	if (prm->surface == EGL_NO_SURFACE) {
 		printf("failed to create egl surface\n");
 		return -1;
 	}
 
-	eglMakeCurrent(prm->display, prm->surface, prm->surface, prm->context);
-	
+	if (!eglMakeCurrent(prm->display, prm->surface, prm->surface, prm->context)) {
+		printf("failed to make the context current: 0x%x\n", eglGetError());
+		return -1;
+	}
+	startup_record(STARTUP_CONTEXT, t1);
+
+	if(prm->set_swap_interval) {
+		EGLint min = config_attrib(prm->display, config, EGL_MIN_SWAP_INTERVAL);
+		EGLint max = config_attrib(prm->display, config, EGL_MAX_SWAP_INTERVAL);
+		int interval = prm->swap_interval;
+
+		if(interval < min || interval > max) {
+			interval = interval < min ? min : max;
+			printf("swap interval %d not supported, using %d\n",
+					prm->swap_interval, interval);
+			prm->swap_interval = interval;
+		}
+		eglSwapInterval(prm->display, interval);
+	}
+
 	prm->render_priv_data = prm->render_priv_setup(prm);
 	if(!prm->render_priv_data) {
 		printf("failed to setup renderpriv\n");
@@ -67,23 +187,357 @@ int setup_render_thread (struct render_thread_param *prm)
 
 	eglMakeCurrent(prm->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 
+	if(prm->use_fences) {
+		const char *extensions = eglQueryString(prm->display, EGL_EXTENSIONS);
+
+		if(extensions && strstr(extensions, "EGL_ANDROID_native_fence_sync")) {
+			prm->create_sync = (PFNEGLCREATESYNCKHRPROC)
+				eglGetProcAddress("eglCreateSyncKHR");
+			prm->destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+				eglGetProcAddress("eglDestroySyncKHR");
+			prm->dup_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+				eglGetProcAddress("eglDupNativeFenceFDANDROID");
+		}
+#ifdef USE_FAKEKMS
+		if(!prm->dup_fence_fd) {
+			prm->create_sync = fake_kms_create_sync;
+			prm->destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+				eglGetProcAddress("eglDestroySyncKHR");
+			prm->dup_fence_fd = fake_kms_dup_fence_fd;
+		}
+#endif
+
+		if(!prm->create_sync || !prm->destroy_sync || !prm->dup_fence_fd) {
+			printf("EGL_ANDROID_native_fence_sync not supported, using implicit sync\n");
+			prm->use_fences = 0;
+		}
+	}
+
+	if(prm->render_priv_damage) {
+		const char *extensions = eglQueryString(prm->display, EGL_EXTENSIONS);
+
+		if(extensions && strstr(extensions, "EGL_KHR_partial_update")) {
+			prm->set_damage_region = (PFNEGLSETDAMAGEREGIONKHRPROC)
+				eglGetProcAddress("eglSetDamageRegionKHR");
+			prm->buffer_age = 1;
+		}
+		if(extensions && strstr(extensions, "EGL_EXT_buffer_age"))
+			prm->buffer_age = 1;
+
+		if(extensions && strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+			prm->swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+				eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+		else if(extensions && strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+			prm->swap_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)
+				eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+
+		if(!prm->buffer_age)
+			printf("no buffer age, every frame is redrawn in full\n");
+	}
+
+	if(frame_queue_init(&prm->queue, prm->surf))
+		return -1;
+
+	prm->render_width = prm->frame_width;
+	prm->render_height = prm->frame_height;
+	if(prm->dynres.budget_nsec && !prm->render_priv_resize) {
+		printf("the scene cannot change its size, no dynamic resolution\n");
+		prm->dynres.budget_nsec = 0;
+	}
+
+	prm->setup_nsec = stats_now_nsec() - t0;
+
 	return 0;
 }
 
-static void *render_thread (void *arg)
+int render_thread_can_render (struct render_thread_param *prm)
 {
-	struct render_thread_param *prm = arg;
+	unsigned int latched = __atomic_load_n(&prm->queue.latched, __ATOMIC_ACQUIRE);
 
-	eglMakeCurrent(prm->display, prm->surface, prm->surface, prm->context);
+	if(prm->max_frames_in_flight &&
+			prm->queue.produced - latched >= prm->max_frames_in_flight)
+		return 0;
 
-	while(1) {
-		int ret = prm->render_priv_render(prm->render_priv_data);
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	frame_queue_reclaim(&prm->queue);
+
+	/* every published buffer is locked until the compositor releases it */
+	if(prm->max_buffers && prm->queue.produced -
+			__atomic_load_n(&prm->queue.released, __ATOMIC_ACQUIRE) >= prm->max_buffers)
+		return 0;
+	if(!gbm_surface_has_free_buffers(prm->surf))
+		return 0;
+#endif
+
+	return 1;
+}
+
+/*
+ * Back-pressure: do not start a frame that could not be queued anyway.
+ * The fast path is lock free, the mutex is only taken to sleep.
+ */
+static void wait_for_buffer (struct render_thread_param *prm)
+{
+	unsigned long long t0;
+
+	if(render_thread_can_render(prm))
+		return;
+
+	t0 = stats_now_nsec();
+
+	TRACE_BEGIN("wait for buffer");
+	pthread_mutex_lock(&prm->queue.lock);
+	while(!render_thread_can_render(prm))
+		pthread_cond_wait(&prm->queue.cond, &prm->queue.lock);
+	pthread_mutex_unlock(&prm->queue.lock);
+	TRACE_END("wait for buffer");
+
+	stats_record(&prm->wait_time, stats_now_nsec() - t0);
+}
+
+/* EGL rectangles are x, y, width, height with the origin at the bottom left */
+static int egl_rects (struct render_thread_param *prm, struct damage_rect *rects,
+		int count, EGLint *out)
+{
+	int n;
+
+	for(n = 0; n < count; n++) {
+		out[4 * n + 0] = rects[n].x1;
+		out[4 * n + 1] = prm->frame_height - rects[n].y2;
+		out[4 * n + 2] = rects[n].x2 - rects[n].x1;
+		out[4 * n + 3] = rects[n].y2 - rects[n].y1;
+	}
 
-		if(ret != 0)
-			printf("renderpriv render returned %d\n", ret);
+	return count;
+}
+
+/*
+ * Ask the renderer what the next frame changes, and keep it from drawing
+ * anything but the stale part of the back buffer: this frame's damage plus
+ * the damage of the frames drawn since the buffer was last used.
+ */
+static void begin_damage (struct render_thread_param *prm, struct frame_damage *damage)
+{
+	EGLint rects[4 * FRAME_MAX_DAMAGE * RENDER_DAMAGE_HISTORY];
+	struct damage_rect box = { prm->frame_width, prm->frame_height, 0, 0 };
+	struct frame_damage *repaint[RENDER_DAMAGE_HISTORY];
+	EGLint age = 0;
+	int count, r, n = 0, full;
+
+	frame_damage_reset(damage);
+	prm->render_priv_damage(prm->render_priv_data, damage);
+
+	if(prm->buffer_age)
+		eglQuerySurface(prm->display, prm->surface, EGL_BUFFER_AGE_EXT, &age);
+
+	full = damage->full || age <= 0 || age > RENDER_DAMAGE_HISTORY ||
+		age - 1 > prm->count_damage_history;
+
+	repaint[0] = damage;
+	for(count = 1; !full && count < age; count++) {
+		repaint[count] = &prm->damage_history[count - 1];
+		full = repaint[count]->full;
+	}
+
+	if(!full) {
+		for(count = 0; count < age; count++) {
+			n += egl_rects(prm, repaint[count]->rects, repaint[count]->count, &rects[4 * n]);
+			for(r = 0; r < repaint[count]->count; r++) {
+				struct damage_rect *rect = &repaint[count]->rects[r];
+				if(rect->x1 < box.x1)
+					box.x1 = rect->x1;
+				if(rect->y1 < box.y1)
+					box.y1 = rect->y1;
+				if(rect->x2 > box.x2)
+					box.x2 = rect->x2;
+				if(rect->y2 > box.y2)
+					box.y2 = rect->y2;
+			}
+		}
+		if(box.x1 > box.x2 || box.y1 > box.y2)
+			box.x1 = box.x2 = box.y1 = box.y2 = 0;
+	}
+
+	memmove(&prm->damage_history[1], &prm->damage_history[0],
+			sizeof(prm->damage_history[0]) * (RENDER_DAMAGE_HISTORY - 1));
+	prm->damage_history[0] = *damage;
+	if(prm->count_damage_history < RENDER_DAMAGE_HISTORY)
+		prm->count_damage_history++;
+
+	if(full) {
+		glDisable(GL_SCISSOR_TEST);
+		return;
+	}
+
+	if(prm->set_damage_region)
+		prm->set_damage_region(prm->display, prm->surface, rects, n);
+
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(box.x1, prm->frame_height - box.y2, box.x2 - box.x1, box.y2 - box.y1);
+}
 
+static void swap_damage (struct render_thread_param *prm, struct frame_damage *damage)
+{
+	EGLint rects[4 * FRAME_MAX_DAMAGE];
+
+	/* no rectangles means the whole surface to EGL as well */
+	if(!prm->swap_with_damage || damage->full) {
 		eglSwapBuffers(prm->display, prm->surface);
+		return;
+	}
+
+	prm->swap_with_damage(prm->display, prm->surface, rects,
+			egl_rects(prm, damage->rects, damage->count, rects));
+}
+
+/* draw, swap and queue one frame, the context must be current */
+void render_thread_frame (struct render_thread_param *prm)
+{
+	unsigned long long start = stats_now_nsec(), t0, t1, t2;
+	EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+	struct gbm_bo *bo = NULL;
+	struct frame_damage damage;
+	struct frame frame;
+	int fence_fd = -1;
+	/* a dynamic resolution change redraws everything anyway */
+	int track_damage = prm->render_priv_damage && !prm->dynres.budget_nsec;
+
+	if(track_damage) {
+		begin_damage(prm, &damage);
+	} else {
+		frame_damage_reset(&damage);
+		damage.full = 1;
+
+		/* only the drawn part is shown, the clear can leave the rest alone */
+		if(prm->dynres.budget_nsec) {
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(0, 0, prm->render_width, prm->render_height);
+		} else {
+			glDisable(GL_SCISSOR_TEST);
+		}
+	}
+
+	t0 = stats_now_nsec();
+	TRACE_BEGIN("render");
+	int ret = prm->render_priv_render(prm->render_priv_data);
+	TRACE_END("render");
+
+	if(ret != 0)
+		printf("renderpriv render returned %d\n", ret);
+
+	t1 = stats_now_nsec();
+
+	if(prm->use_fences) {
+		static const EGLint fence_attribs[] = {
+			EGL_SYNC_NATIVE_FENCE_FD_ANDROID, EGL_NO_NATIVE_FENCE_FD_ANDROID,
+			EGL_NONE
+		};
+
+		sync = prm->create_sync(prm->display,
+				EGL_SYNC_NATIVE_FENCE_ANDROID, fence_attribs);
+	}
+
+	TRACE_BEGIN("swap");
+#if defined(USE_HEADLESS) || defined(USE_FAKEKMS)
+	/*
+	 * Swapping a pbuffer is a no-op, so wait for the frame to
+	 * finish to keep the frame count honest.
+	 */
+	glFinish();
+#endif
+	swap_damage(prm, &damage);
+	TRACE_END("swap");
+	t2 = stats_now_nsec();
+
+	/* the swap flushed the fence, so it has a fd now */
+	if(sync != EGL_NO_SYNC_KHR) {
+		fence_fd = prm->dup_fence_fd(prm->display, sync);
+		prm->destroy_sync(prm->display, sync);
+	}
+
+#if !defined(USE_WAYLAND) && !defined(USE_HEADLESS)
+	TRACE_BEGIN("lock front buffer");
+	bo = gbm_surface_lock_front_buffer(prm->surf);
+	TRACE_END("lock front buffer");
+#endif
+	if(!prm->queue.produced)
+		startup_record(STARTUP_FIRST_FRAME, start);
+	frame.bo = bo;
+	frame.fence_fd = fence_fd;
+	frame.damage = damage;
+	frame.width = prm->render_width;
+	frame.height = prm->render_height;
+	frame.start_nsec = start;
+	frame_queue_publish(&prm->queue, &frame);
+
+	stats_record(&prm->render_time, t1 - t0);
+	stats_record(&prm->swap_time, t2 - t1);
+	if(track_damage)
+		stats_record_value(&prm->damage_ratio,
+				frame_damage_permille(&damage, prm->frame_width, prm->frame_height));
+
+	if(prm->dynres.budget_nsec) {
+		stats_record_value(&prm->render_scale, prm->dynres.scale);
+		if(dynres_update(&prm->dynres, t2 - t0)) {
+			prm->render_width = dynres_size(&prm->dynres, prm->frame_width);
+			prm->render_height = dynres_size(&prm->dynres, prm->frame_height);
+			prm->render_priv_resize(prm->render_priv_data,
+					prm->render_width, prm->render_height);
+		}
+	}
+}
+
+void *render_share_lock (struct render_thread_param *prm)
+{
+	if(!prm->share)
+		return NULL;
+
+	pthread_mutex_lock(&prm->share->lock);
+
+	return prm->share->shared ? prm->share->objects : NULL;
+}
+
+void render_share_unlock (struct render_thread_param *prm, void *objects, size_t bytes)
+{
+	struct render_share *share = prm->share;
 
+	if(!share)
+		return;
+
+	if(share->shared && share->objects && share->objects == objects) {
+		share->reused_bytes += bytes;
+	} else {
+		share->created_bytes += bytes;
+		if(share->shared)
+			share->objects = objects;
+	}
+
+	pthread_mutex_unlock(&share->lock);
+}
+
+static void *render_thread (void *arg)
+{
+	struct render_thread_param *prm = arg;
+
+	if(prm->sched)
+		thread_sched_apply(prm->sched, prm->index);
+	thread_sched_track("thread %d", prm->index);
+
+	if(prm->start_barrier) {
+		if(prm->surface == EGL_NO_SURFACE)
+			prm->setup_result = setup_render_thread(prm);
+		/* once the setup is done, once more for the first frame */
+		pthread_barrier_wait(prm->start_barrier);
+		pthread_barrier_wait(prm->start_barrier);
+		if(prm->setup_result)
+			return NULL;
+	}
+
+	eglMakeCurrent(prm->display, prm->surface, prm->surface, prm->context);
+
+	while(1) {
+		wait_for_buffer(prm);
+		render_thread_frame(prm);
 	}
 }
 
@@ -2,28 +2,179 @@
 #define __RENDER_THREAD__
 
 #include <EGL/egl.h>
-#include <gbm/gbm.h>
+#include <EGL/eglext.h>
+#include <stdint.h>
 #include <pthread.h>
 
+#include "stats.h"
+#include "frame_queue.h"
+#include "thread_sched.h"
+#include "dynres.h"
+
+struct gbm_device;
+struct gbm_surface;
+
+/* color formats a surface can have, fourcc is the GBM/DRM format */
+struct render_format {
+	const char *name;
+	uint32_t fourcc;
+	int red, green, blue, alpha;
+	int bytes_per_pixel;
+};
+
+/* rgb565, xrgb8888 or argb8888, NULL for anything else */
+const struct render_format *render_format_parse (const char *name);
+
+/* damage of this many previous frames is kept for the buffer age */
+#define RENDER_DAMAGE_HISTORY (4)
+
+/*
+ * GL objects (programs, buffers, textures) that a scene creates once and
+ * every later surface of the same share group reuses. Without sharing
+ * each surface creates its own; the byte counts are kept either way.
+ */
+struct render_share {
+	pthread_mutex_t lock;
+	int shared;		/* the contexts are in one share group */
+	void *objects;		/* scene specific, created by the first setup */
+	size_t created_bytes;
+	size_t reused_bytes;
+};
+
 struct render_thread_param {
 	struct gbm_device *dev;
 	struct gbm_surface *surf;
 	EGLDisplay display;		
-	EGLContext context;
+	EGLConfig config;
+	EGLContext context;	/* created by setup unless set before */
+	EGLContext share_context;	/* for the context setup creates */
+	struct render_share *share;	/* or NULL */
 	EGLSurface surface;
 
 
 	unsigned int frame_width;
 	unsigned int frame_height;
 
+	/*
+	 * The EGL config has exactly this color format, its native visual
+	 * matches the GBM surface. Depth (and no stencil) only if the scene
+	 * asks for it with depth_size; depth_stencil_bits is what the config
+	 * setup picked really has.
+	 */
+	const struct render_format *format;
+	int depth_size;
+	int depth_stencil_bits;
+
+	/*
+	 * Dynamic resolution, off unless dynres_init gave it a budget. Only
+	 * the bottom left render_width x render_height of the buffer is
+	 * drawn, and render_priv_resize tells the scene about every change.
+	 * Every frame is fully damaged then.
+	 */
+	struct dynres dynres;
+	unsigned int render_width;
+	unsigned int render_height;
+
+	/* scene settings, see gl_cubes.h and gl_mesh.h */
+	int num_objects;
+	int no_instancing;
+	int mesh_layout;	/* enum mesh_layout of gl_mesh.h */
+	int mesh_repeat;	/* draws of the mesh per frame, 0 for one */
+
+	int index;
+	struct thread_sched *sched;	/* applied by the render thread, or NULL */
+
+	/*
+	 * With a start barrier, the render thread runs setup_render_thread
+	 * itself unless the surface already exists, and waits on the barrier
+	 * twice: when the setup is done, with its result in setup_result, and
+	 * before the first frame. A thread whose setup failed exits then.
+	 */
+	pthread_barrier_t *start_barrier;
+	int setup_result;
+	unsigned long long setup_nsec;
+
+	struct frame_queue queue;
+
+	/*
+	 * Swapped frames the compositor has not latched yet before the
+	 * render thread waits, 0 for no limit. GBM surfaces also wait for a
+	 * free buffer in any case.
+	 */
+	unsigned int max_frames_in_flight;
+
+	/*
+	 * GBM buffers of the surface the render thread may use, 2 for double
+	 * buffering, 0 for as many as GBM has. Buffers still held by the
+	 * compositor, on screen or queued, count against it, so fewer buffers
+	 * mean less render-to-scanout latency but more waiting.
+	 */
+	unsigned int max_buffers;
+
+	/*
+	 * eglSwapInterval for the surface when set_swap_interval is set,
+	 * clamped to what the config allows. GBM and pbuffer surfaces are
+	 * not paced by EGL, the limits above do that for them.
+	 */
+	int set_swap_interval;
+	int swap_interval;
+
+	/*
+	 * Export an EGL_ANDROID_native_fence_sync fd with every frame.
+	 * Cleared by setup_render_thread if the driver cannot do it.
+	 */
+	int use_fences;
+	PFNEGLCREATESYNCKHRPROC create_sync;
+	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+	PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_fence_fd;
+
+	/*
+	 * Damage tracking, filled in by setup_render_thread. Only the stale
+	 * part of the back buffer is redrawn when the buffer age is known,
+	 * and the damage goes to EGL_KHR_partial_update and
+	 * EGL_KHR_swap_buffers_with_damage when the driver has them.
+	 */
+	int buffer_age;
+	PFNEGLSETDAMAGEREGIONKHRPROC set_damage_region;
+	PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_with_damage;
+	struct frame_damage damage_history[RENDER_DAMAGE_HISTORY];	/* newest first */
+	int count_damage_history;
+
+	/* written by the render thread only */
+	struct stats_hist render_time;
+	struct stats_hist swap_time;
+	struct stats_hist wait_time;
+	struct stats_hist damage_ratio;
+	struct stats_hist render_scale;
+
 	void *render_priv_data;
 	void *(*render_priv_setup) (struct render_thread_param *prm);
 	int (*render_priv_render) (void *priv);
+	/*
+	 * Optional, called before render_priv_render with what the next frame
+	 * is going to change. Without it every frame is fully damaged.
+	 */
+	void (*render_priv_damage) (void *priv, struct frame_damage *damage);
+	/* draw width x height from the bottom left from the next frame on */
+	void (*render_priv_resize) (void *priv, unsigned int width, unsigned int height);
 
 };
 
 int setup_render_thread (struct render_thread_param *prm);
 
+/* -1 if the thread could not be created */
 pthread_t start_render_thread (struct render_thread_param *prm);
 
+/*
+ * For render_priv_setup: the objects of the share group, with the share
+ * locked, or NULL if the caller has to create them. Always followed by
+ * render_share_unlock with what the setup uses and the bytes it takes.
+ */
+void *render_share_lock (struct render_thread_param *prm);
+void render_share_unlock (struct render_thread_param *prm, void *objects, size_t bytes);
+
+/* for running frames from somewhere else than a render thread, see render_pool.h */
+int render_thread_can_render (struct render_thread_param *prm);
+void render_thread_frame (struct render_thread_param *prm);
+
 #endif /*__RENDER_THREAD__*/
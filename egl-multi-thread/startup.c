@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "startup.h"
+#include "stats.h"
+
+struct startup_entry {
+	unsigned long count;
+	unsigned long long sum_nsec;
+	unsigned long long first_nsec;	/* 0 until the phase has been recorded */
+	unsigned long long last_nsec;
+};
+
+static const char *phase_names[STARTUP_NUM_PHASES] = {
+	[STARTUP_DRM_OPEN] = "drm open/master",
+	[STARTUP_RESOURCES] = "drm resources",
+	[STARTUP_GBM_SURFACE] = "gbm surfaces",
+	[STARTUP_EGL_INIT] = "egl init",
+	[STARTUP_CONTEXT] = "egl context/surface",
+	[STARTUP_SHADERS] = "shader programs",
+	[STARTUP_FIRST_FRAME] = "first frame",
+	[STARTUP_FIRST_COMMIT] = "first commit",
+};
+
+static struct startup_entry phases[STARTUP_NUM_PHASES];
+static unsigned long long origin_nsec;
+static double exec_msec = -1;
+static int done;
+
+/*
+ * The process start time is in clock ticks since boot, so the time spent
+ * before main (exec, the dynamic linker, library constructors) is only
+ * known to a tick, usually 10 ms.
+ */
+static double time_since_exec (void)
+{
+	unsigned long long start_ticks;
+	struct timespec now;
+	char buf[1024], *p;
+	size_t len;
+	int field;
+	FILE *f = fopen("/proc/self/stat", "r");
+
+	if(!f)
+		return -1;
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = 0;
+
+	/* the command name may contain anything, count fields after it */
+	p = strrchr(buf, ')');
+	for(field = 2; p && field < 22; field++)
+		p = strchr(p + 1, ' ');
+	if(!p || sscanf(p, " %llu", &start_ticks) != 1)
+		return -1;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6 -
+		start_ticks * 1e3 / sysconf(_SC_CLK_TCK);
+}
+
+void startup_init (void)
+{
+	origin_nsec = stats_now_nsec();
+	exec_msec = time_since_exec();
+}
+
+static void atomic_min (unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while((old == 0 || v < old) &&
+			!__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void atomic_max (unsigned long long *p, unsigned long long v)
+{
+	unsigned long long old = __atomic_load_n(p, __ATOMIC_RELAXED);
+
+	while(v > old &&
+			!__atomic_compare_exchange_n(p, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void startup_record (enum startup_phase phase, unsigned long long start_nsec)
+{
+	struct startup_entry *e = &phases[phase];
+	unsigned long long now = stats_now_nsec();
+
+	if(__atomic_load_n(&done, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_add_fetch(&e->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&e->sum_nsec, now - start_nsec, __ATOMIC_RELAXED);
+	atomic_min(&e->first_nsec, start_nsec);
+	atomic_max(&e->last_nsec, now);
+}
+
+void startup_done (const char *what)
+{
+	unsigned long long now = stats_now_nsec();
+	int count;
+
+	if(__atomic_exchange_n(&done, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	printf("startup profile, ms since main:\n");
+	printf("  %-24s %5s %9s %9s %9s\n", "phase", "count", "sum", "start", "end");
+	for(count = 0; count < STARTUP_NUM_PHASES; count++) {
+		struct startup_entry *e = &phases[count];
+
+		if(!e->count)
+			continue;
+		printf("  %-24s %5lu %9.3f %9.3f %9.3f\n", phase_names[count], e->count,
+				e->sum_nsec / 1e6, (e->first_nsec - origin_nsec) / 1e6,
+				(e->last_nsec - origin_nsec) / 1e6);
+	}
+	printf("  time to %s: %.3f ms", what, (now - origin_nsec) / 1e6);
+	if(exec_msec >= 0)
+		printf(", %.0f ms since exec", exec_msec + (now - origin_nsec) / 1e6);
+	printf("\n");
+}
@@ -0,0 +1,31 @@
+#ifndef __STARTUP_H__
+#define __STARTUP_H__
+
+/*
+ * Where the time to the first flip goes. Phases that run on several
+ * threads at once are counted once per thread; the report shows their
+ * summed time and the wall clock span from the first start to the last
+ * end, so overlapping phases show up as a span shorter than the sum.
+ */
+enum startup_phase {
+	STARTUP_DRM_OPEN,	/* open the card and become DRM master */
+	STARTUP_RESOURCES,	/* CRTC, connector, planes and their properties, GBM device */
+	STARTUP_GBM_SURFACE,	/* plane allocation and gbm_surface_create */
+	STARTUP_EGL_INIT,	/* display, eglInitialize and the config */
+	STARTUP_CONTEXT,	/* context and window surface */
+	STARTUP_SHADERS,	/* compile and link, or load from the program cache */
+	STARTUP_FIRST_FRAME,	/* first draw and swap of a surface */
+	STARTUP_FIRST_COMMIT,	/* first atomic commit to its flip event */
+	STARTUP_NUM_PHASES
+};
+
+/* time origin of the report, first thing in main */
+void startup_init (void);
+
+/* thread safe, ignored once startup_done has printed the report */
+void startup_record (enum startup_phase phase, unsigned long long start_nsec);
+
+/* print the report the first time it is called, what is the milestone reached */
+void startup_done (const char *what);
+
+#endif /*__STARTUP_H__*/
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_SUB_MASK ((1 << STATS_SUB_BITS) - 1)
+
+struct stats_entry {
+	char name[32];
+	int flags;
+	struct stats_hist *hist;
+
+	/* copy of hist at the previous windowed dump */
+	struct stats_hist last;
+};
+
+static struct stats_entry entries[STATS_MAX_ENTRIES];
+static int num_entries;
+static void (*dumps[STATS_MAX_DUMPS])(int total);
+static int num_dumps;
+static unsigned long long last_dump_nsec;
+static unsigned long long first_dump_nsec;
+
+unsigned long long stats_now_nsec(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((unsigned long long)t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+static int stats_bucket(unsigned long long usec)
+{
+	int msb;
+
+	if(usec <= STATS_SUB_MASK)
+		return usec;
+	if(usec > 0xffffffffULL)
+		usec = 0xffffffffULL;
+
+	msb = 31 - __builtin_clz((unsigned int)usec);
+
+	return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+		((usec >> (msb - STATS_SUB_BITS)) & STATS_SUB_MASK);
+}
+
+/* midpoint of a bucket in usec */
+static unsigned long long stats_bucket_value(int idx)
+{
+	int group = idx >> STATS_SUB_BITS;
+	unsigned long long sub = idx & STATS_SUB_MASK;
+
+	if(group == 0)
+		return sub;
+
+	return (((1 << STATS_SUB_BITS) + sub) << (group - 1)) +
+		((1ULL << (group - 1)) >> 1);
+}
+
+void stats_record(struct stats_hist *h, unsigned long long nsec)
+{
+	stats_record_value(h, nsec / 1000);
+}
+
+void stats_record_value(struct stats_hist *h, unsigned long long usec)
+{
+	unsigned long long min, max;
+	int b = stats_bucket(usec);
+
+	__atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum_usec, h->sum_usec + usec, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+
+	if(usec > h->max_usec)
+		__atomic_store_n(&h->max_usec, usec, __ATOMIC_RELAXED);
+	if(usec < h->min_usec)
+		__atomic_store_n(&h->min_usec, usec, __ATOMIC_RELAXED);
+
+	/* the reader resets the window bounds, so these need a CAS */
+	max = __atomic_load_n(&h->window_max_usec, __ATOMIC_RELAXED);
+	while(usec > max) {
+		if(__atomic_compare_exchange_n(&h->window_max_usec, &max, usec,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	min = __atomic_load_n(&h->window_min_usec, __ATOMIC_RELAXED);
+	while(usec < min) {
+		if(__atomic_compare_exchange_n(&h->window_min_usec, &min, usec,
+					0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+void stats_record_interval(struct stats_hist *h, unsigned long long nsec,
+		unsigned long long period_nsec)
+{
+	unsigned long long periods;
+
+	stats_record(h, nsec);
+
+	if(!period_nsec)
+		return;
+
+	periods = (nsec + period_nsec / 2) / period_nsec;
+	if(periods > 1)
+		__atomic_store_n(&h->missed, h->missed + periods - 1, __ATOMIC_RELAXED);
+}
+
+int stats_register(struct stats_hist *h, int flags, const char *fmt, ...)
+{
+	va_list args;
+	struct stats_entry *e;
+
+	if(num_entries == STATS_MAX_ENTRIES) {
+		printf("stats: too many entries\n");
+		return -1;
+	}
+
+	if(!first_dump_nsec)
+		first_dump_nsec = last_dump_nsec = stats_now_nsec();
+
+	e = &entries[num_entries++];
+	memset(e, 0, sizeof(*e));
+	e->hist = h;
+	e->flags = flags;
+
+	/* nothing recorded yet, the first value sets the minimum */
+	if(!h->count)
+		h->min_usec = h->window_min_usec = ~0ULL;
+
+	va_start(args, fmt);
+	vsnprintf(e->name, sizeof(e->name), fmt, args);
+	va_end(args);
+
+	return 0;
+}
+
+int stats_register_dump(void (*dump)(int total))
+{
+	if(num_dumps == STATS_MAX_DUMPS) {
+		printf("stats: too many dumps\n");
+		return -1;
+	}
+
+	dumps[num_dumps++] = dump;
+
+	return 0;
+}
+
+static void stats_snapshot(struct stats_hist *dst, struct stats_hist *src)
+{
+	int b;
+
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum_usec = __atomic_load_n(&src->sum_usec, __ATOMIC_RELAXED);
+	dst->min_usec = __atomic_load_n(&src->min_usec, __ATOMIC_RELAXED);
+	dst->max_usec = __atomic_load_n(&src->max_usec, __ATOMIC_RELAXED);
+	dst->missed = __atomic_load_n(&src->missed, __ATOMIC_RELAXED);
+	for(b = 0; b < STATS_HIST_BUCKETS; b++)
+		dst->buckets[b] = __atomic_load_n(&src->buckets[b], __ATOMIC_RELAXED);
+}
+
+/* the bucket midpoint, but never outside the values actually recorded */
+static unsigned long long stats_percentile(struct stats_hist *h,
+		unsigned long total, int pct,
+		unsigned long long min_usec, unsigned long long max_usec)
+{
+	unsigned long long want = ((unsigned long long)total * pct + 99) / 100;
+	unsigned long long seen = 0, value;
+	int b;
+
+	for(b = 0; b < STATS_HIST_BUCKETS; b++) {
+		seen += h->buckets[b];
+		if(seen >= want && seen) {
+			value = stats_bucket_value(b);
+			if(value > max_usec)
+				value = max_usec;
+			if(value < min_usec)
+				value = min_usec;
+			return value;
+		}
+	}
+
+	return 0;
+}
+
+static void stats_print(struct stats_entry *e, struct stats_hist *h,
+		unsigned long long min_usec, unsigned long long max_usec, double seconds)
+{
+	unsigned long total = 0;
+	const char *unit = "ms";
+	double scale = 1000.0;
+	int b;
+
+	for(b = 0; b < STATS_HIST_BUCKETS; b++)
+		total += h->buckets[b];
+
+	if(e->flags & STATS_PERMILLE) {
+		unit = "%";
+		scale = 10.0;
+	}
+
+	printf("  %-24s n=%6lu %8.1f/s avg=%7.3f%s p50=%7.3f%s p90=%7.3f%s p99=%7.3f%s max=%7.3f%s",
+			e->name, total, seconds > 0 ? total / seconds : 0.0,
+			total ? h->sum_usec / scale / total : 0.0, unit,
+			stats_percentile(h, total, 50, min_usec, max_usec) / scale, unit,
+			stats_percentile(h, total, 90, min_usec, max_usec) / scale, unit,
+			stats_percentile(h, total, 99, min_usec, max_usec) / scale, unit,
+			max_usec / scale, unit);
+	if(e->flags & STATS_VBLANK)
+		printf(" missed=%lu", h->missed);
+	printf("\n");
+}
+
+void stats_dump(int total)
+{
+	unsigned long long now = stats_now_nsec();
+	struct stats_hist cur, diff;
+	double seconds;
+	int count, b;
+
+	seconds = (now - (total ? first_dump_nsec : last_dump_nsec)) / 1e9;
+	printf("stats (%s %.2fs):\n", total ? "total" : "last", seconds);
+
+	for(count = 0; count < num_entries; count++) {
+		struct stats_entry *e = &entries[count];
+
+		stats_snapshot(&cur, e->hist);
+
+		if(total) {
+			stats_print(e, &cur, cur.min_usec, cur.max_usec, seconds);
+			continue;
+		}
+
+		diff.count = cur.count - e->last.count;
+		diff.sum_usec = cur.sum_usec - e->last.sum_usec;
+		diff.missed = cur.missed - e->last.missed;
+		for(b = 0; b < STATS_HIST_BUCKETS; b++)
+			diff.buckets[b] = cur.buckets[b] - e->last.buckets[b];
+
+		stats_print(e, &diff,
+				__atomic_exchange_n(&e->hist->window_min_usec, ~0ULL, __ATOMIC_RELAXED),
+				__atomic_exchange_n(&e->hist->window_max_usec, 0, __ATOMIC_RELAXED),
+				seconds);
+
+		memcpy(&e->last, &cur, sizeof(cur));
+	}
+
+	for(count = 0; count < num_dumps; count++)
+		dumps[count](total);
+
+	if(!total)
+		last_dump_nsec = now;
+}
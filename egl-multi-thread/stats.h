@@ -0,0 +1,59 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#define STATS_SUB_BITS (4)
+#define STATS_HIST_BUCKETS ((32 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+#define STATS_MAX_ENTRIES (320)
+#define STATS_MAX_DUMPS (8)
+
+/* stats_register flags */
+#define STATS_VBLANK (1 << 0)	/* print the missed vblank count */
+#define STATS_PERMILLE (1 << 1)	/* values are 1/1000 ratios, print percents */
+
+/*
+ * Log-linear histogram of durations with microsecond resolution and
+ * roughly 6% relative error.
+ *
+ * Every histogram has exactly one writer thread. The writer never does a
+ * read-modify-write that a reader could race with, and readers only load,
+ * so neither side ever takes a lock.
+ */
+struct stats_hist {
+	unsigned long count;
+	unsigned long long sum_usec;
+	unsigned long long min_usec;
+	unsigned long long max_usec;
+	unsigned long long window_min_usec;
+	unsigned long long window_max_usec;
+	unsigned long missed;
+	unsigned int buckets[STATS_HIST_BUCKETS];
+};
+
+unsigned long long stats_now_nsec(void);
+
+void stats_record(struct stats_hist *h, unsigned long long nsec);
+/* raw value in the histogram's unit, usec for durations */
+void stats_record_value(struct stats_hist *h, unsigned long long value);
+void stats_record_interval(struct stats_hist *h, unsigned long long nsec,
+		unsigned long long period_nsec);
+
+/*
+ * Registration is not thread safe, do it before starting the threads
+ * that write to the histogram.
+ */
+int stats_register(struct stats_hist *h, int flags, const char *fmt, ...);
+
+/*
+ * Extra report printed after the histograms by every stats_dump, for
+ * numbers that are not durations. Not thread safe either.
+ */
+int stats_register_dump(void (*dump)(int total));
+
+/*
+ * Print p50/p90/p99/max of every registered histogram. With total == 0 the
+ * numbers cover the time since the previous call, otherwise the whole run.
+ */
+void stats_dump(int total);
+
+#endif /*__STATS_H__*/
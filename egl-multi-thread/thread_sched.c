@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "thread_sched.h"
+#include "stats.h"
+
+struct tracked_thread {
+	char name[32];
+	pid_t tid;
+
+	/* counts at the previous windowed dump */
+	unsigned long migrations;
+	unsigned long voluntary;
+	unsigned long involuntary;
+};
+
+static struct tracked_thread tracked[THREAD_SCHED_MAX_TRACKED];
+static int num_tracked;
+static pthread_mutex_t tracked_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int parse_cpus (const char *list, uint64_t *cpus)
+{
+	char *end;
+
+	*cpus = 0;
+	while(*list && *list != ',') {
+		long first = strtol(list, &end, 10), last;
+
+		if(end == list)
+			return -1;
+		last = first;
+		if(*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if(end == list)
+				return -1;
+		}
+		if(first < 0 || last > 63 || first > last)
+			return -1;
+		for(; first <= last; first++)
+			*cpus |= 1ULL << first;
+
+		list = end;
+		if(*list == ':')
+			list++;
+	}
+
+	return *cpus ? 0 : -1;
+}
+
+static int parse_priority (const char *value, int policy)
+{
+	if(strcmp(value, "max") == 0)
+		return sched_get_priority_max(policy);
+
+	return atoi(value);
+}
+
+int thread_sched_parse (const char *spec, struct thread_sched *sched)
+{
+	char buf[128];
+	char *opt, *save;
+
+	memset(sched, 0, sizeof(*sched));
+	sched->policy = SCHED_OTHER;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for(opt = strtok_r(buf, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if(strncmp(opt, "cpus=", 5) == 0) {
+			if(parse_cpus(opt + 5, &sched->cpus))
+				goto invalid;
+		} else if(strcmp(opt, "spread") == 0) {
+			sched->spread = 1;
+		} else if(strncmp(opt, "fifo=", 5) == 0) {
+			sched->policy = SCHED_FIFO;
+			sched->priority = parse_priority(opt + 5, SCHED_FIFO);
+		} else if(strncmp(opt, "rr=", 3) == 0) {
+			sched->policy = SCHED_RR;
+			sched->priority = parse_priority(opt + 3, SCHED_RR);
+		} else if(strncmp(opt, "nice=", 5) == 0) {
+			sched->nice = atoi(opt + 5);
+			sched->set_nice = 1;
+		} else {
+			goto invalid;
+		}
+	}
+
+	if(sched->spread && !sched->cpus)
+		goto invalid;
+
+	return 0;
+
+invalid:
+	printf("invalid scheduling spec '%s'\n", spec);
+	return -1;
+}
+
+int thread_sched_apply (struct thread_sched *sched, int index)
+{
+	int ret = 0, err;
+
+	if(sched->cpus) {
+		cpu_set_t set;
+		int cpu, n = 0, pick = -1;
+
+		CPU_ZERO(&set);
+		if(sched->spread)
+			pick = index % __builtin_popcountll(sched->cpus);
+		for(cpu = 0; cpu < 64; cpu++) {
+			if(!(sched->cpus & (1ULL << cpu)))
+				continue;
+			if(pick < 0 || n == pick)
+				CPU_SET(cpu, &set);
+			n++;
+		}
+
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(err) {
+			printf("failed to set the CPU affinity: %s\n", strerror(err));
+			ret = -1;
+		}
+	}
+
+	if(sched->policy != SCHED_OTHER) {
+		struct sched_param param = { .sched_priority = sched->priority };
+
+		err = pthread_setschedparam(pthread_self(), sched->policy, &param);
+		if(err) {
+			printf("failed to set the scheduling policy: %s\n", strerror(err));
+			ret = -1;
+		}
+	}
+
+	/* the nice value is per thread on Linux */
+	if(sched->set_nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), sched->nice)) {
+		printf("failed to set nice %d\n", sched->nice);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static unsigned long read_proc_value (const char *path, const char *key)
+{
+	char line[256];
+	unsigned long value = 0;
+	FILE *f = fopen(path, "r");
+
+	if(!f)
+		return 0;
+
+	while(fgets(line, sizeof(line), f)) {
+		if(strncmp(line, key, strlen(key)) == 0) {
+			char *sep = strchr(line, ':');
+			if(sep)
+				value = strtoul(sep + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+
+	return value;
+}
+
+static void thread_sched_dump (int total)
+{
+	char path[64];
+	int count;
+
+	pthread_mutex_lock(&tracked_lock);
+	for(count = 0; count < num_tracked; count++) {
+		struct tracked_thread *t = &tracked[count];
+		unsigned long migrations, voluntary, involuntary;
+
+		snprintf(path, sizeof(path), "/proc/self/task/%d/sched", t->tid);
+		migrations = read_proc_value(path, "se.nr_migrations");
+		snprintf(path, sizeof(path), "/proc/self/task/%d/status", t->tid);
+		voluntary = read_proc_value(path, "voluntary_ctxt_switches");
+		involuntary = read_proc_value(path, "nonvoluntary_ctxt_switches");
+
+		printf("  %-24s migrations=%6lu voluntary=%8lu involuntary=%8lu\n", t->name,
+				migrations - (total ? 0 : t->migrations),
+				voluntary - (total ? 0 : t->voluntary),
+				involuntary - (total ? 0 : t->involuntary));
+
+		if(!total) {
+			t->migrations = migrations;
+			t->voluntary = voluntary;
+			t->involuntary = involuntary;
+		}
+	}
+	pthread_mutex_unlock(&tracked_lock);
+}
+
+void thread_sched_track (const char *fmt, ...)
+{
+	va_list args;
+	struct tracked_thread *t;
+
+	pthread_mutex_lock(&tracked_lock);
+
+	if(num_tracked == THREAD_SCHED_MAX_TRACKED) {
+		pthread_mutex_unlock(&tracked_lock);
+		printf("thread sched: too many threads\n");
+		return;
+	}
+
+	if(!num_tracked)
+		stats_register_dump(thread_sched_dump);
+
+	t = &tracked[num_tracked++];
+	memset(t, 0, sizeof(*t));
+	t->tid = syscall(SYS_gettid);
+
+	va_start(args, fmt);
+	vsnprintf(t->name, sizeof(t->name), fmt, args);
+	va_end(args);
+
+	/* for top, perf and the trace, cut to 15 characters by the kernel */
+	prctl(PR_SET_NAME, t->name);
+
+	pthread_mutex_unlock(&tracked_lock);
+}
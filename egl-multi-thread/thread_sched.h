@@ -0,0 +1,40 @@
+#ifndef __THREAD_SCHED_H__
+#define __THREAD_SCHED_H__
+
+#include <stdint.h>
+
+#define THREAD_SCHED_MAX_TRACKED (96)
+
+/* where and how a thread runs, everything 0 leaves the default */
+struct thread_sched {
+	uint64_t cpus;		/* affinity mask, bit n is CPU n */
+	int spread;		/* pin thread i to the i-th CPU of the mask only */
+	int policy;		/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int priority;		/* for SCHED_FIFO and SCHED_RR */
+	int nice;
+	int set_nice;
+};
+
+/*
+ * Comma separated list of
+ *   cpus=<list>    CPUs like 0-3,6 with ':' instead of ',' (cpus=0-3:6)
+ *   spread         one CPU of the list per thread, round robin
+ *   fifo=<prio>    SCHED_FIFO, "max" for the highest priority
+ *   rr=<prio>      SCHED_RR, "max" for the highest priority
+ *   nice=<n>
+ * Returns -1 on a malformed spec.
+ */
+int thread_sched_parse (const char *spec, struct thread_sched *sched);
+
+/* apply to the calling thread, index selects the CPU with spread */
+int thread_sched_apply (struct thread_sched *sched, int index);
+
+/*
+ * Report CPU migrations and voluntary/involuntary context switches of the
+ * calling thread with the stats, read from /proc/self/task. The first call
+ * registers with the stats, so it must come before any thread is started
+ * and is best done by main. Also names the thread after it.
+ */
+void thread_sched_track (const char *fmt, ...);
+
+#endif /*__THREAD_SCHED_H__*/
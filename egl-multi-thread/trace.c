@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "stats.h"
+
+struct trace_record {
+	unsigned long long nsec;
+	const char *name;
+	char phase;
+};
+
+/*
+ * Single writer, the thread that owns it. head only grows and is
+ * published after the record is written, tail is only touched by
+ * trace_write.
+ */
+struct trace_ring {
+	struct trace_ring *next;
+	pid_t tid;
+	char name[16];
+	unsigned long head;
+	unsigned long tail;
+	struct trace_record records[TRACE_RING_EVENTS];
+};
+
+int trace_enabled;
+
+static struct trace_ring *rings;	/* pushed to with a CAS, never removed */
+static __thread struct trace_ring *thread_ring;
+
+static struct trace_ring *ring_create (void)
+{
+	struct trace_ring *ring = calloc(1, sizeof(*ring));
+
+	if(!ring)
+		return NULL;
+
+	ring->tid = syscall(SYS_gettid);
+	prctl(PR_GET_NAME, ring->name);
+
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return ring;
+}
+
+void trace_event (const char *name, char phase)
+{
+	struct trace_ring *ring = thread_ring;
+	struct trace_record *r;
+
+	if(!ring) {
+		ring = thread_ring = ring_create();
+		if(!ring) {
+			printf("trace: no memory for the ring buffer\n");
+			__atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	r = &ring->records[ring->head % TRACE_RING_EVENTS];
+	r->nsec = stats_now_nsec();
+	r->name = name;
+	r->phase = phase;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_set_enabled (int enable)
+{
+	__atomic_store_n(&trace_enabled, enable, __ATOMIC_RELAXED);
+}
+
+int trace_write (const char *path)
+{
+	struct trace_ring *ring;
+	unsigned long written = 0;
+	int pid = getpid();
+	FILE *f = fopen(path, "w");
+
+	if(!f) {
+		printf("trace: cannot write %s\n", path);
+		return -1;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"egl_multi_layer\"}}", pid);
+
+	for(ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned long i = ring->tail;
+		int started = 0;
+
+		if(head - i > TRACE_RING_EVENTS)
+			i = head - TRACE_RING_EVENTS;
+
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", pid, ring->tid, ring->name);
+
+		/* microseconds with nanosecond digits */
+		for(; i != head; i++) {
+			struct trace_record *r = &ring->records[i % TRACE_RING_EVENTS];
+
+			/* ends of spans that began before the oldest record */
+			if(!started && r->phase == 'E')
+				continue;
+			started = 1;
+
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu}",
+					r->name, r->phase, pid, ring->tid,
+					r->nsec / 1000, r->nsec % 1000);
+			written++;
+		}
+		ring->tail = head;
+	}
+
+	fprintf(f, "\n]}\n");
+	if(fclose(f)) {
+		printf("trace: cannot write %s\n", path);
+		return -1;
+	}
+
+	printf("trace: %lu events written to %s\n", written, path);
+
+	return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#define TRACE_RING_EVENTS (1 << 15)	/* per thread, the oldest are overwritten */
+
+/*
+ * Begin/end spans of every thread, written to a Chrome trace event JSON
+ * file that chrome://tracing and ui.perfetto.dev open.
+ *
+ * Every thread that records gets its own ring buffer on its first event,
+ * so recording takes no lock and is a relaxed load when tracing is off.
+ * Names must be string literals, only the pointer is kept. Thread names
+ * come from the kernel, see thread_sched_track.
+ */
+extern int trace_enabled;
+
+#define TRACE_BEGIN(name) do { \
+	if(__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) \
+		trace_event(name, 'B'); \
+} while(0)
+
+#define TRACE_END(name) do { \
+	if(__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)) \
+		trace_event(name, 'E'); \
+} while(0)
+
+void trace_event (const char *name, char phase);
+
+/* start or stop recording, from any thread */
+void trace_set_enabled (int enable);
+
+/*
+ * Write the events recorded since the previous trace_write and forget
+ * them. Stop recording first, a thread still recording may overwrite
+ * the oldest events while they are written otherwise.
+ * Returns -1 if the file cannot be written.
+ */
+int trace_write (const char *path);
+
+#endif /*__TRACE_H__*/